@@ -62,13 +62,104 @@ void pit_x264_logger(void *priv, int level, const char *fmt, va_list ap)
         pit_vlog(lv, __func__, 0, fmt, ap);
 }
 
+static int pit_x264_log_level(void)
+{
+	switch (pit_get_log_level()) {
+	case PIT_TRACE:
+		return X264_LOG_DEBUG;
+	case PIT_DEBUG:
+	case PIT_INFO:
+		return X264_LOG_INFO;
+	case PIT_WARN:
+		return X264_LOG_WARNING;
+	default:
+		return X264_LOG_ERROR;
+	}
+}
+
+void avcenc_params_init(struct avcenc_params *params)
+{
+	memset(params, '\0', sizeof(*params));
+	strcpy(params->preset, AVCENC_DEFAULT_PRESET);
+	strcpy(params->tune, AVCENC_DEFAULT_TUNE);
+	params->rc = AVCENC_RC_DEFAULT;
+	params->lookahead = -1;
+}
+
+static int name_in(const char *name, size_t len, const char * const *names)
+{
+	for (; *names; names++) {
+		if (strlen(*names) == len && !strncmp(*names, name, len)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int avcenc_params_preset(struct avcenc_params *params, const char *str)
+{
+	const char *tune, *p, *end;
+	size_t len;
+
+	if (!params || !str) {
+		return EINVAL;
+	}
+
+	if (!(tune = strchr(str, ':'))) {
+		tune = str + strlen(str);
+	}
+
+	len = tune - str;
+
+	if (!name_in(str, len, x264_preset_names) ||
+			len >= sizeof(params->preset)) {
+		return EINVAL;
+	}
+
+	if (*tune == ':') {
+		tune++;
+
+		if (strlen(tune) >= sizeof(params->tune)) {
+			return EINVAL;
+		}
+
+		for (p = tune; *p; p = *end ? end + 1 : end) {
+			if (!(end = strchr(p, ','))) {
+				end = p + strlen(p);
+			}
+
+			if (!name_in(p, end - p, x264_tune_names)) {
+				return EINVAL;
+			}
+		}
+	}
+
+	memcpy(params->preset, str, len);
+	params->preset[len] = '\0';
+
+	if (*tune) {
+		strcpy(params->tune, tune);
+	}
+
+	return 0;
+}
+
 struct avcenc_session *avcenc_session_new(const char *profile,
-		struct pit_dim *size, struct pit_frac *frame_rate)
+		struct pit_dim *size, struct pit_frac *frame_rate,
+		enum i420_matrix matrix, enum i420_range range,
+		const struct avcenc_params *params)
 {
 	int rc;
 	struct avcenc_session *session = NULL;
+	struct avcenc_params defaults;
 	x264_param_t *param;
 
+	if (!params) {
+		avcenc_params_init(&defaults);
+		params = &defaults;
+	}
+
 	if (!(session = calloc(1, sizeof(*session)))) {
 		rc = errno ? errno : -1;
 		error("calloc: %s", strerror(rc));
@@ -81,8 +172,10 @@ struct avcenc_session *avcenc_session_new(const char *profile,
 
 	x264_param_default(param);
 
-	if ((rc = x264_param_default_preset(param, "veryslow", "film"))) {
-		warn("failed to apply preset: %s", strerror(rc));
+	if ((rc = x264_param_default_preset(param, params->preset,
+			*params->tune ? params->tune : NULL))) {
+		warn("failed to apply preset '%s' tuned for '%s'",
+				params->preset, params->tune);
 	}
 
 	param->i_csp = X264_CSP_I420;
@@ -92,19 +185,35 @@ struct avcenc_session *avcenc_session_new(const char *profile,
 	param->i_fps_den = param->i_timebase_num = frame_rate->den;
 
 	param->b_annexb = 1;
-	param->i_threads = 8;
+	param->i_threads = params->threads ? params->threads : X264_THREADS_AUTO;
+	param->b_sliced_threads = params->sliced_threads;
+
+	switch (params->rc) {
+	case AVCENC_RC_CRF:
+		param->rc.i_rc_method = X264_RC_CRF;
+		param->rc.f_rf_constant = params->quality;
+		break;
+	case AVCENC_RC_QP:
+		param->rc.i_rc_method = X264_RC_CQP;
+		param->rc.i_qp_constant = (int) params->quality;
+		break;
+	default:
+		break;
+	}
 
-//        param->rc.i_lookahead = 0;
-//        param->i_sync_lookahead = 0;
-//        param->i_bframe = 0;
-//        param->b_sliced_threads = 1;
-//        param->b_vfr_input = 0;
-//        param->rc.b_mb_tree = 0;
+	if (params->keyint > 0) {
+		param->i_keyint_max = params->keyint;
+	}
 
-//        param->i_keyint_max = frame_rate->num * 10 / frame_rate->den;
+	if (params->lookahead >= 0) {
+		param->rc.i_lookahead = params->lookahead;
+	}
 
-//        param->rc.i_rc_method = X264_RC_CQP;
-//        param->rc.i_qp_constant = quality;
+	/* signal how jpg2avc converted the pictures: smpte170m or bt709 */
+	param->vui.i_colorprim = matrix == I420_BT709 ? 1 : 6;
+	param->vui.i_transfer = matrix == I420_BT709 ? 1 : 6;
+	param->vui.i_colmatrix = matrix == I420_BT709 ? 1 : 6;
+	param->vui.b_fullrange = range == I420_FULL;
 
 	if ((rc = x264_param_apply_profile(param, profile))) {
 		warn("failed to apply profile '%s': %s", profile, strerror(rc));
@@ -113,7 +222,7 @@ struct avcenc_session *avcenc_session_new(const char *profile,
 	/* log redirect */
 
 	param->pf_log = pit_x264_logger;
-	param->i_log_level = X264_LOG_DEBUG;
+	param->i_log_level = pit_x264_log_level();
 
 	if (!(session->x264.encoder = x264_encoder_open(param))) {
 		rc = errno ? errno : -1;
@@ -125,10 +234,11 @@ struct avcenc_session *avcenc_session_new(const char *profile,
 
 finally:
 	if (rc != 0) {
-		if (!session) {
+		if (session) {
 			avcenc_session_free(session);
 			session = NULL;
 		}
+		errno = rc;
 	}
 	return session;
 }
@@ -153,15 +263,44 @@ void avcenc_session_set_cb(struct avcenc_session *session,
 	session->cbarg = cbarg;
 }
 
+static int avcenc_session_emit(struct avcenc_session *session,
+		x264_nal_t *nals, int num_nals, int len, x264_picture_t *pic)
+{
+	int rc, i;
+	struct avcenc_frame frame;
+
+	if (num_nals == 0) {
+		return EAGAIN;
+	}
+
+	for (i = 0; i < num_nals; i++) {
+		trace("emitting nal[%d]: %d (%d bytes)", i,
+				0x1f & *(nals[i].p_payload + 4), nals[i].i_payload);
+	}
+
+	/* x264 lays the NALs of one frame out back to back */
+	frame.data = nals[0].p_payload;
+	frame.len = len;
+	frame.keyframe = pic->b_keyframe;
+	frame.pts = pic->i_pts;
+	frame.dts = pic->i_dts;
+
+	if (session->cb && (rc = (*session->cb)(session, &frame,
+			session->cbarg))) {
+		error("failed to emit frame: %s", strerror(rc));
+		return rc;
+	}
+
+	return 0;
+}
+
 int avcenc_session_encode(struct avcenc_session *session,
-		const unsigned char *data, const char *outfile)
+		const unsigned char *data)
 {
-        int rc;
-        x264_nal_t *nals, *nal = NULL;
-        int num_nals, i;
+        int rc, len;
+        x264_nal_t *nals;
+        int num_nals;
         x264_picture_t input, output;
-        FILE *file = NULL;
-        size_t n;
 
         if (!session || !data) {
                 rc = EINVAL;
@@ -191,48 +330,16 @@ int avcenc_session_encode(struct avcenc_session *session,
         input.param = NULL;
         input.i_pts = session->x264.pts++;
 
-        if (x264_encoder_encode(session->x264.encoder, &nals, &num_nals,
-                        &input, &output) < 0) {
+        if ((len = x264_encoder_encode(session->x264.encoder, &nals, &num_nals,
+                        &input, &output)) < 0) {
                 rc = errno ? errno : -1;
                 error("failed to encode: %s", strerror(rc));
                 goto finally;
         }
 
-        if (num_nals != 0) {
-                if (!(file = fopen(outfile, "w+"))) {
-                        rc = errno ? errno : -1;
-                        error("fopen: %s", strerror(rc));
-                        goto finally;
-                }
-
-                trace("writing %d NALUs to %s", num_nals, outfile);
-
-                for (i = 0; i < num_nals; i++) {
-                        nal = nals + i;
-
-                        if (session->cb) {
-                        	(*session->cb)(session, nal->p_payload,
-                        			nal->i_payload, session->cbarg);
-                        }
-
-                        trace("writing nal[%d]: %d", i, 0x1f & *(nal->p_payload + 4));
-
-                        if ((n = fwrite(nal->p_payload, 1, nal->i_payload,
-                        		file)) != nal->i_payload) {
-                        	rc = errno ? errno : -1;
-                        	error("fwrite: %s", strerror(rc));
-                        	goto finally;
-                        }
-                }
-                rc = 0;
-        } else {
-        	rc = EAGAIN;
-        }
+        rc = avcenc_session_emit(session, nals, num_nals, len, &output);
 
 finally:
-	if (file) {
-		fclose(file);
-	}
         return rc;
 }
 
@@ -241,14 +348,12 @@ int avcenc_session_pending_frames(struct avcenc_session *session)
 	return x264_encoder_delayed_frames(session->x264.encoder);
 }
 
-int avcenc_session_flush(struct avcenc_session *session, const char *outfile)
+int avcenc_session_flush(struct avcenc_session *session)
 {
-        int rc;
-        x264_nal_t *nals, *nal = NULL;
-        int num_nals, i;
+        int rc, len;
+        x264_nal_t *nals;
+        int num_nals;
         x264_picture_t output;
-        FILE *file = NULL;
-        size_t n;
 
         if (!session) {
                 rc = EINVAL;
@@ -258,47 +363,15 @@ int avcenc_session_flush(struct avcenc_session *session, const char *outfile)
 
         x264_picture_init(&output);
 
-	if (x264_encoder_encode(session->x264.encoder, &nals, &num_nals,
-			NULL, &output) < 0) {
+	if ((len = x264_encoder_encode(session->x264.encoder, &nals, &num_nals,
+			NULL, &output)) < 0) {
 		rc = errno ? errno : -1;
 		error("failed to encode: %s", strerror(rc));
 		goto finally;
 	}
 
-	if (num_nals != 0) {
-		if (!(file = fopen(outfile, "w+"))) {
-			rc = errno ? errno : -1;
-			error("fopen: %s", strerror(rc));
-			goto finally;
-		}
-
-		trace("writing %d NALUs to %s", num_nals, outfile);
-
-		for (i = 0; i < num_nals; i++) {
-			nal = nals + i;
-
-			if (session->cb) {
-				(*session->cb)(session, nal->p_payload,
-						nal->i_payload, session->cbarg);
-			}
-
-			trace("writing nal[%d]: %d", i, 0x1f & *(nal->p_payload + 4));
-
-			if ((n = fwrite(nal->p_payload, 1, nal->i_payload,
-					file)) != nal->i_payload) {
-				rc = errno ? errno : -1;
-				error("fwrite: %s", strerror(rc));
-				goto finally;
-			}
-		}
-	        rc = 0;
-       } else {
-        	rc = EAGAIN;
-	}
+	rc = avcenc_session_emit(session, nals, num_nals, len, &output);
 
 finally:
-	if (file) {
-		fclose(file);
-	}
         return rc;
 }
@@ -18,15 +18,54 @@
 #ifndef AVCENC_H_
 #define AVCENC_H_
 
+#include <stdint.h>
+
 #include "common.h"
+#include "i420.h"
+
+#define AVCENC_DEFAULT_PRESET "veryslow"
+#define AVCENC_DEFAULT_TUNE "film"
+
+enum avcenc_rc {
+	AVCENC_RC_DEFAULT = 0,
+	AVCENC_RC_CRF,
+	AVCENC_RC_QP,
+};
+
+struct avcenc_params {
+	char preset[16];
+	char tune[64];
+	enum avcenc_rc rc;
+	float quality;
+	unsigned int keyint; /* 0 for preset default */
+	int lookahead; /* negative for preset default */
+	unsigned int threads; /* 0 for auto */
+	int sliced_threads;
+};
+
+void avcenc_params_init(struct avcenc_params *params);
+
+/* parses "<preset>[:tune[,tune...]]" against the names known to x264 */
+int avcenc_params_preset(struct avcenc_params *params, const char *str);
 
 struct avcenc_session;
 
-typedef void (*avcenc_session_cb)(struct avcenc_session *session,
-		void *data, size_t len, void *cbarg);
+/* one access unit in Annex B byte stream; timestamps count frames */
+struct avcenc_frame {
+	void *data;
+	size_t len;
+	int keyframe;
+	int64_t pts;
+	int64_t dts;
+};
+
+typedef int (*avcenc_session_cb)(struct avcenc_session *session,
+		const struct avcenc_frame *frame, void *cbarg);
 
 struct avcenc_session *avcenc_session_new(const char *profile,
-		struct pit_dim *size, struct pit_frac *frame_rate);
+		struct pit_dim *size, struct pit_frac *frame_rate,
+		enum i420_matrix matrix, enum i420_range range,
+		const struct avcenc_params *params);
 
 void avcenc_session_free(struct avcenc_session *session);
 
@@ -34,10 +73,10 @@ void avcenc_session_set_cb(struct avcenc_session *session,
 		avcenc_session_cb cb, void *cbarg);
 
 int avcenc_session_encode(struct avcenc_session *session,
-		const unsigned char *data, const char *outfile);
+		const unsigned char *data);
 
 int avcenc_session_pending_frames(struct avcenc_session *session);
 
-int avcenc_session_flush(struct avcenc_session *session, const char *outfile);
+int avcenc_session_flush(struct avcenc_session *session);
 
 #endif /* AVCENC_H_ */
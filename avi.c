@@ -23,6 +23,7 @@
 #include <time.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include "log.h"
 #include "riff.h"
@@ -31,6 +32,13 @@
 
 static int avi_writer_init(struct avi_writer *writer);
 static int avi_writer_finalize(struct avi_writer *writer);
+static int avi_writer_index(struct avi_writer *writer);
+static int avi_writer_split(struct avi_writer *writer);
+
+struct avi_indx {
+	struct avi_super_index hdr;
+	struct avi_super_index_entry entries[AVI_SUPER_INDEX_ENTRIES];
+};
 
 struct avi_writer *avi_writer_new(u_int32_t fourcc, struct pit_dim *size,
 		struct pit_frac *fps)
@@ -45,6 +53,7 @@ struct avi_writer *avi_writer_new(u_int32_t fourcc, struct pit_dim *size,
 	memcpy(&writer->size, size, sizeof(writer->size));
 	memcpy(&writer->fps, fps, sizeof(writer->fps));
 	writer->fourcc = fourcc;
+	writer->fd = -1;
 
 	return writer;
 error:
@@ -58,7 +67,7 @@ void avi_writer_free(struct avi_writer *writer)
 		return;
 	}
 
-	if (writer->file) {
+	if (writer->fd >= 0) {
 		avi_writer_close(writer);
 	}
 
@@ -70,6 +79,10 @@ void avi_writer_free(struct avi_writer *writer)
 		riff_tree_free(writer->tree);
 	}
 
+	if (writer->index.frames) {
+		free(writer->index.frames);
+	}
+
 	free(writer);
 }
 
@@ -83,7 +96,7 @@ int avi_writer_open(struct avi_writer *writer, const char *filename)
 		goto finally;
 	}
 
-	if (writer->file) {
+	if (writer->fd >= 0) {
 		rc = EINPROGRESS;
 		error("already open");
 		goto finally;
@@ -102,7 +115,8 @@ int avi_writer_open(struct avi_writer *writer, const char *filename)
 		goto finally;
 	}
 
-	if (!(writer->file = fopen(writer->filename, "w+"))) {
+	if ((writer->fd = open(writer->filename,
+			O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
 		rc = errno ? errno : -1;
 		error("failed to open file '%s': %s",
 				writer->filename, strerror(rc));
@@ -118,7 +132,7 @@ int avi_writer_open(struct avi_writer *writer, const char *filename)
 
 finally:
 	if (rc != 0) {
-		if (writer->file) {
+		if (writer->fd >= 0) {
 			avi_writer_close(writer);
 		}
 		if (writer->filename) {
@@ -139,36 +153,26 @@ int avi_writer_close(struct avi_writer *writer)
 		goto finally;
 	}
 
-	if (!writer->file) {
+	if (writer->fd < 0) {
 		rc = -1;
 		error("not open");
 		goto finally;
 	}
 
-	if ((rc = avi_writer_finalize(writer))) {
+	/* the descriptor is closed even if the headers could not be fixed */
+	if ((rc = writer->tree ? avi_writer_finalize(writer) : 0)) {
 		error("failed to finalize: %s", strerror(rc));
-		goto finally;
 	}
 
 	debug("closing file: %s", writer->filename);
 
-	if (fflush(writer->file)) {
-		rc = errno ? errno : -1;
-		error("failed to flush file '%s': %s",
-				writer->filename, strerror(rc));
-		goto finally;
-	}
-
-	if (fclose(writer->file)) {
+	if (close(writer->fd) && rc == 0) {
 		rc = errno ? errno : -1;
 		error("failed to close file '%s': %s",
 				writer->filename, strerror(rc));
-		goto finally;
 	}
 
-	writer->file = NULL;
-
-	rc = 0;
+	writer->fd = -1;
 
 finally:
 	return rc;
@@ -182,10 +186,14 @@ int avi_writer_init(struct avi_writer *writer)
 		struct avi_hdr avih;
 		struct avi_stream_hdr strh;
 		struct avi_mjpg_stream mjpg;
+		struct avi_indx indx;
 		struct avi_odm_hdr dmlh;
 	} data;
 
-	if (!(writer->tree = riff_tree_new(writer->file))) {
+	memset(&writer->segment, '\0', sizeof(writer->segment));
+	writer->index.num = 0;
+
+	if (!(writer->tree = riff_tree_new(writer->fd))) {
 		rc = ENOMEM;
 		error("failed to create RIFF tree");
 		goto finally;
@@ -290,7 +298,24 @@ int avi_writer_init(struct avi_writer *writer)
 		goto finally;
 	}
 
-	if ((rc = riff_add_list(list,
+	/* room for the super index, filled in once all RIFFs are known */
+	if ((rc = riff_add_leaf(list,
+			avi_fourcc('i', 'n', 'd', 'x'),
+			sizeof(data.indx), &writer->indx))) {
+		error("failed to add super index chunk: %s",
+				strerror(rc));
+		goto finally;
+	}
+
+	memset(&data.indx, '\0', sizeof(data.indx));
+
+	if ((rc = riff_write(writer->indx, &data.indx, sizeof(data.indx)))) {
+		error("failed to write super index chunk: %s",
+				strerror(rc));
+		goto finally;
+	}
+
+	if ((rc = riff_add_list(hdrl,
 			avi_fourcc('L', 'I', 'S', 'T'),
 			avi_fourcc('o', 'd', 'm', 'l'), &list))) {
 		error("failed to add stream chunk: %s",
@@ -300,7 +325,7 @@ int avi_writer_init(struct avi_writer *writer)
 
 	if ((rc = riff_add_leaf(list,
 			avi_fourcc('d', 'm', 'l', 'h'),
-			sizeof(data.dmlh), &leaf))) {
+			sizeof(data.dmlh), &writer->dmlh))) {
 		error("failed to add stream chunk: %s",
 				strerror(rc));
 		goto finally;
@@ -308,7 +333,7 @@ int avi_writer_init(struct avi_writer *writer)
 
 	memset(&data.dmlh, '\0', sizeof(data.dmlh));
 
-	if ((rc = riff_write(leaf, &data.dmlh, sizeof(data.dmlh)))) {
+	if ((rc = riff_write(writer->dmlh, &data.dmlh, sizeof(data.dmlh)))) {
 		error("failed to write Open-DMX extended AVI header "
 				"chunk: %s", strerror(rc));
 		goto finally;
@@ -321,6 +346,8 @@ int avi_writer_init(struct avi_writer *writer)
 		goto finally;
 	}
 
+	writer->riff = writer->avi;
+
 finally:
 	if (rc != 0) {
 		if (writer->tree) {
@@ -337,15 +364,17 @@ int avi_writer_finalize(struct avi_writer *writer)
 	union {
 		struct avi_hdr avih;
 		struct avi_stream_hdr strh;
+		struct avi_indx indx;
+		struct avi_odm_hdr dmlh;
 	} data;
-	struct riff_list *list;
-	struct riff *idx1;
-	struct riff_item *frame;
-	struct riff_stat stat;
-	struct avi_index idx;
 
 	debug("finalizing: %s", writer->filename);
 
+	if ((rc = avi_writer_index(writer))) {
+		error("failed to index: %s", strerror(rc));
+		goto finally;
+	}
+
 	memset(&data.avih, '\0', sizeof(data.avih));
 	data.avih.us_per_frame = 1000000 * writer->fps.den
 			/ writer->fps.num;
@@ -353,7 +382,7 @@ int avi_writer_finalize(struct avi_writer *writer)
 			* 3 * writer->fps.num / writer->fps.den;
 //	data.avih.flags = AVIF_WASCAPTUREFILE;
 	data.avih.flags = AVIF_HASINDEX;
-	data.avih.total_frames = writer->stat.frames;
+	data.avih.total_frames = writer->segment.legacy_frames;
 //	data.avih.init_frames = 0;
 	data.avih.streams = 1;
 	data.avih.suggested_buffer = writer->size.width
@@ -389,64 +418,278 @@ int avi_writer_finalize(struct avi_writer *writer)
 		goto finally;
 	}
 
-	if ((rc = riff_add_leaf(writer->avi,
-			avi_fourcc('i', 'd', 'x', '1'),
-			sizeof(idx) * writer->stat.frames, &idx1))) {
-		error("failed to add index chunk: %s",
+	memset(&data.indx, '\0', sizeof(data.indx));
+	data.indx.hdr.longs_per_entry = sizeof(*data.indx.entries)
+			/ sizeof(u_int32_t);
+	data.indx.hdr.index_type = AVI_INDEX_OF_INDEXES;
+	data.indx.hdr.entries_in_use = writer->segment.num;
+	data.indx.hdr.chunk_id = avi_fourcc('0', '0', 'd', 'c');
+	memcpy(data.indx.entries, writer->segment.index,
+			sizeof(data.indx.entries));
+
+	if ((rc = riff_update(writer->indx, &data.indx,
+			sizeof(data.indx)))) {
+		error("failed to update super index chunk: %s",
 				strerror(rc));
 		goto finally;
 	}
 
-	list = riff_iterator(writer->movi);
+	memset(&data.dmlh, '\0', sizeof(data.dmlh));
+	data.dmlh.total_frames = writer->stat.frames;
 
-	TAILQ_FOREACH(frame, list, next) {
-		if ((rc = riff_stat(frame->riff, &stat))) {
-			error("failed to stat riff: %s", strerror(rc));
-			goto finally;
+	if ((rc = riff_update(writer->dmlh, &data.dmlh,
+			sizeof(data.dmlh)))) {
+		error("failed to update Open-DML extended AVI header "
+				"chunk: %s", strerror(rc));
+		goto finally;
+	}
+
+	if ((rc = riff_tree_refresh(writer->tree))) {
+		error("failed to refresh RIFF: %s", strerror(rc));
+		goto finally;
+	}
+
+	if ((rc = riff_tree_flush(writer->tree))) {
+		error("failed to flush RIFF: %s", strerror(rc));
+		goto finally;
+	}
+
+	riff_tree_free(writer->tree);
+	writer->tree = NULL;
+	rc = 0;
+
+finally:
+	return rc;
+}
+
+/*
+ * Closes the movi list of the current RIFF with an ix00 standard index and
+ * records it in the super index; the first RIFF also gets the legacy idx1.
+ */
+int avi_writer_index(struct avi_writer *writer)
+{
+	int rc;
+	size_t i, n = writer->index.num;
+	struct riff *ix00, *idx1;
+	struct riff_stat stat, movi;
+	struct avi_std_index *hdr;
+	struct avi_std_index_entry *entry;
+	struct avi_super_index_entry *super;
+	struct avi_index *idx;
+	struct avi_frame *frame;
+	void *buf = NULL;
+	size_t header = riff_leaf_header_size();
+
+	if (writer->segment.num >= AVI_SUPER_INDEX_ENTRIES) {
+		rc = EFBIG;
+		error("too many RIFF segments: %zu", writer->segment.num);
+		goto finally;
+	}
+
+	/* large enough for either index of this RIFF */
+	if (!(buf = malloc(sizeof(*hdr) + sizeof(*idx) * n))) {
+		rc = errno ? errno : -1;
+		error("malloc: %s", strerror(rc));
+		goto finally;
+	}
+
+	if ((rc = riff_stat(writer->movi, &movi))) {
+		error("failed to stat riff: %s", strerror(rc));
+		goto finally;
+	}
+
+	hdr = buf;
+	memset(hdr, '\0', sizeof(*hdr));
+	hdr->longs_per_entry = sizeof(*entry) / sizeof(u_int32_t);
+	hdr->index_type = AVI_INDEX_OF_CHUNKS;
+	hdr->entries_in_use = n;
+	hdr->chunk_id = avi_fourcc('0', '0', 'd', 'c');
+	hdr->base_offset_low = (u_int64_t) movi.offset & 0xffffffff;
+	hdr->base_offset_high = (u_int64_t) movi.offset >> 32;
+
+	entry = (struct avi_std_index_entry *) (hdr + 1);
+
+	for (i = 0; i < n; i++) {
+		frame = writer->index.frames + i;
+
+		/* relative to movi, pointing past the chunk header */
+		entry[i].offset = frame->offset + header - movi.offset;
+		entry[i].size = frame->size;
+
+		if (!frame->keyframe) {
+			entry[i].size |= AVI_STD_INDEX_DELTAFRAME;
 		}
+	}
+
+	if ((rc = riff_add_leaf(writer->movi,
+			avi_fourcc('i', 'x', '0', '0'),
+			sizeof(*hdr) + sizeof(*entry) * n, &ix00))) {
+		error("failed to add standard index chunk: %s",
+				strerror(rc));
+		goto finally;
+	}
+
+	if ((rc = riff_write(ix00, buf, sizeof(*hdr) + sizeof(*entry) * n))) {
+		error("failed to write standard index: %s", strerror(rc));
+		goto finally;
+	}
 
-		idx.type = avi_fourcc('0', '0', 'd', 'c');
-		idx.flags = AVIIF_KEYFRAME | AVIIF_TWOCC;
-		idx.offset = stat.offset; // - writer->movi->offset;
-		idx.size = stat.size;
+	if ((rc = riff_stat(ix00, &stat))) {
+		error("failed to stat riff: %s", strerror(rc));
+		goto finally;
+	}
+
+	super = writer->segment.index + writer->segment.num++;
+	super->offset_low = (u_int64_t) stat.offset & 0xffffffff;
+	super->offset_high = (u_int64_t) stat.offset >> 32;
+	super->size = stat.size + header;
+	super->duration = n;
+
+	if (writer->riff == writer->avi) {
+		idx = buf;
+
+		for (i = 0; i < n; i++) {
+			frame = writer->index.frames + i;
+			idx[i].type = avi_fourcc('0', '0', 'd', 'c');
+			idx[i].flags = AVIIF_TWOCC;
+			idx[i].offset = frame->offset;
+			idx[i].size = frame->size;
+
+			if (frame->keyframe) {
+				idx[i].flags |= AVIIF_KEYFRAME;
+			}
+		}
+
+		if ((rc = riff_add_leaf(writer->avi,
+				avi_fourcc('i', 'd', 'x', '1'),
+				sizeof(*idx) * n, &idx1))) {
+			error("failed to add index chunk: %s",
+					strerror(rc));
+			goto finally;
+		}
 
-		if ((rc = riff_write(idx1, &idx, sizeof(idx)))) {
+		if (n > 0 && (rc = riff_write(idx1, buf, sizeof(*idx) * n))) {
 			error("failed to write index: %s", strerror(rc));
 			goto finally;
 		}
+
+		writer->segment.legacy_frames = n;
 	}
 
-	if ((rc = riff_tree_refresh(writer->tree))) {
-		error("failed to refresh RIFF: %s", strerror(rc));
+	writer->index.num = 0;
+	rc = 0;
+
+finally:
+	if (buf) {
+		free(buf);
+	}
+	return rc;
+}
+
+int avi_writer_split(struct avi_writer *writer)
+{
+	int rc;
+
+	debug("starting RIFF AVIX #%zu", writer->segment.num);
+
+	if ((rc = avi_writer_index(writer))) {
+		error("failed to index: %s", strerror(rc));
+		goto finally;
+	}
+
+	if ((rc = riff_tree_add_list(writer->tree,
+			avi_fourcc('R', 'I', 'F', 'F'),
+			avi_fourcc('A', 'V', 'I', 'X'), &writer->riff))) {
+		error("failed to add AVIX RIFF-list: %s", strerror(rc));
+		goto finally;
+	}
+
+	if ((rc = riff_add_list(writer->riff,
+			avi_fourcc('L', 'I', 'S', 'T'),
+			avi_fourcc('m', 'o', 'v', 'i'), &writer->movi))) {
+		error("failed to add movi list: %s", strerror(rc));
 		goto finally;
 	}
 
-	riff_tree_free(writer->tree);
-	writer->tree = NULL;
 	rc = 0;
 
 finally:
 	return rc;
 }
 
-int avi_writer_write(struct avi_writer *writer, void *data, size_t len)
+int avi_writer_write(struct avi_writer *writer, void *data, size_t len,
+		int keyframe)
 {
 	int rc;
-	size_t align;
+	size_t align, header, reserve, cap;
 	unsigned char padding[4];
-	struct riff *leaf;
+	struct {
+		u_int32_t type;
+		u_int32_t size;
+	} chunk;
+	struct riff_stat stat;
+	struct avi_frame *frame;
 
 	align = sizeof(u_int32_t) - (len % sizeof(u_int32_t));
+	header = riff_leaf_header_size();
 
-	if ((rc = riff_add_leaf(writer->movi,
-			avi_fourcc('0', '0', 'd', 'c'),
-			len + align, &leaf))) {
-		error("failed to add stream chunk: %s",
+	if ((rc = riff_stat(writer->riff, &stat))) {
+		error("failed to stat riff: %s", strerror(rc));
+		goto finally;
+	}
+
+	/* this frame plus the indexes that will close the RIFF */
+	reserve = header + len + align + header + sizeof(struct avi_std_index)
+			+ sizeof(struct avi_std_index_entry)
+			* (writer->index.num + 1);
+
+	if (writer->riff == writer->avi) {
+		reserve += header + sizeof(struct avi_index)
+				* (writer->index.num + 1);
+	}
+
+	if (writer->index.num > 0 && stat.size + reserve > AVI_RIFF_MAX) {
+		if ((rc = avi_writer_split(writer))) {
+			error("failed to split: %s", strerror(rc));
+			goto finally;
+		}
+	}
+
+	if (writer->index.num == writer->index.cap) {
+		cap = writer->index.cap ? writer->index.cap * 2 : 1024;
+
+		if (!(frame = realloc(writer->index.frames,
+				cap * sizeof(*frame)))) {
+			rc = errno ? errno : -1;
+			error("realloc: %s", strerror(rc));
+			goto finally;
+		}
+
+		writer->index.frames = frame;
+		writer->index.cap = cap;
+	}
+
+	if ((rc = riff_stat(writer->movi, &stat))) {
+		error("failed to stat riff: %s", strerror(rc));
+		goto finally;
+	}
+
+	/* frames are plain data of movi, so the chunk starts where movi ends */
+	frame = writer->index.frames + writer->index.num;
+	frame->offset = stat.offset + header + stat.size;
+	frame->size = len + align;
+	frame->keyframe = keyframe;
+
+	chunk.type = avi_fourcc('0', '0', 'd', 'c');
+	chunk.size = len + align;
+
+	if ((rc = riff_write(writer->movi, &chunk, sizeof(chunk)))) {
+		error("failed to write frame chunk header: %s",
 				strerror(rc));
 		goto finally;
 	}
 
-	if ((rc = riff_write(leaf, data, len))) {
+	if ((rc = riff_write(writer->movi, data, len))) {
 		error("failed to write frame chunk: %s",
 				strerror(rc));
 		goto finally;
@@ -455,13 +698,14 @@ int avi_writer_write(struct avi_writer *writer, void *data, size_t len)
 	if (align > 0) {
 		memset(padding, 0xff, sizeof(padding));
 
-		if ((rc = riff_write(leaf, padding, align))) {
+		if ((rc = riff_write(writer->movi, padding, align))) {
 			error("failed to align frame chunk: %s",
 					strerror(rc));
 			goto finally;
 		}
 	}
 
+	writer->index.num++;
 	writer->stat.frames++;
 	rc = 0;
 
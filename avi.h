@@ -37,7 +37,8 @@ int avi_writer_open(struct avi_writer *writer, const char *filename);
 
 int avi_writer_close(struct avi_writer *writer);
 
-int avi_writer_write(struct avi_writer *writer, void *data, size_t len);
+int avi_writer_write(struct avi_writer *writer, void *data, size_t len,
+		int keyframe);
 
 size_t avi_writer_num_frames(struct avi_writer *writer);
 
@@ -110,6 +111,52 @@ struct avi_odm_hdr {
 	u_int32_t total_frames;
 };
 
+/* OpenDML keeps every RIFF well below 4GB; 1GB keeps the first one legacy */
+#ifndef AVI_RIFF_MAX
+#define AVI_RIFF_MAX (1 << 30)
+#endif
+
+#define AVI_SUPER_INDEX_ENTRIES 256
+
+enum {
+	AVI_INDEX_OF_INDEXES = 0x00,
+	AVI_INDEX_OF_CHUNKS = 0x01,
+};
+
+struct avi_super_index {
+	u_int16_t longs_per_entry;
+	u_int8_t index_sub_type;
+	u_int8_t index_type;
+	u_int32_t entries_in_use;
+	u_int32_t chunk_id;
+	u_int32_t reserved[3];
+};
+
+struct avi_super_index_entry {
+	u_int32_t offset_low;
+	u_int32_t offset_high;
+	u_int32_t size;
+	u_int32_t duration;
+};
+
+struct avi_std_index {
+	u_int16_t longs_per_entry;
+	u_int8_t index_sub_type;
+	u_int8_t index_type;
+	u_int32_t entries_in_use;
+	u_int32_t chunk_id;
+	u_int32_t base_offset_low;
+	u_int32_t base_offset_high;
+	u_int32_t reserved;
+};
+
+#define AVI_STD_INDEX_DELTAFRAME 0x80000000
+
+struct avi_std_index_entry {
+	u_int32_t offset;
+	u_int32_t size;
+};
+
 enum {
 	AVIIF_LIST = 0x00000001, /* chunk is a 'LIST' */
 	AVIIF_TWOCC = 0x00000002,
@@ -128,6 +175,12 @@ struct avi_index {
 	u_int32_t size;
 };
 
+struct avi_frame {
+	u_int64_t offset; /* of the chunk header */
+	u_int32_t size;
+	u_int32_t keyframe;
+};
+
 struct avi_writer {
 	struct riff_tree *tree;
 	char *filename;
@@ -138,11 +191,24 @@ struct avi_writer {
 		size_t frames;
 		size_t size;
 	} stat;
-	FILE *file;
+	int fd;
 	struct riff *avi;
 	struct riff *avih;
 	struct riff *strh;
+	struct riff *indx;
+	struct riff *dmlh;
+	struct riff *riff;
 	struct riff *movi;
+	struct {
+		struct avi_frame *frames; /* of the current RIFF */
+		size_t num;
+		size_t cap;
+	} index;
+	struct {
+		size_t legacy_frames;
+		size_t num;
+		struct avi_super_index_entry index[AVI_SUPER_INDEX_ENTRIES];
+	} segment;
 };
 
 #endif /* AVI_H_ */
@@ -0,0 +1,662 @@
+// $Id$
+/*
+ * Copyright 2013 Cedric Shih (cedric dot shih at gmail dot com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/queue.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "log.h"
+#include "common.h"
+#include "filelist.h"
+#include "jpg2rgb.h"
+#include "rgb2jpg.h"
+#include "resize.h"
+#include "i420.h"
+#include "avcenc.h"
+#include "histogram.h"
+#include "blend.h"
+#include "tone.h"
+#include "stack.h"
+#include "bench.h"
+
+#define murmur(fmt...) fprintf(stderr, fmt)
+
+#define DEFAULT_ROUNDS 1
+#define DEFAULT_PROFILE "high"
+#define DEFAULT_FPS 24
+#define DEFAULT_QUALITY 98
+
+#define PIXEL_MIN 0
+#define PIXEL_MAX 255
+
+void bench_help(FILE *file, char *basename, char *cmd)
+{
+	fprintf(file, "Usage: %s %s [options] <width>x<height> [file...]\n\n"
+			"Measures each pipeline stage on the given JPEG files, scaling them to <width>x<height> for video stages.\n"
+			"Rates are counted in pixels fed into each stage.\n\n"
+			"Options:\n"
+			"    -n <rounds>         Number of passes over the files. (default: %d)\n"
+			"\n", basename, cmd, DEFAULT_ROUNDS);
+}
+
+static int jpeg_filter(const char *filename, const char *extname, void *cbarg)
+{
+	if (extname && (!strcasecmp(extname, "jpg") ||
+			!strcasecmp(extname, "jpeg"))) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+enum bench_stage {
+	BENCH_DECODE = 0,
+	BENCH_TONE,
+	BENCH_SCALE,
+	BENCH_I420,
+	BENCH_ENCODE,
+	BENCH_HISTOGRAM,
+	BENCH_BLEND,
+	BENCH_STACK,
+	BENCH_JPEG,
+	BENCH_STAGES,
+};
+
+static const char *bench_stage_names[BENCH_STAGES] = {
+		"jpg_reader",
+		"tone_apply",
+		"scale_down",
+		"i420_conv",
+		"avcenc",
+		"histogram",
+		"blend_max",
+		"stack_line",
+		"rgb2jpg",
+};
+
+struct bench_stat {
+	size_t frames;
+	double pixels;
+	double elapsed;
+};
+
+struct bench_ctx {
+	struct pit_dim size;
+	struct bench_stat stats[BENCH_STAGES];
+	unsigned char *frame;
+	size_t frame_sz;
+	unsigned char *trail;
+	size_t trail_sz;
+	float *acc;
+	size_t acc_sz;
+	float *fg;
+	float *mat;
+	size_t row_sz;
+	unsigned char *scaled;
+	unsigned char *yuv;
+	struct i420_conv *conv;
+	struct avcenc_session *session;
+	struct histogram *histogram;
+};
+
+struct bench_cursor {
+	unsigned char *ptr;
+	size_t stride;
+};
+
+static void bench_stat_add(struct bench_stat *stat, double begin,
+		size_t pixels)
+{
+	stat->frames++;
+	stat->pixels += pixels;
+	stat->elapsed += pit_clock() - begin;
+}
+
+/* buffers only grow; new space is zeroed so float stages never see NaN */
+static int bench_reserve(void **ptr, size_t *size, size_t len)
+{
+	void *buf;
+
+	if (len <= *size) {
+		return 0;
+	}
+
+	if (!(buf = calloc(1, len))) {
+		return errno ? errno : -1;
+	}
+
+	free(*ptr);
+	*ptr = buf;
+	*size = len;
+	return 0;
+}
+
+static int frame_read(unsigned char *row, size_t len, void *cbarg)
+{
+	struct bench_cursor *cursor = cbarg;
+
+	memcpy(row, cursor->ptr, len);
+	cursor->ptr += cursor->stride;
+	return 0;
+}
+
+static int bench_decode(struct bench_ctx *ctx, const char *path,
+		size_t *w, size_t *h)
+{
+	int rc;
+	struct jpg_reader *reader = NULL;
+	size_t y, stride;
+	double begin;
+
+	begin = pit_clock();
+
+	if (!(reader = jpg_reader_open(path, 0, 0, PIXEL_MIN, PIXEL_MAX,
+			1.0, 0))) {
+		rc = errno ? errno : -1;
+		error("jpg_reader_open: %s", strerror(rc));
+		goto finally;
+	}
+
+	*w = jpg_reader_width(reader);
+	*h = jpg_reader_height(reader);
+	stride = *w * 3;
+
+	if ((rc = bench_reserve((void **) &ctx->frame, &ctx->frame_sz,
+			stride * *h))) {
+		error("bench_reserve: %s", strerror(rc));
+		goto finally;
+	}
+
+	for (y = 0; y < *h; y++) {
+		if ((rc = jpg_reader_read(reader, ctx->frame + y * stride,
+				stride))) {
+			error("jpg_reader_read: %s", strerror(rc));
+			goto finally;
+		}
+	}
+
+	bench_stat_add(&ctx->stats[BENCH_DECODE], begin, *w * *h);
+	rc = 0;
+
+finally:
+	if (reader) {
+		jpg_reader_close(reader);
+	}
+	return rc;
+}
+
+static int bench_scale(struct bench_ctx *ctx, size_t w, size_t h)
+{
+	int rc, scaled;
+	struct imgsrc *src = NULL;
+	struct imgdst *dst = NULL;
+	struct bench_cursor cursor;
+	double begin;
+
+	scaled = w != ctx->size.width || h != ctx->size.height;
+	cursor.ptr = ctx->frame;
+	cursor.stride = w * 3;
+
+	begin = pit_clock();
+
+	if (!(src = cbsrc_new(w, h, 3, scaled ? scale_down_rows(h,
+			ctx->size.height) : 1, frame_read, &cursor))) {
+		rc = errno ? errno : -1;
+		error("cbsrc_new: %s", strerror(rc));
+		goto finally;
+	}
+
+	if (!(dst = memdst_new(ctx->scaled, ctx->size.width,
+			ctx->size.height, 3))) {
+		rc = errno ? errno : -1;
+		error("memdst_new: %s", strerror(rc));
+		goto finally;
+	}
+
+	if (scaled) {
+		if ((rc = scale_down(src, dst))) {
+			error("scale_down: %s", strerror(rc));
+			goto finally;
+		}
+	} else {
+		if ((rc = scale_copy(src, dst))) {
+			error("scale_copy: %s", strerror(rc));
+			goto finally;
+		}
+	}
+
+	bench_stat_add(&ctx->stats[BENCH_SCALE], begin, w * h);
+	rc = 0;
+
+finally:
+	if (dst) {
+		memdst_free(dst);
+	}
+	if (src) {
+		cbsrc_free(src);
+	}
+	return rc;
+}
+
+static int bench_i420(struct bench_ctx *ctx)
+{
+	int rc;
+	size_t y, w = ctx->size.width, h = ctx->size.height, stride = w * 3;
+	unsigned char *u, *v;
+	double begin;
+
+	u = ctx->yuv + w * h;
+	v = u + (w * h >> 2);
+
+	begin = pit_clock();
+
+	for (y = 0; y < h; y += 2) {
+		if ((rc = i420_conv_rows(ctx->conv, w, ctx->scaled + y * stride,
+				ctx->scaled + (y + 1) * stride,
+				ctx->yuv + y * w, ctx->yuv + (y + 1) * w,
+				u + (y >> 1) * (w >> 1), v + (y >> 1) * (w >> 1)))) {
+			error("i420_conv_rows: %s", strerror(rc));
+			return rc;
+		}
+	}
+
+	bench_stat_add(&ctx->stats[BENCH_I420], begin, w * h);
+	return 0;
+}
+
+static int bench_encode(struct bench_ctx *ctx)
+{
+	int rc;
+	double begin;
+
+	begin = pit_clock();
+
+	if ((rc = avcenc_session_encode(ctx->session, ctx->yuv)) &&
+			rc != EAGAIN) {
+		error("avcenc_session_encode: %s", strerror(rc));
+		return rc;
+	}
+
+	bench_stat_add(&ctx->stats[BENCH_ENCODE], begin,
+			ctx->size.width * ctx->size.height);
+	return 0;
+}
+
+static int bench_flush(struct bench_ctx *ctx)
+{
+	int rc;
+	double begin;
+
+	begin = pit_clock();
+
+	while (avcenc_session_pending_frames(ctx->session) > 0) {
+		if ((rc = avcenc_session_flush(ctx->session)) && rc != EAGAIN) {
+			error("avcenc_session_flush: %s", strerror(rc));
+			return rc;
+		}
+	}
+
+	/* delayed frames were already counted when they were submitted */
+	ctx->stats[BENCH_ENCODE].elapsed += pit_clock() - begin;
+	return 0;
+}
+
+static int bench_histogram(struct bench_ctx *ctx, size_t w, size_t h)
+{
+	int rc;
+	double begin;
+
+	begin = pit_clock();
+
+	if ((rc = histogram_load(ctx->histogram, ctx->frame, w, h))) {
+		error("histogram_load: %s", strerror(rc));
+		return rc;
+	}
+
+	bench_stat_add(&ctx->stats[BENCH_HISTOGRAM], begin, w * h);
+	return 0;
+}
+
+static int bench_tone(struct bench_ctx *ctx, size_t w, size_t h)
+{
+	unsigned char lut[TONE_SIZE];
+	double begin;
+
+	begin = pit_clock();
+	tone_build(lut, 16, 235, 1.0, 0);
+	tone_apply(lut, ctx->frame, w * h * 3);
+	bench_stat_add(&ctx->stats[BENCH_TONE], begin, w * h);
+	return 0;
+}
+
+static int bench_blend(struct bench_ctx *ctx, size_t w, size_t h)
+{
+	int rc;
+	size_t len = w * h * 3;
+	double begin;
+
+	if ((rc = bench_reserve((void **) &ctx->trail, &ctx->trail_sz, len))) {
+		error("bench_reserve: %s", strerror(rc));
+		return rc;
+	}
+
+	begin = pit_clock();
+	blend_max(ctx->trail, ctx->frame, len);
+	bench_stat_add(&ctx->stats[BENCH_BLEND], begin, w * h);
+	return 0;
+}
+
+static int bench_stack(struct bench_ctx *ctx, size_t w, size_t h)
+{
+	int rc;
+	size_t i, y, stride = w * 3;
+	unsigned char *bytes;
+	float *dst;
+	double begin;
+
+	if ((rc = bench_reserve((void **) &ctx->acc, &ctx->acc_sz,
+			stride * h * sizeof(*ctx->acc)))) {
+		error("bench_reserve: %s", strerror(rc));
+		return rc;
+	}
+
+	if (stride * sizeof(*ctx->fg) > ctx->row_sz) {
+		free(ctx->fg);
+		free(ctx->mat);
+		ctx->row_sz = 0;
+
+		if (!(ctx->fg = malloc(stride * sizeof(*ctx->fg))) ||
+				!(ctx->mat = malloc(stride * sizeof(*ctx->mat)))) {
+			rc = errno ? errno : -1;
+			error("malloc: %s", strerror(rc));
+			return rc;
+		}
+
+		ctx->row_sz = stride * sizeof(*ctx->fg);
+	}
+
+	begin = pit_clock();
+
+	bytes = ctx->frame;
+	dst = ctx->acc;
+
+	for (y = 0; y < h; y++) {
+		for (i = 0; i < stride; i++) {
+			ctx->fg[i] = bytes[i] / 255.0;
+		}
+
+		stack_line(dst, ctx->fg, ctx->mat, stride, 1.0, 0.7, 0.8);
+		bytes += stride;
+		dst += stride;
+	}
+
+	bench_stat_add(&ctx->stats[BENCH_STACK], begin, w * h);
+	return 0;
+}
+
+static int bench_jpeg(struct bench_ctx *ctx, size_t w, size_t h)
+{
+	int rc;
+	double begin;
+
+	begin = pit_clock();
+
+	if ((rc = rgb2jpg("/dev/null", DEFAULT_QUALITY, PIXEL_MIN, PIXEL_MAX,
+			1.0, 0, ctx->frame, w, h))) {
+		error("rgb2jpg: %s", strerror(rc));
+		return rc;
+	}
+
+	bench_stat_add(&ctx->stats[BENCH_JPEG], begin, w * h);
+	return 0;
+}
+
+static int bench_file(struct bench_ctx *ctx, const char *path)
+{
+	int rc;
+	size_t w, h;
+
+	if ((rc = bench_decode(ctx, path, &w, &h)) ||
+			(rc = bench_tone(ctx, w, h))) {
+		return rc;
+	}
+
+	if (w < ctx->size.width || h < ctx->size.height) {
+		warn("smaller than %zux%zu, skipping video stages: %s",
+				ctx->size.width, ctx->size.height, path);
+	} else if ((rc = bench_scale(ctx, w, h)) ||
+			(rc = bench_i420(ctx)) ||
+			(rc = bench_encode(ctx))) {
+		return rc;
+	}
+
+	if ((rc = bench_histogram(ctx, w, h)) ||
+			(rc = bench_blend(ctx, w, h)) ||
+			(rc = bench_stack(ctx, w, h)) ||
+			(rc = bench_jpeg(ctx, w, h))) {
+		return rc;
+	}
+
+	return 0;
+}
+
+static void bench_report(struct bench_ctx *ctx, FILE *file)
+{
+	int i;
+	struct bench_stat *stat;
+
+	fprintf(file, "\n%-12s %8s %10s %10s %10s %10s\n", "Stage", "Frames",
+			"Seconds", "MP/s", "Frames/s", "ns/pixel");
+
+	for (i = 0; i < BENCH_STAGES; i++) {
+		stat = &ctx->stats[i];
+
+		if (stat->frames == 0 || stat->elapsed <= 0) {
+			fprintf(file, "%-12s %8d %10s %10s %10s %10s\n",
+					bench_stage_names[i], 0, "-", "-", "-", "-");
+			continue;
+		}
+
+		fprintf(file, "%-12s %8zu %10.3f %10.2f %10.2f %10.2f\n",
+				bench_stage_names[i], stat->frames, stat->elapsed,
+				stat->pixels / stat->elapsed / 1e6,
+				stat->frames / stat->elapsed,
+				stat->elapsed * 1e9 / stat->pixels);
+	}
+
+	fprintf(file, "\n");
+}
+
+int bench(char *basename, int argc, char **argv)
+{
+	int rc, c, i;
+	enum pit_log_level log_level = PIT_WARN;
+	size_t total, round, rounds, count;
+	struct bench_ctx ctx;
+	struct pit_frac frame_rate;
+	struct filelist list;
+	struct file *item;
+	char *tmp;
+	char fmt[256];
+
+	RB_INIT(&list);
+	memset(&ctx, '\0', sizeof(ctx));
+	rounds = DEFAULT_ROUNDS;
+	frame_rate.num = DEFAULT_FPS;
+	frame_rate.den = 1;
+
+	while ((c = getopt(argc, argv, "vn:")) != -1) {
+		switch (c) {
+		case 'v':
+			log_level--;
+			break;
+		case 'n':
+			rounds = (size_t) strtoul(optarg, &tmp, 10);
+
+			if (*tmp != '\0' || rounds == 0) {
+				rc = EINVAL;
+				murmur("Invalid number of rounds: %s\n", optarg);
+				goto finally;
+			}
+			break;
+		default:
+			/* unrecognised option ... add your error condition */
+			break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	pit_set_log_level(log_level);
+
+	if (argc < 1) {
+		rc = EINVAL;
+		bench_help(stderr, basename, "bench");
+		goto finally;
+	}
+
+	if ((rc = pit_dim_parse(&ctx.size, argv[0])) ||
+			ctx.size.width == 0 || ctx.size.height == 0 ||
+			(ctx.size.width & 1) || (ctx.size.height & 1)) {
+		rc = EINVAL;
+		murmur("Invalid size: %s\n", argv[0]);
+		goto finally;
+	}
+
+	argc--;
+	argv++;
+
+	if (argc == 0) {
+		if ((rc = filelist_list(&list, ".", &total, jpeg_filter, NULL))) {
+			error("filelist_list: %s", strerror(rc));
+			goto finally;
+		}
+	} else {
+		total = 0;
+
+		for (i = 0; i < argc; i++) {
+			if ((rc = filelist_add(&list, argv[i]))) {
+				if (rc == EEXIST) {
+					continue;
+				}
+
+				error("filelist_add: %s", strerror(rc));
+				goto finally;
+			}
+
+			total++;
+		}
+	}
+
+	if (RB_EMPTY(&list)) {
+		murmur("No input file.\n");
+		rc = EINVAL;
+		goto finally;
+	}
+
+	if (!(ctx.scaled = malloc(ctx.size.width * ctx.size.height * 3))) {
+		rc = errno ? errno : -1;
+		error("malloc: %s", strerror(rc));
+		goto finally;
+	}
+
+	if (!(ctx.yuv = malloc(ctx.size.width * ctx.size.height * 3 / 2))) {
+		rc = errno ? errno : -1;
+		error("malloc: %s", strerror(rc));
+		goto finally;
+	}
+
+	if (!(ctx.conv = i420_conv_new(I420_BT601, I420_LIMITED))) {
+		rc = errno ? errno : -1;
+		error("i420_conv_new: %s", strerror(rc));
+		goto finally;
+	}
+
+	if (!(ctx.session = avcenc_session_new(DEFAULT_PROFILE, &ctx.size,
+			&frame_rate, I420_BT601, I420_LIMITED, NULL))) {
+		rc = errno ? errno : -1;
+		error("avcenc_session_new: %s", strerror(rc));
+		goto finally;
+	}
+
+	if (!(ctx.histogram = histogram_new(PIXEL_MAX + 1))) {
+		rc = errno ? errno : -1;
+		error("histogram_new: %s", strerror(rc));
+		goto finally;
+	}
+
+	snprintf(fmt, sizeof(fmt), "%zu", total * rounds);
+	snprintf(fmt, sizeof(fmt), "%%0%zuzu/%%zu: %%s\n", strlen(fmt));
+	count = 0;
+
+	for (round = 0; round < rounds; round++) {
+		RB_FOREACH(item, filelist, &list) {
+			fprintf(stdout, fmt, ++count, total * rounds, item->path);
+
+			if ((rc = bench_file(&ctx, item->path))) {
+				error("failed to benchmark %s: %s", item->path,
+						strerror(rc));
+				goto finally;
+			}
+		}
+	}
+
+	if ((rc = bench_flush(&ctx))) {
+		goto finally;
+	}
+
+	bench_report(&ctx, stdout);
+	rc = 0;
+
+finally:
+	if (ctx.histogram) {
+		histogram_free(ctx.histogram);
+	}
+	if (ctx.session) {
+		avcenc_session_free(ctx.session);
+	}
+	if (ctx.conv) {
+		i420_conv_free(ctx.conv);
+	}
+	if (ctx.yuv) {
+		free(ctx.yuv);
+	}
+	if (ctx.scaled) {
+		free(ctx.scaled);
+	}
+	if (ctx.mat) {
+		free(ctx.mat);
+	}
+	if (ctx.fg) {
+		free(ctx.fg);
+	}
+	if (ctx.acc) {
+		free(ctx.acc);
+	}
+	if (ctx.trail) {
+		free(ctx.trail);
+	}
+	if (ctx.frame) {
+		free(ctx.frame);
+	}
+	filelist_clear(&list);
+	return rc;
+}
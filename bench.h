@@ -0,0 +1,27 @@
+// $Id$
+/*
+ * Copyright 2013 Cedric Shih (cedric dot shih at gmail dot com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdio.h>
+
+int bench(char *basename, int argc, char **argv);
+
+void bench_help(FILE *file, char *basename, char *cmd);
+
+#endif /* BENCH_H_ */
@@ -0,0 +1,102 @@
+// $Id$
+/*
+ * Copyright 2013 Cedric Shih (cedric dot shih at gmail dot com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define BLEND_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#define BLEND_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#include "blend.h"
+
+typedef void (*blend_fn)(unsigned char *dst, const unsigned char *src,
+		size_t len);
+
+static void max_c(unsigned char *dst, const unsigned char *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (src[i] > dst[i]) {
+			dst[i] = src[i];
+		}
+	}
+}
+
+#ifdef BLEND_SSE2
+static void max_sse2(unsigned char *dst, const unsigned char *src, size_t len)
+{
+	size_t i;
+	__m128i a, b;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		a = _mm_loadu_si128((const __m128i *) (dst + i));
+		b = _mm_loadu_si128((const __m128i *) (src + i));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_max_epu8(a, b));
+	}
+
+	max_c(dst + i, src + i, len - i);
+}
+#endif
+
+#ifdef BLEND_AVX2
+__attribute__((target("avx2")))
+static void max_avx2(unsigned char *dst, const unsigned char *src, size_t len)
+{
+	size_t i;
+	__m256i a, b, c, d;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		a = _mm256_loadu_si256((const __m256i *) (dst + i));
+		b = _mm256_loadu_si256((const __m256i *) (src + i));
+		c = _mm256_loadu_si256((const __m256i *) (dst + i + 32));
+		d = _mm256_loadu_si256((const __m256i *) (src + i + 32));
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_max_epu8(a, b));
+		_mm256_storeu_si256((__m256i *) (dst + i + 32),
+				_mm256_max_epu8(c, d));
+	}
+
+	max_sse2(dst + i, src + i, len - i);
+}
+#endif
+
+static blend_fn blend_max_fn = max_c;
+static pthread_once_t blend_once = PTHREAD_ONCE_INIT;
+
+static void blend_init(void)
+{
+#ifdef BLEND_SSE2
+	blend_max_fn = max_sse2;
+#endif
+#ifdef BLEND_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+		blend_max_fn = max_avx2;
+	}
+#endif
+}
+
+void blend_max(unsigned char *dst, const unsigned char *src, size_t len)
+{
+	pthread_once(&blend_once, blend_init);
+	(*blend_max_fn)(dst, src, len);
+}
@@ -0,0 +1,493 @@
+// $Id$
+/*
+ * Copyright 2013 Cedric Shih (cedric dot shih at gmail dot com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "log.h"
+
+#include "cache.h"
+
+#define CACHE_MAGIC 0x43544950 /* "PITC" */
+#define CACHE_VERSION 1
+#define CACHE_SUFFIX ".pitc"
+
+struct cache_header {
+	u_int32_t magic;
+	u_int32_t version;
+	u_int64_t mtime_sec;
+	u_int64_t mtime_nsec;
+	u_int64_t size;
+	u_int32_t path_len;
+	u_int32_t variant_len;
+	u_int64_t data_len;
+};
+
+struct cache_entry {
+	char name[NAME_MAX + 1];
+	struct timespec mtime;
+	off_t size;
+};
+
+struct cache {
+	char *dir;
+	off_t cap;
+	off_t size;
+	unsigned int seq;
+	pthread_mutex_t mutex;
+};
+
+static int cache_evict(struct cache *cache, off_t target);
+static void cache_key(struct cache *cache, const char *path,
+		const struct stat *st, const void *variant, size_t variant_len,
+		struct cache_header *hdr, char *name, size_t size);
+static int read_full(int fd, void *data, size_t len);
+static int write_full(int fd, const void *data, size_t len);
+
+struct cache *cache_new(const char *dir, off_t cap)
+{
+	int rc;
+	struct cache *cache;
+
+	if (!(cache = calloc(1, sizeof(*cache)))) {
+		rc = errno ? errno : -1;
+		error("calloc: %s", strerror(rc));
+		goto finally;
+	}
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	cache->cap = cap;
+
+	if (!(cache->dir = strdup(dir))) {
+		rc = errno ? errno : -1;
+		error("strdup: %s", strerror(rc));
+		goto finally;
+	}
+
+	if (mkdir(dir, 0777) && errno != EEXIST) {
+		rc = errno ? errno : -1;
+		error("failed to create '%s': %s", dir, strerror(rc));
+		goto finally;
+	}
+
+	/* a full scan also counts what earlier runs left behind */
+	pthread_mutex_lock(&cache->mutex);
+	rc = cache_evict(cache, cap);
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (rc) {
+		error("failed to scan '%s': %s", dir, strerror(rc));
+		goto finally;
+	}
+
+	debug("cache '%s': %lld bytes", dir, (long long) cache->size);
+	rc = 0;
+
+finally:
+	if (rc != 0) {
+		if (cache) {
+			cache_free(cache);
+		}
+		cache = NULL;
+		errno = rc;
+	}
+	return cache;
+}
+
+void cache_free(struct cache *cache)
+{
+	if (!cache) {
+		return;
+	}
+
+	if (cache->dir) {
+		free(cache->dir);
+	}
+
+	pthread_mutex_destroy(&cache->mutex);
+	free(cache);
+}
+
+int cache_get(struct cache *cache, const char *path,
+		const void *variant, size_t variant_len,
+		void *data, size_t len)
+{
+	int rc, fd = -1;
+	struct stat st;
+	struct cache_header expected, hdr;
+	char name[PATH_MAX];
+	char *key = NULL;
+	size_t path_len;
+
+	if (!cache || !path || !data) {
+		return EINVAL;
+	}
+
+	if (stat(path, &st)) {
+		return errno ? errno : -1;
+	}
+
+	cache_key(cache, path, &st, variant, variant_len, &expected,
+			name, sizeof(name));
+	expected.data_len = len;
+
+	if ((fd = open(name, O_RDONLY)) < 0) {
+		rc = errno ? errno : -1;
+		goto finally;
+	}
+
+	if ((rc = read_full(fd, &hdr, sizeof(hdr)))) {
+		goto finally;
+	}
+
+	if (memcmp(&hdr, &expected, sizeof(hdr))) {
+		trace("stale entry for '%s'", path);
+		rc = ENOENT;
+		goto finally;
+	}
+
+	/* the name is only a hash; the full key is stored in the entry */
+	path_len = hdr.path_len;
+
+	if (!(key = malloc(path_len + variant_len))) {
+		rc = errno ? errno : -1;
+		goto finally;
+	}
+
+	if ((rc = read_full(fd, key, path_len + variant_len))) {
+		goto finally;
+	}
+
+	if (memcmp(key, path, path_len) ||
+			memcmp(key + path_len, variant, variant_len)) {
+		trace("hash collision for '%s'", path);
+		rc = ENOENT;
+		goto finally;
+	}
+
+	if ((rc = read_full(fd, data, len))) {
+		goto finally;
+	}
+
+	/* entries age by mtime, so a hit makes it the most recent */
+	futimens(fd, NULL);
+	rc = 0;
+
+finally:
+	if (key) {
+		free(key);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	return rc;
+}
+
+int cache_put(struct cache *cache, const char *path,
+		const void *variant, size_t variant_len,
+		const void *data, size_t len)
+{
+	int rc, fd = -1;
+	struct stat st;
+	struct cache_header hdr;
+	char name[PATH_MAX];
+	char tmp[PATH_MAX];
+	off_t size, old;
+	unsigned int seq;
+
+	if (!cache || !path || !data) {
+		return EINVAL;
+	}
+
+	if (stat(path, &st)) {
+		return errno ? errno : -1;
+	}
+
+	cache_key(cache, path, &st, variant, variant_len, &hdr,
+			name, sizeof(name));
+	hdr.data_len = len;
+
+	pthread_mutex_lock(&cache->mutex);
+	seq = cache->seq++;
+	pthread_mutex_unlock(&cache->mutex);
+
+	/* readers only ever see complete entries */
+	snprintf(tmp, sizeof(tmp), "%s/.%d.%u.tmp", cache->dir,
+			(int) getpid(), seq);
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		rc = errno ? errno : -1;
+		error("failed to open '%s': %s", tmp, strerror(rc));
+		goto finally;
+	}
+
+	if ((rc = write_full(fd, &hdr, sizeof(hdr))) ||
+			(rc = write_full(fd, path, hdr.path_len)) ||
+			(rc = write_full(fd, variant, variant_len)) ||
+			(rc = write_full(fd, data, len))) {
+		error("failed to write '%s': %s", tmp, strerror(rc));
+		goto finally;
+	}
+
+	if (close(fd)) {
+		fd = -1;
+		rc = errno ? errno : -1;
+		error("failed to close '%s': %s", tmp, strerror(rc));
+		goto finally;
+	}
+
+	fd = -1;
+	size = sizeof(hdr) + hdr.path_len + variant_len + len;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	old = stat(name, &st) ? 0 : st.st_size;
+
+	if (rename(tmp, name)) {
+		rc = errno ? errno : -1;
+		pthread_mutex_unlock(&cache->mutex);
+		error("failed to rename '%s': %s", tmp, strerror(rc));
+		goto finally;
+	}
+
+	cache->size += size - old;
+
+	/* drop an eighth below the cap so not every put has to scan */
+	if (cache->cap > 0 && cache->size > cache->cap) {
+		rc = cache_evict(cache, cache->cap - cache->cap / 8);
+	} else {
+		rc = 0;
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (rc) {
+		error("failed to evict: %s", strerror(rc));
+		goto finally;
+	}
+
+	rc = 0;
+
+finally:
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (rc != 0) {
+		unlink(tmp);
+	}
+	return rc;
+}
+
+off_t cache_size(struct cache *cache)
+{
+	off_t size;
+
+	pthread_mutex_lock(&cache->mutex);
+	size = cache->size;
+	pthread_mutex_unlock(&cache->mutex);
+
+	return size;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct cache_entry *x = a, *y = b;
+
+	if (x->mtime.tv_sec != y->mtime.tv_sec) {
+		return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+	}
+
+	if (x->mtime.tv_nsec != y->mtime.tv_nsec) {
+		return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+	}
+
+	return 0;
+}
+
+/* recounts the entries and removes the oldest down to target bytes */
+static int cache_evict(struct cache *cache, off_t target)
+{
+	int rc;
+	DIR *dir = NULL;
+	struct dirent *ent;
+	struct stat st;
+	struct cache_entry *entries = NULL, *entry;
+	size_t num = 0, cap = 0, i, n;
+	char path[PATH_MAX];
+	off_t total = 0;
+
+	if (!(dir = opendir(cache->dir))) {
+		rc = errno ? errno : -1;
+		error("opendir: %s", strerror(rc));
+		goto finally;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		n = strlen(ent->d_name);
+
+		if (n <= strlen(CACHE_SUFFIX) || strcmp(ent->d_name + n
+				- strlen(CACHE_SUFFIX), CACHE_SUFFIX)) {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", cache->dir, ent->d_name);
+
+		if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+
+		if (num == cap) {
+			cap = cap ? cap * 2 : 256;
+
+			if (!(entry = realloc(entries, cap * sizeof(*entry)))) {
+				rc = errno ? errno : -1;
+				error("realloc: %s", strerror(rc));
+				goto finally;
+			}
+
+			entries = entry;
+		}
+
+		entry = entries + num++;
+		strcpy(entry->name, ent->d_name);
+		entry->mtime = st.st_mtim;
+		entry->size = st.st_size;
+		total += st.st_size;
+	}
+
+	if (target > 0 && total > target) {
+		qsort(entries, num, sizeof(*entries), entry_cmp);
+
+		for (i = 0; i < num && total > target; i++) {
+			snprintf(path, sizeof(path), "%s/%s", cache->dir,
+					entries[i].name);
+
+			if (unlink(path) && errno != ENOENT) {
+				warn("failed to evict '%s': %s", path,
+						strerror(errno));
+				continue;
+			}
+
+			trace("evicted '%s'", path);
+			total -= entries[i].size;
+		}
+	}
+
+	cache->size = total;
+	rc = 0;
+
+finally:
+	if (entries) {
+		free(entries);
+	}
+	if (dir) {
+		closedir(dir);
+	}
+	return rc;
+}
+
+/* FNV-1a over everything that identifies an entry */
+static u_int64_t fnv1a(u_int64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len-- > 0) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static void cache_key(struct cache *cache, const char *path,
+		const struct stat *st, const void *variant, size_t variant_len,
+		struct cache_header *hdr, char *name, size_t size)
+{
+	u_int64_t hash;
+
+	memset(hdr, '\0', sizeof(*hdr));
+	hdr->magic = CACHE_MAGIC;
+	hdr->version = CACHE_VERSION;
+	hdr->mtime_sec = st->st_mtim.tv_sec;
+	hdr->mtime_nsec = st->st_mtim.tv_nsec;
+	hdr->size = st->st_size;
+	hdr->path_len = strlen(path);
+	hdr->variant_len = variant_len;
+
+	hash = fnv1a(0xcbf29ce484222325ULL, hdr, sizeof(*hdr));
+	hash = fnv1a(hash, path, hdr->path_len);
+	hash = fnv1a(hash, variant, variant_len);
+
+	snprintf(name, size, "%s/%016llx" CACHE_SUFFIX, cache->dir,
+			(unsigned long long) hash);
+}
+
+static int read_full(int fd, void *data, size_t len)
+{
+	ssize_t n;
+	unsigned char *p = data;
+
+	while (len > 0) {
+		if ((n = read(fd, p, len)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return errno ? errno : -1;
+		}
+
+		/* a truncated entry is as good as none */
+		if (n == 0) {
+			return ENOENT;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int write_full(int fd, const void *data, size_t len)
+{
+	ssize_t n;
+	const unsigned char *p = data;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return errno ? errno : -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
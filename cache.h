@@ -0,0 +1,46 @@
+// $Id$
+/*
+ * Copyright 2013 Cedric Shih (cedric dot shih at gmail dot com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <sys/types.h>
+
+/*
+ * On-disk cache of decoded pictures. An entry is keyed by the source path,
+ * its mtime and size, and a caller defined variant describing how it was
+ * decoded; the least recently used entries go once the cap is exceeded.
+ * Safe to share between threads.
+ */
+struct cache;
+
+struct cache *cache_new(const char *dir, off_t cap);
+
+void cache_free(struct cache *cache);
+
+/* ENOENT unless an entry of exactly len bytes matches */
+int cache_get(struct cache *cache, const char *path,
+		const void *variant, size_t variant_len,
+		void *data, size_t len);
+
+int cache_put(struct cache *cache, const char *path,
+		const void *variant, size_t variant_len,
+		const void *data, size_t len);
+
+off_t cache_size(struct cache *cache);
+
+#endif /* CACHE_H_ */
@@ -17,6 +17,7 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "common.h"
 
@@ -130,3 +131,38 @@ int pit_range_parse(struct pit_range *range, const char *str)
 
 	return 0;
 }
+
+double pit_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void pit_timer_now(struct pit_timer *timer)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	timer->wall = ts.tv_sec + ts.tv_nsec / 1e9;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	timer->cpu = ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void pit_prof_start(struct pit_prof *prof, struct pit_timer *stages)
+{
+	prof->stages = stages;
+	pit_timer_now(&prof->mark);
+}
+
+void pit_prof_lap(struct pit_prof *prof, int stage)
+{
+	struct pit_timer now;
+
+	pit_timer_now(&now);
+	prof->stages[stage].wall += now.wall - prof->mark.wall;
+	prof->stages[stage].cpu += now.cpu - prof->mark.cpu;
+	prof->mark = now;
+}
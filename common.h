@@ -44,4 +44,26 @@ int pit_range_parsef(struct pit_range *range, const char *str);
 
 int pit_range_parse(struct pit_range *range, const char *str);
 
+double pit_clock(void);
+
+struct pit_timer {
+	double wall;
+	double cpu;
+};
+
+void pit_timer_now(struct pit_timer *timer);
+
+/*
+ * Splits the time of one thread into stages: each lap charges the time
+ * since the previous lap to the given stage.
+ */
+struct pit_prof {
+	struct pit_timer mark;
+	struct pit_timer *stages;
+};
+
+void pit_prof_start(struct pit_prof *prof, struct pit_timer *stages);
+
+void pit_prof_lap(struct pit_prof *prof, int stage);
+
 #endif /* COMMON_H_ */
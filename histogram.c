@@ -19,47 +19,72 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HISTOGRAM_SSSE3
+#include <tmmintrin.h>
+#endif
 
 #include "log.h"
 
 #include "histogram.h"
 
-#define MAX(a,b) a > b ? a : b
+/* sub-histograms per thread so neighbouring pixels rarely hit one counter */
+#define HISTOGRAM_LANES 4
+
+/* below this many pixels a thread costs more than it saves */
+#define HISTOGRAM_MIN_PIXELS (1 << 20)
+
+/* pixels converted to luma at a time */
+#define HISTOGRAM_RUN 1024
+
+/* rows read from a file at a time */
+#define HISTOGRAM_BLOCK (8 << 20)
 
 struct histogram {
 	size_t size;
 	unsigned long total;
-	unsigned int *values;
-	unsigned int max;
-	double *contribs;
+	unsigned long values[HISTOGRAM_CHANNELS][HISTOGRAM_BINS];
+	unsigned long cdf[HISTOGRAM_CHANNELS][HISTOGRAM_BINS];
+	unsigned long max;
+	unsigned long rows;
 	int dirty;
+	int rgb;
+	unsigned int threads;
+	unsigned int step;
+};
+
+struct histogram_part {
+	const unsigned char *rgb;
+	size_t width;
+	size_t height;
+	int all;
+	pthread_t thread;
+	unsigned int bins[HISTOGRAM_CHANNELS][HISTOGRAM_LANES][HISTOGRAM_BINS];
 };
 
 struct histogram *histogram_new(size_t size)
 {
 	int rc;
-	struct histogram *histogram;
-
-	if (!(histogram = calloc(1, sizeof(*histogram)))) {
-		rc = errno ? errno : -1;
-		error("calloc: %s", strerror(rc));
-		goto finally;
-	}
-
-	histogram->size = size;
+	struct histogram *histogram = NULL;
 
-	if (!(histogram->values = calloc(size, sizeof(*histogram->values)))) {
-		rc = errno ? errno : -1;
-		error("calloc: %s", strerror(rc));
+	if (size == 0 || size > HISTOGRAM_BINS) {
+		rc = EINVAL;
+		error("invalid number of bins: %zu", size);
 		goto finally;
 	}
 
-	if (!(histogram->contribs = calloc(size, sizeof(*histogram->contribs)))) {
+	if (!(histogram = calloc(1, sizeof(*histogram)))) {
 		rc = errno ? errno : -1;
 		error("calloc: %s", strerror(rc));
 		goto finally;
 	}
 
+	histogram->size = size;
+	histogram->step = 1;
 	rc = 0;
 
 finally:
@@ -79,48 +104,370 @@ void histogram_free(struct histogram *histogram)
 		return;
 	}
 
-	if (histogram->contribs) {
-		free(histogram->contribs);
+	free(histogram);
+}
+
+int histogram_threads(struct histogram *histogram, unsigned int threads)
+{
+	if (!histogram) {
+		return EINVAL;
+	}
+
+	histogram->threads = threads;
+	return 0;
+}
+
+int histogram_rgb(struct histogram *histogram, int enable)
+{
+	if (!histogram) {
+		return EINVAL;
+	}
+
+	histogram->rgb = enable;
+	return 0;
+}
+
+int histogram_sample(struct histogram *histogram, unsigned int step)
+{
+	if (!histogram || step < 1) {
+		return EINVAL;
+	}
+
+	histogram->step = step;
+	return 0;
+}
+
+unsigned int histogram_sample_step(size_t width, size_t height, double error)
+{
+	double n;
+
+	if (error <= 0) {
+		return 1;
 	}
 
-	if (histogram->values) {
-		free(histogram->values);
+	/* DKW inequality: P(rank error > e) <= 2 exp(-2 n e^2) */
+	n = log(2 / 0.001) / (2 * error * error);
+
+	if (width * height <= n) {
+		return 1;
 	}
 
-	free(histogram);
+	return (unsigned int) sqrt(width * height / n);
 }
 
-static inline int rgb2v(unsigned char *ptr)
+void histogram_reset(struct histogram *histogram)
 {
-	int v = (*ptr++ * 77);
-	v += (*ptr++ * 151);
-	v += (*ptr++ * 28);
-	v >>= 8;
+	memset(histogram->values, '\0', sizeof(histogram->values));
+	histogram->total = 0;
+	histogram->max = 0;
+	histogram->rows = 0;
+	histogram->dirty = 1;
+}
 
-	return v;
+static inline unsigned int rgb2v(const unsigned char *ptr)
+{
+	return (ptr[0] * 77 + ptr[1] * 151 + ptr[2] * 28) >> 8;
 }
 
-int histogram_load(struct histogram *histogram, unsigned char *ptr,
-		size_t w, size_t h)
+static void luma_c(unsigned char *dst, const unsigned char *p, size_t n)
 {
-	size_t y, i;
-	int v;
+	size_t i;
+
+	for (i = 0; i < n; i++, p += 3) {
+		dst[i] = rgb2v(p);
+	}
+}
+
+#ifdef HISTOGRAM_SSSE3
+/* picks one channel of 16 pixels spread over 48 bytes */
+__attribute__((target("ssse3")))
+static inline __m128i channel16(__m128i a, __m128i b, __m128i c, int ch)
+{
+	static const char masks[3][3][16] = {
+		{
+			{ 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+			{ -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1 },
+			{ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13 },
+		},
+		{
+			{ 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+			{ -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1 },
+			{ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14 },
+		},
+		{
+			{ 2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+			{ -1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1 },
+			{ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15 },
+		},
+	};
+
+	return _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(a, _mm_loadu_si128((const __m128i *) masks[ch][0])),
+			_mm_shuffle_epi8(b, _mm_loadu_si128((const __m128i *) masks[ch][1]))),
+			_mm_shuffle_epi8(c, _mm_loadu_si128((const __m128i *) masks[ch][2])));
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i luma8(__m128i r, __m128i g, __m128i b, __m128i zero)
+{
+	__m128i v;
+
+	v = _mm_mullo_epi16(_mm_unpacklo_epi8(r, zero), _mm_set1_epi16(77));
+	v = _mm_add_epi16(v, _mm_mullo_epi16(_mm_unpacklo_epi8(g, zero),
+			_mm_set1_epi16(151)));
+	v = _mm_add_epi16(v, _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero),
+			_mm_set1_epi16(28)));
+	return _mm_srli_epi16(v, 8);
+}
+
+__attribute__((target("ssse3")))
+static void luma_ssse3(unsigned char *dst, const unsigned char *p, size_t n)
+{
+	size_t i;
+	__m128i a, b, c, r, g, bl, zero = _mm_setzero_si128();
+
+	for (i = 0; i + 16 <= n; i += 16, p += 48) {
+		a = _mm_loadu_si128((const __m128i *) p);
+		b = _mm_loadu_si128((const __m128i *) (p + 16));
+		c = _mm_loadu_si128((const __m128i *) (p + 32));
+		r = channel16(a, b, c, 0);
+		g = channel16(a, b, c, 1);
+		bl = channel16(a, b, c, 2);
+
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(
+				luma8(r, g, bl, zero),
+				luma8(_mm_unpackhi_epi64(r, r),
+						_mm_unpackhi_epi64(g, g),
+						_mm_unpackhi_epi64(bl, bl), zero)));
+	}
+
+	luma_c(dst + i, p, n - i);
+}
+#endif
+
+typedef void (*luma_fn)(unsigned char *dst, const unsigned char *p, size_t n);
+
+static luma_fn luma_row = luma_c;
+static pthread_once_t luma_once = PTHREAD_ONCE_INIT;
+
+static void luma_init(void)
+{
+#ifdef HISTOGRAM_SSSE3
+	if (__builtin_cpu_supports("ssse3")) {
+		luma_row = luma_ssse3;
+	}
+#endif
+}
+
+static void count_luma(struct histogram_part *part)
+{
+	unsigned int (*l)[HISTOGRAM_BINS] = part->bins[HISTOGRAM_LUMA];
+	const unsigned char *p = part->rgb;
+	unsigned char luma[HISTOGRAM_RUN];
+	size_t n = part->width * part->height, run, i, j;
+
+	for (i = 0; i < n; i += run, p += run * 3) {
+		run = n - i < HISTOGRAM_RUN ? n - i : HISTOGRAM_RUN;
+		luma_row(luma, p, run);
+
+		for (j = 0; j + HISTOGRAM_LANES <= run; j += HISTOGRAM_LANES) {
+			l[0][luma[j]]++;
+			l[1][luma[j + 1]]++;
+			l[2][luma[j + 2]]++;
+			l[3][luma[j + 3]]++;
+		}
+
+		for (; j < run; j++) {
+			l[0][luma[j]]++;
+		}
+	}
+}
+
+static void count_all(struct histogram_part *part)
+{
+	unsigned int (*l)[HISTOGRAM_BINS] = part->bins[HISTOGRAM_LUMA];
+	unsigned int (*r)[HISTOGRAM_BINS] = part->bins[HISTOGRAM_RED];
+	unsigned int (*g)[HISTOGRAM_BINS] = part->bins[HISTOGRAM_GREEN];
+	unsigned int (*b)[HISTOGRAM_BINS] = part->bins[HISTOGRAM_BLUE];
+	const unsigned char *p = part->rgb;
+	size_t n = part->width * part->height, i;
+	unsigned int k;
+
+	for (i = 0; i < n; i++, p += 3) {
+		k = i % HISTOGRAM_LANES;
+		r[k][p[0]]++;
+		g[k][p[1]]++;
+		b[k][p[2]]++;
+		l[k][rgb2v(p)]++;
+	}
+}
+
+static void *count_worker(void *arg)
+{
+	struct histogram_part *part = arg;
+
+	if (part->all) {
+		count_all(part);
+	} else {
+		count_luma(part);
+	}
+
+	return NULL;
+}
+
+static void histogram_merge(struct histogram *histogram,
+		struct histogram_part *part)
+{
+	int c, k, v;
+	unsigned long sum;
+
+	for (c = 0; c < HISTOGRAM_CHANNELS; c++) {
+		if (c != HISTOGRAM_LUMA && !part->all) {
+			break;
+		}
+
+		for (v = 0; v < HISTOGRAM_BINS; v++) {
+			sum = 0;
+
+			for (k = 0; k < HISTOGRAM_LANES; k++) {
+				sum += part->bins[c][k][v];
+			}
+
+			histogram->values[c][v] += sum;
+		}
+	}
+}
+
+static void histogram_loaded(struct histogram *histogram, size_t rows)
+{
+	size_t v;
+
+	for (v = 0; v < HISTOGRAM_BINS; v++) {
+		if (histogram->values[HISTOGRAM_LUMA][v] > histogram->max) {
+			histogram->max = histogram->values[HISTOGRAM_LUMA][v];
+		}
+	}
+
+	histogram->rows += rows;
+	histogram->dirty = 1;
+}
+
+static void load_sampled(struct histogram *histogram,
+		const unsigned char *ptr, size_t w, size_t h)
+{
+	unsigned long (*values)[HISTOGRAM_BINS] = histogram->values;
+	unsigned int step = histogram->step;
+	const unsigned char *p;
+	size_t y, x, row;
 
 	for (y = 0; y < h; y++) {
-		for (i = 0; i < w; i++) {
-			v = (*ptr++ * 77);
-			v += (*ptr++ * 151);
-			v += (*ptr++ * 28);
-			v >>= 8;
+		row = histogram->rows + y;
+
+		if (row % step) {
+			continue;
+		}
+
+		x = (row / step) % step;
+		p = ptr + (y * w + x) * 3;
+
+		for (; x < w; x += step, p += step * 3) {
+			values[HISTOGRAM_LUMA][rgb2v(p)]++;
+
+			if (histogram->rgb) {
+				values[HISTOGRAM_RED][p[0]]++;
+				values[HISTOGRAM_GREEN][p[1]]++;
+				values[HISTOGRAM_BLUE][p[2]]++;
+			}
 
-			histogram->values[v]++;
 			histogram->total++;
-			histogram->max = MAX(histogram->max, histogram->values[v]);
 		}
 	}
 
-	histogram->dirty = 1;
-	return 0;
+	histogram_loaded(histogram, h);
+}
+
+int histogram_load(struct histogram *histogram, unsigned char *ptr,
+		size_t w, size_t h)
+{
+	int rc;
+	struct histogram_part *parts = NULL;
+	size_t rows, y;
+	unsigned int num, i, started = 0;
+	long cpus;
+
+	if (!histogram || !ptr) {
+		return EINVAL;
+	}
+
+	/* few enough pixels that threads would not pay off */
+	if (histogram->step > 1) {
+		load_sampled(histogram, ptr, w, h);
+		return 0;
+	}
+
+	pthread_once(&luma_once, luma_init);
+
+	if (!(num = histogram->threads)) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		num = cpus > 0 ? cpus : 1;
+	}
+
+	if (num > w * h / HISTOGRAM_MIN_PIXELS) {
+		num = w * h / HISTOGRAM_MIN_PIXELS;
+	}
+
+	if (num < 1) {
+		num = 1;
+	}
+
+	if (num > h) {
+		num = h;
+	}
+
+	if (!(parts = calloc(num, sizeof(*parts)))) {
+		rc = errno ? errno : -1;
+		error("calloc: %s", strerror(rc));
+		goto finally;
+	}
+
+	/* whole rows per part; the caller's thread takes the first */
+	for (i = 0, y = 0; i < num; i++, y += rows) {
+		rows = h / num + (i < h % num);
+		parts[i].rgb = ptr + y * w * 3;
+		parts[i].width = w;
+		parts[i].height = rows;
+		parts[i].all = histogram->rgb;
+	}
+
+	for (i = 1; i < num; i++, started++) {
+		if ((rc = pthread_create(&parts[i].thread, NULL, count_worker,
+				parts + i))) {
+			error("pthread_create: %s", strerror(rc));
+			goto finally;
+		}
+	}
+
+	count_worker(parts);
+	rc = 0;
+
+finally:
+	for (i = 1; i <= started; i++) {
+		pthread_join(parts[i].thread, NULL);
+	}
+
+	if (rc == 0) {
+		for (i = 0; i < num; i++) {
+			histogram_merge(histogram, parts + i);
+		}
+
+		histogram->total += w * h;
+		histogram_loaded(histogram, h);
+	}
+
+	if (parts) {
+		free(parts);
+	}
+	return rc;
 }
 
 int histogram_load_file(struct histogram *histogram, const char *filename,
@@ -128,9 +475,8 @@ int histogram_load_file(struct histogram *histogram, const char *filename,
 {
 	int rc;
 	FILE *file = NULL;
-	unsigned char *buffer = NULL, *ptr;
-	size_t s, y, n, i;
-	unsigned int v;
+	unsigned char *buffer = NULL;
+	size_t s, y, rows, n;
 
 	if (!(file = fopen(filename, "rb"))) {
 		rc = errno ? errno : -1;
@@ -140,34 +486,34 @@ int histogram_load_file(struct histogram *histogram, const char *filename,
 
 	s = w * 3;
 
-	if (!(buffer = malloc(s))) {
+	if ((rows = HISTOGRAM_BLOCK / s) < 1) {
+		rows = 1;
+	}
+
+	if (rows > h) {
+		rows = h;
+	}
+
+	if (!(buffer = malloc(s * rows))) {
 		rc = errno ? errno : -1;
 		error("malloc: %s", strerror(rc));
 		goto finally;
 	}
 
-	for (y = 0; y < h; y++) {
-		if ((n = fread(buffer, 1, s, file)) != s) {
+	for (y = 0; y < h; y += n) {
+		n = h - y < rows ? h - y : rows;
+
+		if (fread(buffer, s, n, file) != n) {
 			rc = errno ? errno : -1;
 			error("fread: %s", strerror(rc));
 			goto finally;
 		}
 
-		ptr = buffer;
-
-		for (i = 0; i < w; i++) {
-			v = (*ptr++ * 77);
-			v += (*ptr++ * 151);
-			v += (*ptr++ * 28);
-			v >>= 8;
-
-			histogram->values[v]++;
-			histogram->total++;
-			histogram->max = MAX(histogram->max, histogram->values[v]);
+		if ((rc = histogram_load(histogram, buffer, w, n))) {
+			goto finally;
 		}
 	}
 
-	histogram->dirty = 1;
 	rc = 0;
 
 finally:
@@ -185,50 +531,107 @@ size_t histogram_size(struct histogram *histogram)
 	return histogram->size;
 }
 
-double histogram_contrib(struct histogram *histogram, size_t value)
+unsigned long histogram_total(struct histogram *histogram)
 {
-	int i;
+	return histogram->total;
+}
 
-	if (histogram->dirty) {
-		for (i = 0; i < histogram->size; i++) {
-			histogram->contribs[i] = ((double) histogram->values[i]) / histogram->total;
+unsigned long histogram_count(struct histogram *histogram,
+		enum histogram_channel channel, size_t value)
+{
+	if (channel < 0 || channel >= HISTOGRAM_CHANNELS ||
+			value >= histogram->size) {
+		return 0;
+	}
 
-			if (i != 0) {
-				histogram->contribs[i] += histogram->contribs[i - 1];
-			}
-		}
+	return histogram->values[channel][value];
+}
+
+static void histogram_cdf(struct histogram *histogram)
+{
+	int c, v;
+	unsigned long sum;
 
-		histogram->dirty = 0;
+	if (!histogram->dirty) {
+		return;
+	}
+
+	for (c = 0; c < HISTOGRAM_CHANNELS; c++) {
+		for (v = 0, sum = 0; v < HISTOGRAM_BINS; v++) {
+			sum += histogram->values[c][v];
+			histogram->cdf[c][v] = sum;
+		}
 	}
 
-	return histogram->contribs[value];
+	histogram->dirty = 0;
+}
+
+double histogram_contrib(struct histogram *histogram, size_t value)
+{
+	histogram_cdf(histogram);
+	return ((double) histogram->cdf[HISTOGRAM_LUMA][value]) /
+			histogram->total;
 }
 
 size_t histogram_ratio_value(struct histogram *histogram, float ratio)
 {
-	int i;
-	double contrib;
+	double r = ratio;
+	size_t value;
 
-	if (ratio <= 0) {
-		return 0;
+	if (histogram_percentiles(histogram, HISTOGRAM_LUMA, &r, &value, 1)) {
+		return histogram->size - 1;
 	}
 
-	if (ratio >= 1) {
-		return histogram->size - 1;
+	return value;
+}
+
+int histogram_percentiles(struct histogram *histogram,
+		enum histogram_channel channel, const double *ratios,
+		size_t *values, size_t num)
+{
+	const unsigned long *cdf;
+	size_t i, lo, hi, mid;
+	double rank;
+
+	if (!histogram || channel < 0 || channel >= HISTOGRAM_CHANNELS) {
+		return EINVAL;
+	}
+
+	if (histogram->total == 0) {
+		return ENOENT;
 	}
 
-	for (i = 0; i < histogram->size; i++) {
-		contrib = histogram_contrib(histogram, i);
+	histogram_cdf(histogram);
+	cdf = histogram->cdf[channel];
 
-		if (contrib >= ratio) {
-			return i;
+	for (i = 0; i < num; i++) {
+		if (ratios[i] <= 0) {
+			values[i] = 0;
+			continue;
 		}
-	}
 
-	return histogram->size - 1;
-}
+		if (ratios[i] >= 1) {
+			values[i] = histogram->size - 1;
+			continue;
+		}
 
+		/* the first value whose cumulative share reaches the ratio */
+		rank = ratios[i] * histogram->total;
+		lo = 0;
+		hi = histogram->size - 1;
 
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
 
+			if (cdf[mid] >= rank) {
+				hi = mid;
+			} else {
+				lo = mid + 1;
+			}
+		}
 
+		values[i] = lo;
+	}
 
+	return 0;
+}
@@ -19,12 +19,52 @@
 #ifndef HISTOGRAM_H_
 #define HISTOGRAM_H_
 
+#include <sys/types.h>
+
+#define HISTOGRAM_BINS 256
+
+/* rank error of sampled percentiles that stretch points can live with */
+#define HISTOGRAM_SAMPLE_ERROR 0.001
+
+enum histogram_channel {
+	HISTOGRAM_LUMA = 0,
+	HISTOGRAM_RED,
+	HISTOGRAM_GREEN,
+	HISTOGRAM_BLUE,
+	HISTOGRAM_CHANNELS,
+};
+
 struct histogram;
 
+/* size is the number of bins, at most HISTOGRAM_BINS */
 struct histogram *histogram_new(size_t size);
 
 void histogram_free(struct histogram *histogram);
 
+/* threads used by large loads; 0 for the number of CPUs (default) */
+int histogram_threads(struct histogram *histogram, unsigned int threads);
+
+/* also count red, green and blue besides luma (default off) */
+int histogram_rgb(struct histogram *histogram, int enable);
+
+/*
+ * Counts one pixel per step x step tile from then on, staggered from one
+ * sampled row to the next; 1 (default) counts every pixel.
+ */
+int histogram_sample(struct histogram *histogram, unsigned int step);
+
+/*
+ * The largest step that keeps the rank error of any percentile of a
+ * width x height picture below error, with 99.9% confidence.
+ */
+unsigned int histogram_sample_step(size_t width, size_t height, double error);
+
+void histogram_reset(struct histogram *histogram);
+
+/*
+ * Adds rows of RGB24 pixels; loads accumulate, so a decoder may feed one
+ * scanline at a time.
+ */
 int histogram_load(struct histogram *histogram, unsigned char *rgb,
 		size_t stride, size_t scanline);
 
@@ -33,8 +73,18 @@ int histogram_load_file(struct histogram *histogram, const char *file,
 
 size_t histogram_size(struct histogram *histogram);
 
+unsigned long histogram_total(struct histogram *histogram);
+
+unsigned long histogram_count(struct histogram *histogram,
+		enum histogram_channel channel, size_t value);
+
 double histogram_contrib(struct histogram *histogram, size_t value);
 
 size_t histogram_ratio_value(struct histogram *histogram, float ratio);
 
+/* values below which the given ratios of pixels of a channel fall */
+int histogram_percentiles(struct histogram *histogram,
+		enum histogram_channel channel, const double *ratios,
+		size_t *values, size_t num);
+
 #endif /* HISTOGRAM_H_ */
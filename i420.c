@@ -0,0 +1,462 @@
+// $Id$
+/*
+ * Copyright 2013 Cedric Shih (cedric dot shih at gmail dot com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define I420_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#define I420_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#include "log.h"
+
+#include "i420.h"
+
+/*
+ * Coefficients are Q15 and applied to samples pre-shifted into the upper
+ * bits of a 16-bit lane, so that every path computes exactly what
+ * _mm_mulhi_epi16() does and the output is identical whichever is used.
+ */
+
+typedef void (*i420_rows_fn)(struct i420_conv *conv, size_t width,
+		const unsigned char *rgb0, const unsigned char *rgb1,
+		unsigned char *y0, unsigned char *y1,
+		unsigned char *u, unsigned char *v);
+
+struct i420_conv {
+	short y[3];
+	short u[3];
+	short v[3];
+	short y_offset;
+	i420_rows_fn rows;
+};
+
+static inline int mulhi(int a, int c)
+{
+	return (a * c) >> 16;
+}
+
+static inline unsigned char clamp(int x)
+{
+	return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+static inline unsigned char luma(struct i420_conv *conv,
+		const unsigned char *p)
+{
+	return clamp(((mulhi(p[0] << 7, conv->y[0]) +
+			mulhi(p[1] << 7, conv->y[1]) +
+			mulhi(p[2] << 7, conv->y[2]) + 32) >> 6) +
+			conv->y_offset);
+}
+
+static inline unsigned char chroma(const short *c, int r, int g, int b)
+{
+	return clamp(((mulhi(r << 5, c[0]) + mulhi(g << 5, c[1]) +
+			mulhi(b << 5, c[2]) + 32) >> 6) + 128);
+}
+
+static void rows_c(struct i420_conv *conv, size_t width,
+		const unsigned char *rgb0, const unsigned char *rgb1,
+		unsigned char *y0, unsigned char *y1,
+		unsigned char *u, unsigned char *v)
+{
+	size_t i;
+	int r, g, b;
+
+	for (i = 0; i < width; i += 2) {
+		y0[i] = luma(conv, rgb0);
+		y0[i + 1] = luma(conv, rgb0 + 3);
+		y1[i] = luma(conv, rgb1);
+		y1[i + 1] = luma(conv, rgb1 + 3);
+
+		r = rgb0[0] + rgb0[3] + rgb1[0] + rgb1[3];
+		g = rgb0[1] + rgb0[4] + rgb1[1] + rgb1[4];
+		b = rgb0[2] + rgb0[5] + rgb1[2] + rgb1[5];
+
+		*u++ = chroma(conv->u, r, g, b);
+		*v++ = chroma(conv->v, r, g, b);
+
+		rgb0 += 6;
+		rgb1 += 6;
+	}
+}
+
+#ifdef I420_SSE2
+static inline void deinterleave_sse2(const unsigned char *p,
+		__m128i *r, __m128i *g, __m128i *b)
+{
+	__m128i t00 = _mm_loadu_si128((const __m128i *) p);
+	__m128i t01 = _mm_loadu_si128((const __m128i *) (p + 16));
+	__m128i t02 = _mm_loadu_si128((const __m128i *) (p + 32));
+
+	__m128i t10 = _mm_unpacklo_epi8(t00, _mm_srli_si128(t01, 8));
+	__m128i t11 = _mm_unpacklo_epi8(_mm_srli_si128(t00, 8), t02);
+	__m128i t12 = _mm_unpacklo_epi8(t01, _mm_srli_si128(t02, 8));
+
+	__m128i t20 = _mm_unpacklo_epi8(t10, _mm_srli_si128(t11, 8));
+	__m128i t21 = _mm_unpacklo_epi8(_mm_srli_si128(t10, 8), t12);
+	__m128i t22 = _mm_unpacklo_epi8(t11, _mm_srli_si128(t12, 8));
+
+	__m128i t30 = _mm_unpacklo_epi8(t20, _mm_srli_si128(t21, 8));
+	__m128i t31 = _mm_unpacklo_epi8(_mm_srli_si128(t20, 8), t22);
+	__m128i t32 = _mm_unpacklo_epi8(t21, _mm_srli_si128(t22, 8));
+
+	*r = _mm_unpacklo_epi8(t30, _mm_srli_si128(t31, 8));
+	*g = _mm_unpacklo_epi8(_mm_srli_si128(t30, 8), t32);
+	*b = _mm_unpacklo_epi8(t31, _mm_srli_si128(t32, 8));
+}
+
+static inline __m128i luma_sse2(struct i420_conv *conv,
+		__m128i r, __m128i g, __m128i b, int hi)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc;
+
+	if (hi) {
+		r = _mm_unpackhi_epi8(r, zero);
+		g = _mm_unpackhi_epi8(g, zero);
+		b = _mm_unpackhi_epi8(b, zero);
+	} else {
+		r = _mm_unpacklo_epi8(r, zero);
+		g = _mm_unpacklo_epi8(g, zero);
+		b = _mm_unpacklo_epi8(b, zero);
+	}
+
+	acc = _mm_mulhi_epi16(_mm_slli_epi16(r, 7), _mm_set1_epi16(conv->y[0]));
+	acc = _mm_add_epi16(acc, _mm_mulhi_epi16(_mm_slli_epi16(g, 7),
+			_mm_set1_epi16(conv->y[1])));
+	acc = _mm_add_epi16(acc, _mm_mulhi_epi16(_mm_slli_epi16(b, 7),
+			_mm_set1_epi16(conv->y[2])));
+	acc = _mm_srai_epi16(_mm_add_epi16(acc, _mm_set1_epi16(32)), 6);
+
+	return _mm_add_epi16(acc, _mm_set1_epi16(conv->y_offset));
+}
+
+static inline __m128i sum2x2_sse2(__m128i x0, __m128i x1)
+{
+	__m128i mask = _mm_set1_epi16(0xff);
+
+	return _mm_slli_epi16(_mm_add_epi16(
+			_mm_add_epi16(_mm_and_si128(x0, mask),
+					_mm_srli_epi16(x0, 8)),
+			_mm_add_epi16(_mm_and_si128(x1, mask),
+					_mm_srli_epi16(x1, 8))), 5);
+}
+
+static inline __m128i chroma_sse2(const short *c, __m128i r, __m128i g,
+		__m128i b)
+{
+	__m128i acc;
+
+	acc = _mm_mulhi_epi16(r, _mm_set1_epi16(c[0]));
+	acc = _mm_add_epi16(acc, _mm_mulhi_epi16(g, _mm_set1_epi16(c[1])));
+	acc = _mm_add_epi16(acc, _mm_mulhi_epi16(b, _mm_set1_epi16(c[2])));
+	acc = _mm_srai_epi16(_mm_add_epi16(acc, _mm_set1_epi16(32)), 6);
+
+	return _mm_add_epi16(acc, _mm_set1_epi16(128));
+}
+
+static void rows_sse2(struct i420_conv *conv, size_t width,
+		const unsigned char *rgb0, const unsigned char *rgb1,
+		unsigned char *y0, unsigned char *y1,
+		unsigned char *u, unsigned char *v)
+{
+	size_t i;
+	__m128i r0, g0, b0, r1, g1, b1, sr, sg, sb, x;
+
+	for (i = 0; i + 16 <= width; i += 16) {
+		deinterleave_sse2(rgb0 + i * 3, &r0, &g0, &b0);
+		deinterleave_sse2(rgb1 + i * 3, &r1, &g1, &b1);
+
+		_mm_storeu_si128((__m128i *) (y0 + i), _mm_packus_epi16(
+				luma_sse2(conv, r0, g0, b0, 0),
+				luma_sse2(conv, r0, g0, b0, 1)));
+		_mm_storeu_si128((__m128i *) (y1 + i), _mm_packus_epi16(
+				luma_sse2(conv, r1, g1, b1, 0),
+				luma_sse2(conv, r1, g1, b1, 1)));
+
+		sr = sum2x2_sse2(r0, r1);
+		sg = sum2x2_sse2(g0, g1);
+		sb = sum2x2_sse2(b0, b1);
+
+		x = chroma_sse2(conv->u, sr, sg, sb);
+		_mm_storel_epi64((__m128i *) (u + i / 2), _mm_packus_epi16(x, x));
+		x = chroma_sse2(conv->v, sr, sg, sb);
+		_mm_storel_epi64((__m128i *) (v + i / 2), _mm_packus_epi16(x, x));
+	}
+
+	rows_c(conv, width - i, rgb0 + i * 3, rgb1 + i * 3, y0 + i, y1 + i,
+			u + i / 2, v + i / 2);
+}
+#endif /* I420_SSE2 */
+
+#ifdef I420_AVX2
+__attribute__((target("avx2")))
+static inline void deinterleave_avx2(const unsigned char *p,
+		__m256i *r, __m256i *g, __m256i *b)
+{
+	__m128i r0, g0, b0, r1, g1, b1;
+
+	deinterleave_sse2(p, &r0, &g0, &b0);
+	deinterleave_sse2(p + 48, &r1, &g1, &b1);
+
+	*r = _mm256_inserti128_si256(_mm256_castsi128_si256(r0), r1, 1);
+	*g = _mm256_inserti128_si256(_mm256_castsi128_si256(g0), g1, 1);
+	*b = _mm256_inserti128_si256(_mm256_castsi128_si256(b0), b1, 1);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i luma_avx2(struct i420_conv *conv,
+		__m256i r, __m256i g, __m256i b, int hi)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i acc;
+
+	if (hi) {
+		r = _mm256_unpackhi_epi8(r, zero);
+		g = _mm256_unpackhi_epi8(g, zero);
+		b = _mm256_unpackhi_epi8(b, zero);
+	} else {
+		r = _mm256_unpacklo_epi8(r, zero);
+		g = _mm256_unpacklo_epi8(g, zero);
+		b = _mm256_unpacklo_epi8(b, zero);
+	}
+
+	acc = _mm256_mulhi_epi16(_mm256_slli_epi16(r, 7),
+			_mm256_set1_epi16(conv->y[0]));
+	acc = _mm256_add_epi16(acc, _mm256_mulhi_epi16(
+			_mm256_slli_epi16(g, 7), _mm256_set1_epi16(conv->y[1])));
+	acc = _mm256_add_epi16(acc, _mm256_mulhi_epi16(
+			_mm256_slli_epi16(b, 7), _mm256_set1_epi16(conv->y[2])));
+	acc = _mm256_srai_epi16(_mm256_add_epi16(acc,
+			_mm256_set1_epi16(32)), 6);
+
+	return _mm256_add_epi16(acc, _mm256_set1_epi16(conv->y_offset));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i sum2x2_avx2(__m256i x0, __m256i x1)
+{
+	__m256i mask = _mm256_set1_epi16(0xff);
+
+	return _mm256_slli_epi16(_mm256_add_epi16(
+			_mm256_add_epi16(_mm256_and_si256(x0, mask),
+					_mm256_srli_epi16(x0, 8)),
+			_mm256_add_epi16(_mm256_and_si256(x1, mask),
+					_mm256_srli_epi16(x1, 8))), 5);
+}
+
+__attribute__((target("avx2")))
+static inline __m128i chroma_avx2(const short *c, __m256i r, __m256i g,
+		__m256i b)
+{
+	__m256i acc;
+
+	acc = _mm256_mulhi_epi16(r, _mm256_set1_epi16(c[0]));
+	acc = _mm256_add_epi16(acc, _mm256_mulhi_epi16(g,
+			_mm256_set1_epi16(c[1])));
+	acc = _mm256_add_epi16(acc, _mm256_mulhi_epi16(b,
+			_mm256_set1_epi16(c[2])));
+	acc = _mm256_srai_epi16(_mm256_add_epi16(acc,
+			_mm256_set1_epi16(32)), 6);
+	acc = _mm256_add_epi16(acc, _mm256_set1_epi16(128));
+	acc = _mm256_packus_epi16(acc, acc);
+
+	/* packus works per 128-bit lane; gather the low quadword of each */
+	return _mm256_castsi256_si128(_mm256_permute4x64_epi64(acc, 0x08));
+}
+
+__attribute__((target("avx2")))
+static void rows_avx2(struct i420_conv *conv, size_t width,
+		const unsigned char *rgb0, const unsigned char *rgb1,
+		unsigned char *y0, unsigned char *y1,
+		unsigned char *u, unsigned char *v)
+{
+	size_t i;
+	__m256i r0, g0, b0, r1, g1, b1, sr, sg, sb;
+
+	for (i = 0; i + 32 <= width; i += 32) {
+		deinterleave_avx2(rgb0 + i * 3, &r0, &g0, &b0);
+		deinterleave_avx2(rgb1 + i * 3, &r1, &g1, &b1);
+
+		_mm256_storeu_si256((__m256i *) (y0 + i), _mm256_packus_epi16(
+				luma_avx2(conv, r0, g0, b0, 0),
+				luma_avx2(conv, r0, g0, b0, 1)));
+		_mm256_storeu_si256((__m256i *) (y1 + i), _mm256_packus_epi16(
+				luma_avx2(conv, r1, g1, b1, 0),
+				luma_avx2(conv, r1, g1, b1, 1)));
+
+		sr = sum2x2_avx2(r0, r1);
+		sg = sum2x2_avx2(g0, g1);
+		sb = sum2x2_avx2(b0, b1);
+
+		_mm_storeu_si128((__m128i *) (u + i / 2),
+				chroma_avx2(conv->u, sr, sg, sb));
+		_mm_storeu_si128((__m128i *) (v + i / 2),
+				chroma_avx2(conv->v, sr, sg, sb));
+	}
+
+	rows_sse2(conv, width - i, rgb0 + i * 3, rgb1 + i * 3, y0 + i, y1 + i,
+			u + i / 2, v + i / 2);
+}
+#endif /* I420_AVX2 */
+
+static int q15(double x)
+{
+	return (int) (x * 32768.0 + (x < 0 ? -0.5 : 0.5));
+}
+
+struct i420_conv *i420_conv_new(enum i420_matrix matrix,
+		enum i420_range range)
+{
+	int rc;
+	struct i420_conv *conv = NULL;
+	double kr, kb, ys, cs;
+
+	switch (matrix) {
+	case I420_BT601:
+		kr = 0.299;
+		kb = 0.114;
+		break;
+	case I420_BT709:
+		kr = 0.2126;
+		kb = 0.0722;
+		break;
+	default:
+		rc = EINVAL;
+		error("invalid matrix: %d", matrix);
+		goto finally;
+	}
+
+	if (range != I420_LIMITED && range != I420_FULL) {
+		rc = EINVAL;
+		error("invalid range: %d", range);
+		goto finally;
+	}
+
+	if (!(conv = calloc(1, sizeof(*conv)))) {
+		rc = errno ? errno : -1;
+		error("calloc: %s", strerror(rc));
+		goto finally;
+	}
+
+	ys = range == I420_FULL ? 1.0 : 219.0 / 255.0;
+	cs = range == I420_FULL ? 1.0 : 224.0 / 255.0;
+
+	conv->y[0] = q15(kr * ys);
+	conv->y[2] = q15(kb * ys);
+	conv->y[1] = q15(ys) - conv->y[0] - conv->y[2];
+	conv->y_offset = range == I420_FULL ? 0 : 16;
+
+	/* rows of the chroma matrix sum to zero so that grey stays neutral */
+	conv->u[0] = q15(-0.5 * kr / (1.0 - kb) * cs);
+	conv->u[2] = q15(0.5 * cs);
+	conv->u[1] = -conv->u[0] - conv->u[2];
+
+	conv->v[0] = q15(0.5 * cs);
+	conv->v[2] = q15(-0.5 * kb / (1.0 - kr) * cs);
+	conv->v[1] = -conv->v[0] - conv->v[2];
+
+	conv->rows = rows_c;
+
+#ifdef I420_SSE2
+	conv->rows = rows_sse2;
+#endif
+#ifdef I420_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+		conv->rows = rows_avx2;
+	}
+#endif
+
+	rc = 0;
+
+finally:
+	if (rc != 0) {
+		if (conv) {
+			i420_conv_free(conv);
+		}
+		conv = NULL;
+		errno = rc;
+	}
+	return conv;
+}
+
+void i420_conv_free(struct i420_conv *conv)
+{
+	if (!conv) {
+		return;
+	}
+
+	free(conv);
+}
+
+int i420_conv_rows(struct i420_conv *conv, size_t width,
+		const unsigned char *rgb0, const unsigned char *rgb1,
+		unsigned char *y0, unsigned char *y1,
+		unsigned char *u, unsigned char *v)
+{
+	if (width % 2) {
+		return EINVAL;
+	}
+
+	(*conv->rows)(conv, width, rgb0, rgb1, y0, y1, u, v);
+	return 0;
+}
+
+int i420_colorspace_parse(enum i420_matrix *matrix, enum i420_range *range,
+		const char *str)
+{
+	const char *sep;
+	size_t len;
+
+	if (!matrix || !range || !str) {
+		return EINVAL;
+	}
+
+	len = (sep = strchr(str, ':')) ? sep - str : strlen(str);
+
+	if (len == 5 && !strncasecmp(str, "bt601", len)) {
+		*matrix = I420_BT601;
+	} else if (len == 5 && !strncasecmp(str, "bt709", len)) {
+		*matrix = I420_BT709;
+	} else {
+		return EINVAL;
+	}
+
+	if (!sep) {
+		return 0;
+	}
+
+	if (!strcasecmp(sep + 1, "limited")) {
+		*range = I420_LIMITED;
+	} else if (!strcasecmp(sep + 1, "full")) {
+		*range = I420_FULL;
+	} else {
+		return EINVAL;
+	}
+
+	return 0;
+}
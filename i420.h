@@ -0,0 +1,52 @@
+// $Id$
+/*
+ * Copyright 2013 Cedric Shih (cedric dot shih at gmail dot com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef I420_H_
+#define I420_H_
+
+#include <sys/types.h>
+
+enum i420_matrix {
+	I420_BT601 = 0,
+	I420_BT709,
+};
+
+enum i420_range {
+	I420_LIMITED = 0,
+	I420_FULL,
+};
+
+struct i420_conv;
+
+struct i420_conv *i420_conv_new(enum i420_matrix matrix,
+		enum i420_range range);
+
+void i420_conv_free(struct i420_conv *conv);
+
+/*
+ * Converts a pair of RGB24 scanlines into two luma rows and one row of each
+ * 2x2 subsampled chroma plane; width must be even.
+ */
+int i420_conv_rows(struct i420_conv *conv, size_t width,
+		const unsigned char *rgb0, const unsigned char *rgb1,
+		unsigned char *y0, unsigned char *y1,
+		unsigned char *u, unsigned char *v);
+
+int i420_colorspace_parse(enum i420_matrix *matrix, enum i420_range *range,
+		const char *str);
+
+#endif /* I420_H_ */
@@ -21,44 +21,173 @@
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/queue.h>
 
 #include "log.h"
 #include "jpg2rgb.h"
 #include "resize.h"
-#include "rgb2yuv.h"
+#include "i420.h"
 #include "avcenc.h"
 #include "avi.h"
+#include "mp4.h"
 #include "histogram.h"
+#include "cache.h"
 
 #include "jpg2avc.h"
 
 #define PIXEL_MIN 0
 #define PIXEL_MAX 255
 
+/* x264 default keyint, used when -k leaves it to the preset */
+#define SEGMENT_LENGTH 250
+
+/* bump whenever decode() produces different pictures */
+#define CACHE_VERSION 1
+
+/* how far deflicker may brighten or darken a frame */
+#define DEFLICKER_MAX_GAIN 2.0
+
+struct jpg2avc_frame {
+	char *jpg;
+	double a;
+	int b;
+	int decoded;
+	int rc;
+	unsigned char *buf;
+	unsigned char *scanline;
+	unsigned long luma[256];
+};
+
+struct jpg2avc_packet {
+	unsigned char *data;
+	size_t len;
+	int keyframe;
+	int64_t pts;
+	int64_t dts;
+};
+
+/* a run of frames encoded as closed GOPs by a session of its own */
+struct jpg2avc_segment {
+	struct jpg2avc *ctx;
+	struct jpg2avc_frame *frames;
+	size_t num_frames;
+	size_t reported;
+	struct jpg2avc_packet *packets;
+	size_t num_packets;
+	size_t cap_packets;
+	size_t written;
+	int64_t base;
+	int queued;
+	int running;
+	int done;
+	int rc;
+	TAILQ_ENTRY(jpg2avc_segment) next;
+};
+
+TAILQ_HEAD(jpg2avc_segments, jpg2avc_segment);
+
+/* everything besides the file that decides a cached picture */
+struct jpg2avc_variant {
+	u_int32_t version;
+	u_int32_t width;
+	u_int32_t height;
+	u_int32_t black;
+	u_int32_t white;
+	u_int32_t matrix;
+	u_int32_t range;
+	int32_t b;
+	double a;
+};
+
 struct jpg2avc {
 	char *profile;
+	struct avcenc_params params;
 	struct pit_dim size;
 	struct pit_frac frame_rate;
-	unsigned char *frame_buf;
 	size_t frame_buf_sz;
 	unsigned int ref_frame;
 	struct {
 		unsigned int black;
 		unsigned int white;
 	} stretch;
+	struct {
+		unsigned int num_threads;
+		unsigned int num_running;
+		pthread_t *threads;
+		struct jpg2avc_frame *frames;
+		unsigned int num_frames;
+		size_t head;
+		size_t next;
+		size_t tail;
+		int quit;
+		pthread_mutex_t mutex;
+		pthread_cond_t queued;
+		pthread_cond_t decoded;
+	} pool;
+	struct {
+		enum i420_matrix matrix;
+		enum i420_range range;
+		struct i420_conv *conv;
+	} colorspace;
+	struct {
+		unsigned int sessions;
+		unsigned int length;
+		struct jpg2avc_segments list;
+		struct jpg2avc_segment *open;
+		size_t queued;
+		size_t written;
+		char *jpg;
+	} segment;
+	struct {
+		unsigned int radius;
+		double *past;
+		double *future;
+		size_t seen;
+	} deflicker;
+	struct cache *cache;
 	struct avcenc_session *session;
 	struct avi_writer *writer;
+	struct mp4_writer *mp4;
 	unsigned int count;
+	struct pit_timer stages[JPG2AVC_STAGES];
+	struct pit_prof prof;
+};
+
+static const char *stage_names[JPG2AVC_STAGES] = {
+		"cache",
+		"header",
+		"decode",
+		"stretch",
+		"resize",
+		"convert",
+		"deflicker",
+		"encode",
+		"write",
 };
 
-static int resize(const char *infile, unsigned int w1, unsigned int h1,
-		const char *outfile, unsigned int w2, unsigned int h2);
-static int rgb2yuv(const char *srcfile, unsigned int w, unsigned int h,
-		unsigned char *dst);
-ssize_t read_file(const char *filename, void *dst, size_t maxlen);
+static int pool_start(struct jpg2avc *ctx);
+static void pool_stop(struct jpg2avc *ctx);
+static int transcode(struct jpg2avc *ctx, struct jpg2avc_frame *frame,
+		struct pit_prof *prof);
+static void deflicker(struct jpg2avc *ctx, size_t ahead);
+static int decode(struct jpg2avc *ctx, const char *jpg, double a, int b,
+		unsigned long *luma,
+		unsigned char *frame, unsigned char *scanline,
+		struct pit_prof *prof);
+static int write_frame(struct avcenc_session *session,
+		const struct avcenc_frame *frame, void *cbarg);
+static int write_packet(struct jpg2avc *ctx,
+		const struct avcenc_frame *frame);
+static void *segment_worker(void *arg);
+static void segment_free(struct jpg2avc_segment *segment);
+static int segment_submit(struct jpg2avc *ctx, char *jpg, double a, int b);
+static void segment_queue(struct jpg2avc *ctx);
+static int segment_next(struct jpg2avc *ctx, const char **jpg);
+static int segment_drain(struct jpg2avc *ctx, int wait);
 
 struct jpg2avc *jpg2avc_new(struct pit_dim *size, struct pit_frac *frame_rate,
-		const char *profile)
+		const char *profile, const struct avcenc_params *params)
 {
 	int rc;
 	struct jpg2avc *ctx;
@@ -69,25 +198,34 @@ struct jpg2avc *jpg2avc_new(struct pit_dim *size, struct pit_frac *frame_rate,
 		goto finally;
 	}
 
+	pthread_mutex_init(&ctx->pool.mutex, NULL);
+	pthread_cond_init(&ctx->pool.queued, NULL);
+	pthread_cond_init(&ctx->pool.decoded, NULL);
+	TAILQ_INIT(&ctx->segment.list);
+
 	if (!(ctx->profile = strdup(profile))) {
 		rc = errno ? errno : -1;
 		error("strdup: %s", strerror(rc));
 		goto finally;
 	}
 
-	ctx->frame_buf_sz = size->width * size->height * 3 / 2;
-
-	if (!(ctx->frame_buf = malloc(ctx->frame_buf_sz))) {
-		rc = errno ? errno : -1;
-		error("malloc: %s", strerror(rc));
-		goto finally;
+	if (params) {
+		memcpy(&ctx->params, params, sizeof(ctx->params));
+	} else {
+		avcenc_params_init(&ctx->params);
 	}
 
+	ctx->frame_buf_sz = size->width * size->height * 3 / 2;
+
 	memcpy(&ctx->size, size, sizeof(ctx->size));
 	memcpy(&ctx->frame_rate, frame_rate, sizeof(ctx->frame_rate));
 
 	ctx->stretch.black = 0;
 	ctx->stretch.white = 255;
+	ctx->pool.num_threads = 1;
+	ctx->segment.sessions = 1;
+	ctx->colorspace.matrix = I420_BT601;
+	ctx->colorspace.range = I420_LIMITED;
 	rc = 0;
 
 finally:
@@ -111,12 +249,34 @@ void jpg2avc_free(struct jpg2avc *ctx)
 		avi_writer_free(ctx->writer);
 	}
 
+	if (ctx->mp4) {
+		mp4_writer_free(ctx->mp4);
+	}
+
 	if (ctx->session) {
 		avcenc_session_free(ctx->session);
 	}
 
-	if (ctx->frame_buf) {
-		free(ctx->frame_buf);
+	pool_stop(ctx);
+
+	if (ctx->colorspace.conv) {
+		i420_conv_free(ctx->colorspace.conv);
+	}
+
+	if (ctx->segment.jpg) {
+		free(ctx->segment.jpg);
+	}
+
+	if (ctx->cache) {
+		cache_free(ctx->cache);
+	}
+
+	pthread_cond_destroy(&ctx->pool.decoded);
+	pthread_cond_destroy(&ctx->pool.queued);
+	pthread_mutex_destroy(&ctx->pool.mutex);
+
+	if (ctx->profile) {
+		free(ctx->profile);
 	}
 
 	free(ctx);
@@ -150,6 +310,105 @@ int jpg2avc_stretch_white(struct jpg2avc *ctx, unsigned int white)
 	return 0;
 }
 
+int jpg2avc_threads(struct jpg2avc *ctx, unsigned int threads)
+{
+	long n;
+
+	if (!ctx) {
+		return EINVAL;
+	}
+
+	if (ctx->pool.threads) {
+		return EINPROGRESS;
+	}
+
+	if (threads == 0) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = n > 0 ? n : 1;
+	}
+
+	ctx->pool.num_threads = threads;
+	return 0;
+}
+
+int jpg2avc_segments(struct jpg2avc *ctx, unsigned int sessions,
+		unsigned int length)
+{
+	if (!ctx || sessions < 1) {
+		return EINVAL;
+	}
+
+	if (ctx->pool.threads) {
+		return EINPROGRESS;
+	}
+
+	if (length == 0) {
+		length = ctx->params.keyint ? ctx->params.keyint
+				: SEGMENT_LENGTH;
+	}
+
+	ctx->segment.sessions = sessions;
+	ctx->segment.length = length;
+	return 0;
+}
+
+int jpg2avc_cache(struct jpg2avc *ctx, const char *dir, off_t cap)
+{
+	int rc;
+	struct cache *cache;
+
+	if (!ctx || !dir) {
+		return EINVAL;
+	}
+
+	if (ctx->pool.threads) {
+		return EINPROGRESS;
+	}
+
+	if (!(cache = cache_new(dir, cap))) {
+		rc = errno ? errno : -1;
+		error("cache_new: %s", strerror(rc));
+		return rc;
+	}
+
+	if (ctx->cache) {
+		cache_free(ctx->cache);
+	}
+
+	ctx->cache = cache;
+	return 0;
+}
+
+int jpg2avc_deflicker(struct jpg2avc *ctx, unsigned int radius)
+{
+	if (!ctx || radius > JPG2AVC_DEFLICKER_MAX) {
+		return EINVAL;
+	}
+
+	if (ctx->pool.threads) {
+		return EINPROGRESS;
+	}
+
+	ctx->deflicker.radius = radius;
+	return 0;
+}
+
+int jpg2avc_colorspace(struct jpg2avc *ctx, enum i420_matrix matrix,
+		enum i420_range range)
+{
+	if (!ctx) {
+		return EINVAL;
+	}
+
+	if (ctx->pool.threads) {
+		return EINPROGRESS;
+	}
+
+	ctx->colorspace.matrix = matrix;
+	ctx->colorspace.range = range;
+	return 0;
+}
+
 int jpg2avc_begin(struct jpg2avc *ctx, const char *output)
 {
 	int rc;
@@ -159,116 +418,248 @@ int jpg2avc_begin(struct jpg2avc *ctx, const char *output)
 		goto finally;
 	}
 
-	if (ctx->writer || ctx->session) {
+	if (ctx->writer || ctx->mp4 || ctx->session) {
 		rc = EEXIST;
 		goto finally;
 	}
 
-	if (!(ctx->writer = avi_writer_new(avi_fourcc('a', 'v', 'c', '1'),
-			&ctx->size, &ctx->frame_rate))) {
-		rc = errno ? errno : -1;
-		error("avi_writer_new: %s", strerror(rc));
+	/* deflicker looks ahead into the decoder ring */
+	if (ctx->deflicker.radius && ctx->segment.sessions > 1) {
+		rc = EINVAL;
+		error("deflicker needs a single encoder session");
 		goto finally;
 	}
 
-	if ((rc = avi_writer_open(ctx->writer, output))) {
-		error("avi_writer_open: %s\n", strerror(rc));
-		goto finally;
+	if (mp4_filename(output)) {
+		if (!(ctx->mp4 = mp4_writer_new(&ctx->size, &ctx->frame_rate,
+				0))) {
+			rc = errno ? errno : -1;
+			error("mp4_writer_new: %s", strerror(rc));
+			goto finally;
+		}
+
+		if ((rc = mp4_writer_open(ctx->mp4, output))) {
+			error("mp4_writer_open: %s\n", strerror(rc));
+			goto finally;
+		}
+	} else {
+		if (!(ctx->writer = avi_writer_new(
+				avi_fourcc('a', 'v', 'c', '1'),
+				&ctx->size, &ctx->frame_rate))) {
+			rc = errno ? errno : -1;
+			error("avi_writer_new: %s", strerror(rc));
+			goto finally;
+		}
+
+		if ((rc = avi_writer_open(ctx->writer, output))) {
+			error("avi_writer_open: %s\n", strerror(rc));
+			goto finally;
+		}
 	}
 
-	if (!(ctx->session = avcenc_session_new(ctx->profile,
-			&ctx->size, &ctx->frame_rate))) {
+	if (!(ctx->colorspace.conv = i420_conv_new(ctx->colorspace.matrix,
+			ctx->colorspace.range))) {
 		rc = errno ? errno : -1;
-		error("avcenc_session_new: %s", strerror(rc));
+		error("i420_conv_new: %s", strerror(rc));
+		goto finally;
+	}
+
+	/* segment workers open sessions of their own */
+	if (ctx->segment.sessions == 1) {
+		if (!(ctx->session = avcenc_session_new(ctx->profile,
+				&ctx->size, &ctx->frame_rate,
+				ctx->colorspace.matrix, ctx->colorspace.range,
+				&ctx->params))) {
+			rc = errno ? errno : -1;
+			error("avcenc_session_new: %s", strerror(rc));
+			goto finally;
+		}
+
+		avcenc_session_set_cb(ctx->session, write_frame, ctx);
+	}
+
+	memset(ctx->stages, '\0', sizeof(ctx->stages));
+
+	if ((rc = pool_start(ctx))) {
+		error("failed to start decoder threads: %s", strerror(rc));
 		goto finally;
 	}
 
 	ctx->count = 0;
+	ctx->segment.written = 0;
 	rc = 0;
 
 finally:
 	if (rc != 0) {
+		pool_stop(ctx);
+
 		if (ctx->writer) {
 			avi_writer_free(ctx->writer);
 			ctx->writer = NULL;
 		}
 
+		if (ctx->mp4) {
+			mp4_writer_free(ctx->mp4);
+			ctx->mp4 = NULL;
+		}
+
 		if (ctx->session) {
 			avcenc_session_free(ctx->session);
 			ctx->session = NULL;
 		}
+
+		if (ctx->colorspace.conv) {
+			i420_conv_free(ctx->colorspace.conv);
+			ctx->colorspace.conv = NULL;
+		}
 	}
 	return rc;
 }
 
-int jpg2avc_transcode(struct jpg2avc *ctx, const char *jpg, const char *rgb,
-		const char *resized, const char *avc, double a, int b)
+int jpg2avc_submit(struct jpg2avc *ctx, const char *jpg, double a, int b)
 {
 	int rc;
-	struct pit_dim sz;
-	size_t n;
+	struct jpg2avc_frame *frame;
+	char *path = NULL;
 
-	if (!ctx || !jpg || !rgb || !resized || !avc) {
-		return EINVAL;
+	if (!ctx || !jpg) {
+		rc = EINVAL;
+		goto finally;
 	}
 
-	if ((rc = jpg_read_header(jpg, &sz.width, &sz.height))) {
-		debug("failed to read header '%s': %s", jpg, strerror(rc));
-		rc = EINVAL;
+	if (!ctx->pool.threads) {
+		rc = -1;
 		goto finally;
 	}
 
-	if (sz.width < ctx->size.width || sz.height < ctx->size.height) {
-		debug("smaller resolution '%s': %dx%d\n", jpg,
-				sz.width, sz.height);
-		rc = EINVAL;
+	if (!(path = strdup(jpg))) {
+		rc = errno ? errno : -1;
+		error("strdup: %s", strerror(rc));
 		goto finally;
 	}
 
-	if ((((float) ctx->size.width) / sz.width * sz.height) != ctx->size.height) {
-		debug("aspect ratio mismatched '%s': %dx%d\n", jpg,
-				sz.width, sz.height);
-		rc = EINVAL;
+	pthread_mutex_lock(&ctx->pool.mutex);
+
+	if (ctx->segment.sessions > 1) {
+		if (!(rc = segment_submit(ctx, path, a, b))) {
+			path = NULL;
+		}
+
+		pthread_mutex_unlock(&ctx->pool.mutex);
 		goto finally;
 	}
 
-	if ((rc = jpg2rgb(jpg, rgb, ctx->stretch.black, ctx->stretch.white, a,
-			b, NULL, NULL))) {
-		error("failed to convert '%s': %s", jpg, strerror(rc));
+	if (ctx->pool.tail - ctx->pool.head >= ctx->pool.num_frames) {
+		pthread_mutex_unlock(&ctx->pool.mutex);
+		rc = EBUSY;
 		goto finally;
 	}
 
-	if (sz.width != ctx->size.width || sz.height != ctx->size.height) {
-		if ((rc = resize(rgb, sz.width, sz.height, resized,
-				ctx->size.width, ctx->size.height))) {
-			error("failed to resize '%s': %s", rgb, strerror(rc));
-			goto finally;
-		}
-	} else {
-		resized = rgb;
+	frame = ctx->pool.frames + (ctx->pool.tail % ctx->pool.num_frames);
+
+	if (frame->jpg) {
+		free(frame->jpg);
+	}
+
+	frame->jpg = path;
+	frame->a = a;
+	frame->b = b;
+	frame->decoded = 0;
+	frame->rc = 0;
+	path = NULL;
+
+	ctx->pool.tail++;
+	pthread_cond_signal(&ctx->pool.queued);
+	pthread_mutex_unlock(&ctx->pool.mutex);
+
+	rc = 0;
+
+finally:
+	if (path) {
+		free(path);
+	}
+	return rc;
+}
+
+size_t jpg2avc_queued_frames(struct jpg2avc *ctx)
+{
+	size_t n;
+
+	pthread_mutex_lock(&ctx->pool.mutex);
+	n = ctx->segment.sessions > 1 ? ctx->segment.queued
+			: ctx->pool.tail - ctx->pool.head;
+	pthread_mutex_unlock(&ctx->pool.mutex);
+
+	return n;
+}
+
+int jpg2avc_next(struct jpg2avc *ctx, const char **jpg)
+{
+	int rc;
+	struct jpg2avc_frame *frame = NULL;
+	size_t i, ahead;
+
+	if (!ctx) {
+		return EINVAL;
 	}
 
-	if ((rc = rgb2yuv(resized, ctx->size.width, ctx->size.height,
-			ctx->frame_buf))) {
-		error("failed to convert '%s': %s", resized, strerror(rc));
+	if (ctx->segment.sessions > 1) {
+		return segment_next(ctx, jpg);
+	}
+
+	pthread_mutex_lock(&ctx->pool.mutex);
+
+	if (ctx->pool.head == ctx->pool.tail) {
+		pthread_mutex_unlock(&ctx->pool.mutex);
+		rc = ENOENT;
 		goto finally;
 	}
 
-	if ((rc = avcenc_session_encode(ctx->session, ctx->frame_buf, avc))) {
-		if (rc != EAGAIN) {
-			error("failed to encode: %s", strerror(rc));
-			goto finally;
-		}
+	frame = ctx->pool.frames + (ctx->pool.head % ctx->pool.num_frames);
+
+	while (!frame->decoded) {
+		pthread_cond_wait(&ctx->pool.decoded, &ctx->pool.mutex);
 	}
 
-	if (rc != EAGAIN) {
-		if ((n = read_file(avc, ctx->frame_buf, ctx->frame_buf_sz)) < 0) {
-			error("failed to read file '%s': %s", avc, strerror(rc));
-			goto finally;
+	ahead = 0;
+
+	if (ctx->deflicker.radius) {
+		ahead = ctx->pool.tail - ctx->pool.head - 1;
+		ahead = ahead < ctx->deflicker.radius ? ahead
+				: ctx->deflicker.radius;
+
+		for (i = 1; i <= ahead; i++) {
+			while (!ctx->pool.frames[(ctx->pool.head + i) %
+					ctx->pool.num_frames].decoded) {
+				pthread_cond_wait(&ctx->pool.decoded,
+						&ctx->pool.mutex);
+			}
 		}
+	}
+
+	pthread_mutex_unlock(&ctx->pool.mutex);
+
+	if (jpg) {
+		*jpg = frame->jpg;
+	}
+
+	if ((rc = frame->rc)) {
+		goto finally;
+	}
+
+	pit_prof_start(&ctx->prof, ctx->stages);
+
+	if (ctx->deflicker.radius) {
+		deflicker(ctx, ahead);
+		pit_prof_lap(&ctx->prof, JPG2AVC_DEFLICKER);
+	}
+
+	rc = avcenc_session_encode(ctx->session, frame->buf);
+	pit_prof_lap(&ctx->prof, JPG2AVC_ENCODE);
 
-		if ((rc = avi_writer_write(ctx->writer, ctx->frame_buf, n))) {
-			error("failed to write AVI: %s", strerror(rc));
+	if (rc) {
+		if (rc != EAGAIN) {
+			error("failed to encode: %s", strerror(rc));
 			goto finally;
 		}
 	}
@@ -277,57 +668,57 @@ int jpg2avc_transcode(struct jpg2avc *ctx, const char *jpg, const char *rgb,
 	rc = 0;
 
 finally:
-	if (avc) {
-		unlink(avc);
-	}
-	if (resized) {
-		unlink(resized);
-	}
-	if (rgb) {
-		unlink(rgb);
+	if (frame) {
+		pthread_mutex_lock(&ctx->pool.mutex);
+		ctx->pool.head++;
+		pthread_mutex_unlock(&ctx->pool.mutex);
 	}
 	return rc;
 }
 
 size_t jpg2avc_pending_frames(struct jpg2avc *ctx)
 {
+	if (ctx->segment.sessions > 1) {
+		return ctx->count - ctx->segment.written;
+	}
+
 	return avcenc_session_pending_frames(ctx->session);
 }
 
-int jpg2avc_flush(struct jpg2avc *ctx, const char *avc)
+int jpg2avc_flush(struct jpg2avc *ctx)
 {
 	int rc;
-	size_t n;
 
-	if (!ctx || !avc) {
+	if (!ctx) {
 		rc = EINVAL;
 		goto finally;
 	}
 
-	if (!ctx->writer || !ctx->session) {
+	if (!ctx->pool.threads) {
 		rc = -1;
 		goto finally;
 	}
 
-	if ((rc = avcenc_session_flush(ctx->session, avc))) {
-		if (rc != EAGAIN) {
-			error("avcenc_session_flush: %s\n", strerror(rc));
-			goto finally;
-		}
-	}
+	if (ctx->segment.sessions > 1) {
+		pthread_mutex_lock(&ctx->pool.mutex);
 
-	if (rc != EAGAIN) {
-		if ((n = read_file(avc, ctx->frame_buf, ctx->frame_buf_sz)) < 0) {
-			error("failed to read file '%s': %s", avc, strerror(rc));
-			goto finally;
+		if (ctx->segment.open) {
+			segment_queue(ctx);
 		}
 
-		if ((rc = avi_writer_write(ctx->writer, ctx->frame_buf, n))) {
-			error("failed to write AVI: %s", strerror(rc));
+		pthread_mutex_unlock(&ctx->pool.mutex);
+		rc = segment_drain(ctx, 1);
+	} else {
+		pit_prof_start(&ctx->prof, ctx->stages);
+		rc = avcenc_session_flush(ctx->session);
+		pit_prof_lap(&ctx->prof, JPG2AVC_ENCODE);
+	}
+
+	if (rc) {
+		if (rc != EAGAIN) {
+			error("avcenc_session_flush: %s\n", strerror(rc));
 			goto finally;
 		}
-
-		rc = 0;
 	}
 
 finally:
@@ -343,29 +734,53 @@ int jpg2avc_commit(struct jpg2avc *ctx)
 		goto finally;
 	}
 
-	if (!ctx->writer || !ctx->session) {
+	if (!ctx->pool.threads) {
 		rc = -1;
 		goto finally;
 	}
 
-	if (avcenc_session_pending_frames(ctx->session) > 0) {
+	if (jpg2avc_queued_frames(ctx) > 0) {
+		rc = EINPROGRESS;
+		error("has queued frames: %zu", jpg2avc_queued_frames(ctx));
+		goto finally;
+	}
+
+	if (jpg2avc_pending_frames(ctx) > 0) {
 		rc = EINPROGRESS;
-		error("has pending frames: %d", avcenc_session_pending_frames(
-				ctx->session));
+		error("has pending frames: %zu", jpg2avc_pending_frames(ctx));
 		goto finally;
 	}
 
-	if ((rc = avi_writer_close(ctx->writer))) {
-		error("avi_writer_close: %s\n", strerror(rc));
+	pit_prof_start(&ctx->prof, ctx->stages);
+	if (ctx->mp4) {
+		rc = mp4_writer_close(ctx->mp4);
+	} else {
+		rc = avi_writer_close(ctx->writer);
+	}
+	pit_prof_lap(&ctx->prof, JPG2AVC_WRITE);
+
+	if (rc) {
+		error("failed to close output: %s\n", strerror(rc));
 		goto finally;
 	}
 
-	avi_writer_free(ctx->writer);
-	ctx->writer = NULL;
+	if (ctx->mp4) {
+		mp4_writer_free(ctx->mp4);
+		ctx->mp4 = NULL;
+	} else {
+		avi_writer_free(ctx->writer);
+		ctx->writer = NULL;
+	}
+
+	if (ctx->session) {
+		avcenc_session_free(ctx->session);
+		ctx->session = NULL;
+	}
 
-	avcenc_session_free(ctx->session);
-	ctx->session = NULL;
+	pool_stop(ctx);
 
+	i420_conv_free(ctx->colorspace.conv);
+	ctx->colorspace.conv = NULL;
 	rc = 0;
 
 finally:
@@ -377,146 +792,1044 @@ size_t jpg2avc_count(struct jpg2avc *ctx)
 	return ctx->count;
 }
 
-int resize(const char *infile, unsigned int w1, unsigned int h1,
-		const char *outfile, unsigned int w2, unsigned int h2)
+const char *jpg2avc_stage_name(enum jpg2avc_stage stage)
 {
-	int rc;
-	FILE *f1 = NULL, *f2 = NULL;
-	struct imgsrc *src = NULL;
-	struct imgdst *dst = NULL;
-	int bpp1 = 3, bpp2 = 3;
-
-	if (!(f1 = fopen(infile, "rb"))) {
-		rc = errno ? errno : -1;
-		error("fopen: %s", strerror(rc));
-		goto finally;
+	if (stage < 0 || stage >= JPG2AVC_STAGES) {
+		return NULL;
 	}
 
-	if (!(f2 = fopen(outfile, "wb+"))) {
-		rc = errno ? errno : -1;
-		error("fopen: %s", strerror(rc));
-		goto finally;
+	return stage_names[stage];
+}
+
+int jpg2avc_stage_time(struct jpg2avc *ctx, enum jpg2avc_stage stage,
+		struct pit_timer *timer)
+{
+	if (!ctx || !timer || stage < 0 || stage >= JPG2AVC_STAGES) {
+		return EINVAL;
 	}
 
-	debug("resizing: %dx%d => %dx%d", w1, h2, w2, h2);
+	pthread_mutex_lock(&ctx->pool.mutex);
+	*timer = ctx->stages[stage];
+	pthread_mutex_unlock(&ctx->pool.mutex);
+	return 0;
+}
 
-	float fy = (float) h1 / h2;
-	int nrrows = (int)ceil(fy + 1.0f);
-	int pos = h2 / 2 * fy;
-	int t3 = pos + nrrows < h1 + 1 ? 0 : pos - h1 + 1;
+static void *pool_worker(void *arg)
+{
+	int rc, i;
+	struct jpg2avc *ctx = arg;
+	struct jpg2avc_frame *frame;
+	struct pit_timer stages[JPG2AVC_STAGES];
+	struct pit_prof prof;
+
+	pthread_mutex_lock(&ctx->pool.mutex);
+
+	while (!ctx->pool.quit) {
+		if (ctx->pool.next == ctx->pool.tail) {
+			pthread_cond_wait(&ctx->pool.queued, &ctx->pool.mutex);
+			continue;
+		}
 
-	if (!(src = fiosrc_new(f1, w1, h1, bpp1, nrrows + t3))) {
-		rc = errno ? errno : -1;
-		error("fiosrc_new: %s", strerror(rc));
-		goto finally;
-	}
+		frame = ctx->pool.frames + (ctx->pool.next++ %
+				ctx->pool.num_frames);
 
-	if (!(dst = fiodst_new(f2, w2, h2, bpp2))) {
-		rc = errno ? errno : -1;
-		error("fiodst_new: %s", strerror(rc));
-		goto finally;
-	}
+		pthread_mutex_unlock(&ctx->pool.mutex);
 
-	if ((rc = scale_down(src, dst))) {
-		error("scale_down: %s", strerror(rc));
-		goto finally;
-	}
+		memset(stages, '\0', sizeof(stages));
+		pit_prof_start(&prof, stages);
 
-	rc = 0;
+		rc = transcode(ctx, frame, &prof);
 
-finally:
-	if (dst) {
-		fiodst_free(dst);
-	}
-	if (src) {
-		fiosrc_free(src);
+		pthread_mutex_lock(&ctx->pool.mutex);
+
+		/* deflicker onwards runs on the caller of jpg2avc_next() */
+		for (i = 0; i < JPG2AVC_DEFLICKER; i++) {
+			ctx->stages[i].wall += stages[i].wall;
+			ctx->stages[i].cpu += stages[i].cpu;
+		}
+
+		frame->rc = rc;
+		frame->decoded = 1;
+		pthread_cond_broadcast(&ctx->pool.decoded);
+	}
+
+	pthread_mutex_unlock(&ctx->pool.mutex);
+	return NULL;
+}
+
+int pool_start(struct jpg2avc *ctx)
+{
+	int rc;
+	unsigned int i, num_threads;
+	struct jpg2avc_frame *frame;
+	void *(*worker)(void *);
+
+	ctx->pool.head = ctx->pool.next = ctx->pool.tail = 0;
+	ctx->pool.quit = 0;
+	ctx->pool.num_running = 0;
+	ctx->segment.queued = 0;
+	ctx->deflicker.seen = 0;
+
+	if (ctx->segment.sessions > 1) {
+		/* every segment worker decodes the frames it encodes */
+		worker = segment_worker;
+		num_threads = ctx->segment.sessions;
+		ctx->pool.num_frames = 0;
+	} else {
+		worker = pool_worker;
+		num_threads = ctx->pool.num_threads;
+
+		/* room for every thread to decode ahead while encoding */
+		ctx->pool.num_frames = ctx->pool.num_threads * 2 +
+				ctx->deflicker.radius;
 	}
-	if (f2) {
-		fclose(f2);
+
+	if (ctx->deflicker.radius && (!(ctx->deflicker.past = calloc(
+			ctx->deflicker.radius,
+			sizeof(*ctx->deflicker.past))) ||
+			!(ctx->deflicker.future = calloc(
+			ctx->deflicker.radius,
+			sizeof(*ctx->deflicker.future))))) {
+		rc = errno ? errno : -1;
+		error("calloc: %s", strerror(rc));
+		goto finally;
 	}
-	if (f1) {
-		fclose(f1);
+
+	if (ctx->pool.num_frames > 0 && !(ctx->pool.frames = calloc(
+			ctx->pool.num_frames,
+			sizeof(*ctx->pool.frames)))) {
+		rc = errno ? errno : -1;
+		error("calloc: %s", strerror(rc));
+		goto finally;
 	}
+
+	for (i = 0; i < ctx->pool.num_frames; i++) {
+		frame = ctx->pool.frames + i;
+
+		if (!(frame->buf = malloc(ctx->frame_buf_sz))) {
+			rc = errno ? errno : -1;
+			error("malloc: %s", strerror(rc));
+			goto finally;
+		}
+
+		if (!(frame->scanline = malloc(ctx->size.width * 3))) {
+			rc = errno ? errno : -1;
+			error("malloc: %s", strerror(rc));
+			goto finally;
+		}
+	}
+
+	if (!(ctx->pool.threads = calloc(num_threads,
+			sizeof(*ctx->pool.threads)))) {
+		rc = errno ? errno : -1;
+		error("calloc: %s", strerror(rc));
+		goto finally;
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		if ((rc = pthread_create(ctx->pool.threads + i, NULL,
+				worker, ctx))) {
+			error("pthread_create: %s", strerror(rc));
+			goto finally;
+		}
+
+		ctx->pool.num_running++;
+	}
+
+	debug("started %d %s threads", ctx->pool.num_running,
+			worker == pool_worker ? "decoder" : "segment");
+	rc = 0;
+
+finally:
 	return rc;
 }
 
-int rgb2yuv(const char *srcfile, unsigned int w, unsigned int h,
-		unsigned char *dst)
+void pool_stop(struct jpg2avc *ctx)
+{
+	unsigned int i;
+	struct jpg2avc_frame *frame;
+	struct jpg2avc_segment *segment;
+
+	pthread_mutex_lock(&ctx->pool.mutex);
+	ctx->pool.quit = 1;
+	pthread_cond_broadcast(&ctx->pool.queued);
+	pthread_mutex_unlock(&ctx->pool.mutex);
+
+	for (i = 0; i < ctx->pool.num_running; i++) {
+		pthread_join(ctx->pool.threads[i], NULL);
+	}
+
+	ctx->pool.num_running = 0;
+
+	if (ctx->pool.threads) {
+		free(ctx->pool.threads);
+		ctx->pool.threads = NULL;
+	}
+
+	if (ctx->pool.frames) {
+		for (i = 0; i < ctx->pool.num_frames; i++) {
+			frame = ctx->pool.frames + i;
+
+			if (frame->jpg) {
+				free(frame->jpg);
+			}
+
+			if (frame->buf) {
+				free(frame->buf);
+			}
+
+			if (frame->scanline) {
+				free(frame->scanline);
+			}
+		}
+
+		free(ctx->pool.frames);
+		ctx->pool.frames = NULL;
+	}
+
+	while ((segment = TAILQ_FIRST(&ctx->segment.list))) {
+		TAILQ_REMOVE(&ctx->segment.list, segment, next);
+		segment_free(segment);
+	}
+
+	ctx->segment.open = NULL;
+
+	if (ctx->deflicker.past) {
+		free(ctx->deflicker.past);
+		ctx->deflicker.past = NULL;
+	}
+
+	if (ctx->deflicker.future) {
+		free(ctx->deflicker.future);
+		ctx->deflicker.future = NULL;
+	}
+}
+
+int transcode(struct jpg2avc *ctx, struct jpg2avc_frame *frame,
+		struct pit_prof *prof)
 {
 	int rc;
-	size_t len, n;
-	unsigned char *src = NULL, *u, *v;
-	FILE *file = NULL;
+	struct pit_dim sz;
+	struct jpg2avc_variant variant;
+	unsigned long *luma = NULL;
+	size_t i;
 
-	len = w * h * 3;
+	if (ctx->deflicker.radius) {
+		luma = frame->luma;
+		memset(luma, '\0', sizeof(frame->luma));
+	}
 
-	if ((!(src = malloc(len)))) {
-		rc = errno ? errno : -1;
-		error("malloc: %s", strerror(rc));
+	if (ctx->cache) {
+		memset(&variant, '\0', sizeof(variant));
+		variant.version = CACHE_VERSION;
+		variant.width = ctx->size.width;
+		variant.height = ctx->size.height;
+		variant.black = ctx->stretch.black;
+		variant.white = ctx->stretch.white;
+		variant.matrix = ctx->colorspace.matrix;
+		variant.range = ctx->colorspace.range;
+		variant.a = frame->a;
+		variant.b = frame->b;
+
+		rc = cache_get(ctx->cache, frame->jpg, &variant,
+				sizeof(variant), frame->buf, ctx->frame_buf_sz);
+		pit_prof_lap(prof, JPG2AVC_CACHE);
+
+		if (rc == 0) {
+			if (luma) {
+				for (i = 0; i < ctx->size.width *
+						ctx->size.height; i++) {
+					luma[frame->buf[i]]++;
+				}
+			}
+
+			goto finally;
+		}
+	}
+
+	if ((rc = jpg_read_header(frame->jpg, &sz.width, &sz.height))) {
+		debug("failed to read header '%s': %s", frame->jpg,
+				strerror(rc));
+		rc = EINVAL;
+		goto finally;
+	}
+
+	if (sz.width < ctx->size.width || sz.height < ctx->size.height) {
+		debug("smaller resolution '%s': %zux%zu\n", frame->jpg,
+				sz.width, sz.height);
+		rc = EINVAL;
 		goto finally;
 	}
 
-	if (!(file = fopen(srcfile, "rb"))) {
+	if ((((float) ctx->size.width) / sz.width * sz.height) != ctx->size.height) {
+		debug("aspect ratio mismatched '%s': %zux%zu\n", frame->jpg,
+				sz.width, sz.height);
+		rc = EINVAL;
+		goto finally;
+	}
+
+	pit_prof_lap(prof, JPG2AVC_HEADER);
+
+	if ((rc = decode(ctx, frame->jpg, frame->a, frame->b, luma, frame->buf,
+			frame->scanline, prof))) {
+		error("failed to decode '%s': %s", frame->jpg, strerror(rc));
+		goto finally;
+	}
+
+	/* a frame that cannot be cached is still a good frame */
+	if (ctx->cache) {
+		if ((rc = cache_put(ctx->cache, frame->jpg, &variant,
+				sizeof(variant), frame->buf,
+				ctx->frame_buf_sz))) {
+			warn("failed to cache '%s': %s", frame->jpg,
+					strerror(rc));
+		}
+
+		pit_prof_lap(prof, JPG2AVC_CACHE);
+	}
+
+	rc = 0;
+
+finally:
+	return rc;
+}
+
+struct i420_sink {
+	struct pit_prof *prof;
+	struct i420_conv *conv;
+	unsigned char *frame;
+	unsigned char *scanline;
+	unsigned long *luma;
+	size_t width;
+	size_t height;
+};
+
+static int i420_write(unsigned char *row, int y, void *cbarg)
+{
+	struct i420_sink *sink = cbarg;
+	size_t i, w = sink->width, len = sink->width * sink->height;
+	unsigned char *u, *v, *luma;
+
+	pit_prof_lap(sink->prof, JPG2AVC_RESIZE);
+
+	if (!(y & 1)) {
+		memcpy(sink->scanline, row, w * 3);
+		pit_prof_lap(sink->prof, JPG2AVC_CONVERT);
+		return 0;
+	}
+
+	u = sink->frame + len;
+	v = u + (len >> 2);
+
+	if (i420_conv_rows(sink->conv, w, sink->scanline, row,
+			sink->frame + (y - 1) * w, sink->frame + y * w,
+			u + (y >> 1) * (w >> 1), v + (y >> 1) * (w >> 1))) {
+		error("odd width: %zu", w);
+		return EINVAL;
+	}
+
+	if (sink->luma) {
+		luma = sink->frame + (y - 1) * w;
+
+		for (i = 0; i < w * 2; i++) {
+			sink->luma[luma[i]]++;
+		}
+	}
+
+	pit_prof_lap(sink->prof, JPG2AVC_CONVERT);
+	return 0;
+}
+
+struct jpg_source {
+	struct pit_prof *prof;
+	struct jpg_reader *reader;
+};
+
+static int jpg_read(unsigned char *row, size_t len, void *cbarg)
+{
+	struct jpg_source *source = cbarg;
+
+	pit_prof_lap(source->prof, JPG2AVC_RESIZE);
+	return jpg_reader_read(source->reader, row, len);
+}
+
+int decode(struct jpg2avc *ctx, const char *jpg, double a, int b,
+		unsigned long *luma,
+		unsigned char *frame, unsigned char *scanline,
+		struct pit_prof *prof)
+{
+	int rc, scaled;
+	struct jpg_reader *reader = NULL;
+	struct imgsrc *src = NULL;
+	struct imgdst *dst = NULL;
+	struct i420_sink sink;
+	struct jpg_source source;
+	size_t w, h;
+
+	if (!(reader = jpg_reader_open(jpg, ctx->size.width, ctx->size.height,
+			ctx->stretch.black, ctx->stretch.white, a, b))) {
 		rc = errno ? errno : -1;
-		error("fopen: %s", strerror(rc));
+		error("jpg_reader_open: %s", strerror(rc));
 		goto finally;
 	}
 
-	if ((n = fread(src, 1, len, file)) != len) {
+	pit_prof_lap(prof, JPG2AVC_HEADER);
+	jpg_reader_prof(reader, prof, JPG2AVC_DECODE, JPG2AVC_STRETCH);
+
+	w = jpg_reader_width(reader);
+	h = jpg_reader_height(reader);
+	scaled = w != ctx->size.width || h != ctx->size.height;
+
+	source.prof = prof;
+	source.reader = reader;
+
+	if (!(src = cbsrc_new(w, h, 3, scaled ? scale_down_rows(h,
+			ctx->size.height) : 1, jpg_read, &source))) {
 		rc = errno ? errno : -1;
-		error("fread: %s", strerror(rc));
+		error("cbsrc_new: %s", strerror(rc));
 		goto finally;
 	}
 
-	len = w * h;
-	v = dst + len;
-	u = v + (len >> 2);
+	sink.prof = prof;
+	sink.conv = ctx->colorspace.conv;
+	sink.frame = frame;
+	sink.scanline = scanline;
+	sink.luma = luma;
+	sink.width = ctx->size.width;
+	sink.height = ctx->size.height;
 
-	if ((rc = RGB2YUV(w, h, src, dst, u, v, 1))) {
-		rc = errno ? errno : rc;
-		error("fread: %s", strerror(rc));
+	if (!(dst = cbdst_new(ctx->size.width, ctx->size.height, 3,
+			i420_write, &sink))) {
+		rc = errno ? errno : -1;
+		error("cbdst_new: %s", strerror(rc));
 		goto finally;
 	}
 
+	if (scaled) {
+		if ((rc = scale_down(src, dst))) {
+			error("scale_down: %s", strerror(rc));
+			goto finally;
+		}
+	} else {
+		if ((rc = scale_copy(src, dst))) {
+			error("scale_copy: %s", strerror(rc));
+			goto finally;
+		}
+	}
+
+	pit_prof_lap(prof, JPG2AVC_RESIZE);
 	rc = 0;
 
 finally:
+	if (dst) {
+		cbdst_free(dst);
+	}
 	if (src) {
-		free(src);
+		cbsrc_free(src);
 	}
-	if (file) {
-		fclose(file);
+	if (reader) {
+		jpg_reader_close(reader);
 	}
 	return rc;
 }
 
-ssize_t read_file(const char *filename, void *dst, size_t maxlen)
+static unsigned char clamp(int c)
+{
+	if (c < 0) {
+		return 0;
+	} else if (c > 255) {
+		return 255;
+	} else {
+		return (unsigned char) c;
+	}
+}
+
+/* mean luma of a frame above black, or -1 if it has no pixels */
+static double frame_mean(struct jpg2avc *ctx, struct jpg2avc_frame *frame)
+{
+	int v, black;
+	double sum = 0, n = 0;
+
+	black = ctx->colorspace.range == I420_LIMITED ? 16 : 0;
+
+	for (v = 0; v < 256; v++) {
+		sum += (double) frame->luma[v] * (v - black);
+		n += frame->luma[v];
+	}
+
+	return n > 0 ? sum / n : -1;
+}
+
+/*
+ * Scales a frame as jpg2rgb() would with a = gain, which moves luma and
+ * chroma away from black and neutral grey by the same factor.
+ */
+static void deflicker_apply(struct jpg2avc *ctx, unsigned char *buf,
+		double gain)
+{
+	int v, black;
+	unsigned char y[256], c[256];
+	size_t i, len = ctx->size.width * ctx->size.height;
+
+	black = ctx->colorspace.range == I420_LIMITED ? 16 : 0;
+
+	for (v = 0; v < 256; v++) {
+		y[v] = clamp(lround(black + (v - black) * gain));
+		c[v] = clamp(lround(128 + (v - 128) * gain));
+	}
+
+	for (i = 0; i < len; i++) {
+		buf[i] = y[buf[i]];
+	}
+
+	for (; i < ctx->frame_buf_sz; i++) {
+		buf[i] = c[buf[i]];
+	}
+}
+
+/*
+ * Gains the head frame towards the mean over a window as wide behind it as
+ * ahead, so that steady ramps such as fades pass through untouched.
+ */
+static void deflicker(struct jpg2avc *ctx, size_t ahead)
+{
+	struct jpg2avc_frame *frame, *next;
+	unsigned int radius = ctx->deflicker.radius;
+	double mean, m, sum, gain;
+	double *future = ctx->deflicker.future;
+	size_t i, n, r;
+
+	frame = ctx->pool.frames + (ctx->pool.head % ctx->pool.num_frames);
+
+	if ((mean = frame_mean(ctx, frame)) < 0) {
+		return;
+	}
+
+	for (i = 1, n = 0; i <= ahead; i++) {
+		next = ctx->pool.frames + ((ctx->pool.head + i) %
+				ctx->pool.num_frames);
+
+		if (!next->rc && (m = frame_mean(ctx, next)) >= 0) {
+			future[n++] = m;
+		}
+	}
+
+	r = ctx->deflicker.seen < radius ? ctx->deflicker.seen : radius;
+	r = n < r ? n : r;
+
+	for (i = 1, sum = mean; i <= r; i++) {
+		sum += ctx->deflicker.past[(ctx->deflicker.seen - i) % radius];
+		sum += future[i - 1];
+	}
+
+	ctx->deflicker.past[ctx->deflicker.seen++ % radius] = mean;
+
+	/* nearly black frames say nothing about exposure */
+	if (r == 0 || mean < 1) {
+		return;
+	}
+
+	gain = sum / (2 * r + 1) / mean;
+
+	if (gain > DEFLICKER_MAX_GAIN) {
+		gain = DEFLICKER_MAX_GAIN;
+	} else if (gain < 1 / DEFLICKER_MAX_GAIN) {
+		gain = 1 / DEFLICKER_MAX_GAIN;
+	}
+
+	if (fabs(gain - 1) >= 1.0 / 512) {
+		deflicker_apply(ctx, frame->buf, gain);
+	}
+}
+
+static int write_frame(struct avcenc_session *session,
+		const struct avcenc_frame *frame, void *cbarg)
 {
 	int rc;
-	FILE *file = NULL;
-	size_t n;
+	struct jpg2avc *ctx = cbarg;
+
+	pit_prof_lap(&ctx->prof, JPG2AVC_ENCODE);
+	rc = write_packet(ctx, frame);
+	pit_prof_lap(&ctx->prof, JPG2AVC_WRITE);
+	return rc;
+}
+
+static int write_packet(struct jpg2avc *ctx, const struct avcenc_frame *frame)
+{
+	int rc;
+
+	if (ctx->mp4) {
+		rc = mp4_writer_write(ctx->mp4, frame->data, frame->len,
+				frame->keyframe, frame->pts, frame->dts);
+	} else {
+		rc = avi_writer_write(ctx->writer, frame->data, frame->len,
+				frame->keyframe);
+	}
+
+	if (rc) {
+		error("failed to write frame: %s", strerror(rc));
+		goto finally;
+	}
+
+	rc = 0;
+
+finally:
+	return rc;
+}
+
+static struct jpg2avc_segment *segment_new(struct jpg2avc *ctx)
+{
+	struct jpg2avc_segment *segment;
+
+	if (!(segment = calloc(1, sizeof(*segment)))) {
+		error("failed to allocate for segment");
+		goto error;
+	}
+
+	segment->ctx = ctx;
+
+	if (!(segment->frames = calloc(ctx->segment.length,
+			sizeof(*segment->frames)))) {
+		error("failed to allocate for %u frames",
+				ctx->segment.length);
+		goto error;
+	}
+
+	return segment;
+error:
+	segment_free(segment);
+	return NULL;
+}
+
+void segment_free(struct jpg2avc_segment *segment)
+{
+	size_t i;
+
+	if (!segment) {
+		return;
+	}
+
+	if (segment->frames) {
+		for (i = 0; i < segment->num_frames; i++) {
+			if (segment->frames[i].jpg) {
+				free(segment->frames[i].jpg);
+			}
+		}
+
+		free(segment->frames);
+	}
+
+	if (segment->packets) {
+		for (i = segment->written; i < segment->num_packets; i++) {
+			free(segment->packets[i].data);
+		}
+
+		free(segment->packets);
+	}
+
+	free(segment);
+}
+
+/* called with the pool mutex held */
+int segment_submit(struct jpg2avc *ctx, char *jpg, double a, int b)
+{
+	struct jpg2avc_segment *segment;
+	struct jpg2avc_frame *frame;
+
+	/* one segment in flight per session */
+	if (ctx->segment.queued >= (size_t) ctx->segment.sessions
+			* ctx->segment.length) {
+		return EBUSY;
+	}
+
+	if (!(segment = ctx->segment.open)) {
+		if (!(segment = segment_new(ctx))) {
+			return ENOMEM;
+		}
+
+		TAILQ_INSERT_TAIL(&ctx->segment.list, segment, next);
+		ctx->segment.open = segment;
+	}
+
+	frame = segment->frames + segment->num_frames++;
+	frame->jpg = jpg;
+	frame->a = a;
+	frame->b = b;
+	frame->decoded = 0;
+	frame->rc = 0;
+
+	ctx->segment.queued++;
+
+	if (segment->num_frames == ctx->segment.length) {
+		segment_queue(ctx);
+	}
+
+	return 0;
+}
+
+/* hands the open segment to the workers; called with the mutex held */
+void segment_queue(struct jpg2avc *ctx)
+{
+	ctx->segment.open->queued = 1;
+	ctx->segment.open = NULL;
+	pthread_cond_signal(&ctx->pool.queued);
+}
+
+int segment_next(struct jpg2avc *ctx, const char **jpg)
+{
+	int rc, err;
+	struct jpg2avc_segment *segment;
+	struct jpg2avc_frame *frame;
+
+	pthread_mutex_lock(&ctx->pool.mutex);
+
+	TAILQ_FOREACH(segment, &ctx->segment.list, next) {
+		if (segment->reported < segment->num_frames) {
+			break;
+		}
+	}
 
-	if (!(file = fopen(filename, "rb"))) {
+	if (!segment) {
+		pthread_mutex_unlock(&ctx->pool.mutex);
+		return ENOENT;
+	}
+
+	/* a short last segment has to start before it can be waited on */
+	if (segment == ctx->segment.open) {
+		segment_queue(ctx);
+	}
+
+	frame = segment->frames + segment->reported;
+
+	while (!frame->decoded) {
+		pthread_cond_wait(&ctx->pool.decoded, &ctx->pool.mutex);
+	}
+
+	segment->reported++;
+	ctx->segment.queued--;
+
+	/* keep the name valid for the caller after the segment is gone */
+	if (ctx->segment.jpg) {
+		free(ctx->segment.jpg);
+	}
+
+	ctx->segment.jpg = frame->jpg;
+	frame->jpg = NULL;
+	rc = frame->rc;
+
+	pthread_mutex_unlock(&ctx->pool.mutex);
+
+	if (jpg) {
+		*jpg = ctx->segment.jpg;
+	}
+
+	if (rc == 0) {
+		ctx->count++;
+	}
+
+	if ((err = segment_drain(ctx, 0))) {
+		return err;
+	}
+
+	return rc;
+}
+
+/*
+ * Writes encoded frames in order, rebasing each segment's timestamps on the
+ * frames written before it; with wait it blocks until one frame is written.
+ */
+int segment_drain(struct jpg2avc *ctx, int wait)
+{
+	int rc, written = 0;
+	struct jpg2avc_segment *segment;
+	struct jpg2avc_packet *packet;
+	struct avcenc_frame frame;
+	struct pit_timer stages[JPG2AVC_STAGES];
+	struct pit_prof prof;
+
+	pthread_mutex_lock(&ctx->pool.mutex);
+
+	while ((segment = TAILQ_FIRST(&ctx->segment.list))) {
+		if (segment->written < segment->num_packets) {
+			if (segment->written == 0) {
+				segment->base = ctx->segment.written;
+			}
+
+			packet = segment->packets + segment->written++;
+			frame.data = packet->data;
+			frame.len = packet->len;
+			frame.keyframe = packet->keyframe;
+			frame.pts = packet->pts + segment->base;
+			frame.dts = packet->dts + segment->base;
+
+			pthread_mutex_unlock(&ctx->pool.mutex);
+
+			memset(stages, '\0', sizeof(stages));
+			pit_prof_start(&prof, stages);
+			rc = write_packet(ctx, &frame);
+			pit_prof_lap(&prof, JPG2AVC_WRITE);
+			free(frame.data);
+
+			pthread_mutex_lock(&ctx->pool.mutex);
+
+			ctx->stages[JPG2AVC_WRITE].wall +=
+					stages[JPG2AVC_WRITE].wall;
+			ctx->stages[JPG2AVC_WRITE].cpu +=
+					stages[JPG2AVC_WRITE].cpu;
+
+			if (rc) {
+				goto finally;
+			}
+
+			ctx->segment.written++;
+
+			if (wait) {
+				written = 1;
+				break;
+			}
+			continue;
+		}
+
+		if (segment->done && segment->reported == segment->num_frames) {
+			TAILQ_REMOVE(&ctx->segment.list, segment, next);
+
+			if ((rc = segment->rc)) {
+				error("failed to encode segment: %s",
+						strerror(rc));
+				segment_free(segment);
+				goto finally;
+			}
+
+			segment_free(segment);
+			continue;
+		}
+
+		if (!wait || segment->done) {
+			break;
+		}
+
+		pthread_cond_wait(&ctx->pool.decoded, &ctx->pool.mutex);
+	}
+
+	rc = wait && !written ? EAGAIN : 0;
+
+finally:
+	pthread_mutex_unlock(&ctx->pool.mutex);
+	return rc;
+}
+
+static int segment_packet(struct avcenc_session *session,
+		const struct avcenc_frame *frame, void *cbarg)
+{
+	int rc;
+	struct jpg2avc_segment *segment = cbarg;
+	struct jpg2avc *ctx = segment->ctx;
+	struct jpg2avc_packet *packet;
+	unsigned char *data;
+	size_t cap;
+
+	if (!(data = malloc(frame->len))) {
 		rc = errno ? errno : -1;
-		error("fopen: %s", strerror(rc));
+		error("malloc: %s", strerror(rc));
 		goto finally;
 	}
 
-	if ((n = fread(dst, 1, maxlen, file)) < 0) {
+	memcpy(data, frame->data, frame->len);
+
+	pthread_mutex_lock(&ctx->pool.mutex);
+
+	if (segment->num_packets == segment->cap_packets) {
+		cap = segment->cap_packets ? segment->cap_packets * 2
+				: segment->num_frames;
+
+		if (!(packet = realloc(segment->packets,
+				cap * sizeof(*packet)))) {
+			rc = errno ? errno : -1;
+			pthread_mutex_unlock(&ctx->pool.mutex);
+			error("realloc: %s", strerror(rc));
+			free(data);
+			goto finally;
+		}
+
+		segment->packets = packet;
+		segment->cap_packets = cap;
+	}
+
+	packet = segment->packets + segment->num_packets++;
+	packet->data = data;
+	packet->len = frame->len;
+	packet->keyframe = frame->keyframe;
+	packet->pts = frame->pts;
+	packet->dts = frame->dts;
+
+	pthread_cond_broadcast(&ctx->pool.decoded);
+	pthread_mutex_unlock(&ctx->pool.mutex);
+	rc = 0;
+
+finally:
+	return rc;
+}
+
+static int segment_encode(struct jpg2avc *ctx,
+		struct jpg2avc_segment *segment, struct avcenc_params *params)
+{
+	int rc, err, quit, i;
+	size_t n;
+	struct jpg2avc_frame *frame;
+	struct avcenc_session *session = NULL;
+	unsigned char *buf = NULL, *scanline = NULL;
+	struct pit_timer stages[JPG2AVC_STAGES];
+	struct pit_prof prof;
+
+	if (!(buf = malloc(ctx->frame_buf_sz)) ||
+			!(scanline = malloc(ctx->size.width * 3))) {
 		rc = errno ? errno : -1;
-		error("fread: %s", strerror(rc));
+		error("malloc: %s", strerror(rc));
+		goto finally;
+	}
+
+	/* a fresh encoder starts every segment on an IDR picture */
+	if (!(session = avcenc_session_new(ctx->profile, &ctx->size,
+			&ctx->frame_rate, ctx->colorspace.matrix,
+			ctx->colorspace.range, params))) {
+		rc = errno ? errno : -1;
+		error("avcenc_session_new: %s", strerror(rc));
 		goto finally;
 	}
 
+	avcenc_session_set_cb(session, segment_packet, segment);
+
+	for (n = 0; n < segment->num_frames; n++) {
+		frame = segment->frames + n;
+		frame->buf = buf;
+		frame->scanline = scanline;
+
+		memset(stages, '\0', sizeof(stages));
+		pit_prof_start(&prof, stages);
+
+		/* a bad picture is skipped like in a single stream */
+		err = 0;
+
+		if (!(rc = transcode(ctx, frame, &prof))) {
+			if ((err = avcenc_session_encode(session, buf)) == EAGAIN) {
+				err = 0;
+			}
+
+			pit_prof_lap(&prof, JPG2AVC_ENCODE);
+			rc = err;
+		}
+
+		frame->buf = frame->scanline = NULL;
+
+		pthread_mutex_lock(&ctx->pool.mutex);
+
+		for (i = 0; i < JPG2AVC_STAGES; i++) {
+			ctx->stages[i].wall += stages[i].wall;
+			ctx->stages[i].cpu += stages[i].cpu;
+		}
+
+		frame->rc = rc;
+		frame->decoded = 1;
+		quit = ctx->pool.quit;
+		pthread_cond_broadcast(&ctx->pool.decoded);
+		pthread_mutex_unlock(&ctx->pool.mutex);
+
+		if (err) {
+			rc = err;
+			error("failed to encode: %s", strerror(rc));
+			goto finally;
+		}
+
+		if (quit) {
+			rc = ECANCELED;
+			goto finally;
+		}
+	}
+
+	while (avcenc_session_pending_frames(session) > 0) {
+		memset(stages, '\0', sizeof(stages));
+		pit_prof_start(&prof, stages);
+
+		if ((rc = avcenc_session_flush(session)) && rc != EAGAIN) {
+			error("avcenc_session_flush: %s", strerror(rc));
+			goto finally;
+		}
+
+		pit_prof_lap(&prof, JPG2AVC_ENCODE);
+
+		pthread_mutex_lock(&ctx->pool.mutex);
+		ctx->stages[JPG2AVC_ENCODE].wall += stages[JPG2AVC_ENCODE].wall;
+		ctx->stages[JPG2AVC_ENCODE].cpu += stages[JPG2AVC_ENCODE].cpu;
+		pthread_mutex_unlock(&ctx->pool.mutex);
+	}
+
 	rc = 0;
 
 finally:
-	if (file) {
-		fclose(file);
+	if (session) {
+		avcenc_session_free(session);
 	}
-	if (rc != 0) {
-		errno = rc;
-		n = -1;
+	if (scanline) {
+		free(scanline);
 	}
-	return n;
+	if (buf) {
+		free(buf);
+	}
+	return rc;
+}
+
+static void *segment_worker(void *arg)
+{
+	int rc;
+	size_t n;
+	long cpus;
+	struct jpg2avc *ctx = arg;
+	struct jpg2avc_segment *segment;
+	struct avcenc_params params;
+
+	/* split the cores between the sessions unless told otherwise */
+	memcpy(&params, &ctx->params, sizeof(params));
+
+	if (params.threads == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		params.threads = cpus > ctx->segment.sessions ?
+				cpus / ctx->segment.sessions : 1;
+	}
+
+	pthread_mutex_lock(&ctx->pool.mutex);
+
+	while (!ctx->pool.quit) {
+		TAILQ_FOREACH(segment, &ctx->segment.list, next) {
+			if (segment->queued && !segment->running) {
+				break;
+			}
+		}
+
+		if (!segment) {
+			pthread_cond_wait(&ctx->pool.queued, &ctx->pool.mutex);
+			continue;
+		}
+
+		segment->running = 1;
+		pthread_mutex_unlock(&ctx->pool.mutex);
+
+		rc = segment_encode(ctx, segment, &params);
+
+		pthread_mutex_lock(&ctx->pool.mutex);
+
+		/* nothing more comes out of a failed segment */
+		for (n = 0; n < segment->num_frames; n++) {
+			if (!segment->frames[n].decoded) {
+				segment->frames[n].rc = rc;
+				segment->frames[n].decoded = 1;
+			}
+		}
+
+		segment->rc = rc;
+		segment->done = 1;
+		pthread_cond_broadcast(&ctx->pool.decoded);
+	}
+
+	pthread_mutex_unlock(&ctx->pool.mutex);
+	return NULL;
 }
@@ -23,11 +23,27 @@
 #include <stdio.h>
 
 #include "common.h"
+#include "i420.h"
+#include "avcenc.h"
 
 struct jpg2avc;
 
+enum jpg2avc_stage {
+	JPG2AVC_CACHE = 0,
+	JPG2AVC_HEADER,
+	JPG2AVC_DECODE,
+	JPG2AVC_STRETCH,
+	JPG2AVC_RESIZE,
+	JPG2AVC_CONVERT,
+	JPG2AVC_DEFLICKER,
+	JPG2AVC_ENCODE,
+	JPG2AVC_WRITE,
+	JPG2AVC_STAGES,
+};
+
+/* params may be NULL for the encoder defaults */
 struct jpg2avc *jpg2avc_new(struct pit_dim *size, struct pit_frac *frame_rate,
-		const char *profile);
+		const char *profile, const struct avcenc_params *params);
 
 void jpg2avc_free(struct jpg2avc *ctx);
 
@@ -35,17 +51,56 @@ int jpg2avc_stretch_black(struct jpg2avc *ctx, unsigned int black);
 
 int jpg2avc_stretch_white(struct jpg2avc *ctx, unsigned int white);
 
+int jpg2avc_threads(struct jpg2avc *ctx, unsigned int threads);
+
+/*
+ * Encodes runs of length frames (0 for the keyint) as closed GOPs on up to
+ * sessions x264 encoders at once and splices them in order; each session
+ * decodes its own frames, so the decoder threads are not used then.
+ */
+int jpg2avc_segments(struct jpg2avc *ctx, unsigned int sessions,
+		unsigned int length);
+
+/*
+ * Keeps decoded frames in dir, keyed by file, geometry and tone settings,
+ * and drops the least recently used beyond cap bytes (0 for no limit).
+ */
+int jpg2avc_cache(struct jpg2avc *ctx, const char *dir, off_t cap);
+
+/* every frame of the window is held decoded in the ring */
+#define JPG2AVC_DEFLICKER_MAX 240
+
+/*
+ * Evens out the brightness of each frame towards the mean luma of the
+ * frames up to radius (at most JPG2AVC_DEFLICKER_MAX) before and after it
+ * (0 to disable); frames are looked ahead only as far as they have been
+ * submitted.
+ */
+int jpg2avc_deflicker(struct jpg2avc *ctx, unsigned int radius);
+
+int jpg2avc_colorspace(struct jpg2avc *ctx, enum i420_matrix matrix,
+		enum i420_range range);
+
 int jpg2avc_begin(struct jpg2avc *ctx, const char *output);
 
-int jpg2avc_transcode(struct jpg2avc *ctx, const char *jpg, const char *rgb,
-		const char *resized, const char *avc, double a, int b);
+int jpg2avc_submit(struct jpg2avc *ctx, const char *jpg, double a, int b);
+
+size_t jpg2avc_queued_frames(struct jpg2avc *ctx);
+
+int jpg2avc_next(struct jpg2avc *ctx, const char **jpg);
 
 size_t jpg2avc_pending_frames(struct jpg2avc *ctx);
 
-int jpg2avc_flush(struct jpg2avc *ctx, const char *avc);
+int jpg2avc_flush(struct jpg2avc *ctx);
 
 int jpg2avc_commit(struct jpg2avc *ctx);
 
 size_t jpg2avc_count(struct jpg2avc *ctx);
 
+const char *jpg2avc_stage_name(enum jpg2avc_stage stage);
+
+/* time spent in a stage since begin, summed over all decoder threads */
+int jpg2avc_stage_time(struct jpg2avc *ctx, enum jpg2avc_stage stage,
+		struct pit_timer *timer);
+
 #endif /* JPG2AVC_H_ */
@@ -0,0 +1,262 @@
+// $Id$
+/*
+ * Copyright 2013 Cedric Shih (cedric dot shih at gmail dot com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <math.h>
+#include <setjmp.h>
+
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "log.h"
+
+#include "jpg2jpg.h"
+
+/* largest magnitude of a quantized AC coefficient in baseline JPEG */
+#define AC_MAX 1023
+
+struct jpg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jmp;
+};
+
+static void jpg_error_exit(j_common_ptr cinfo)
+{
+	struct jpg_error *err = (struct jpg_error *) cinfo->err;
+
+	longjmp(err->jmp, 1);
+}
+
+static int clipped(double v, int black, int white)
+{
+	return v < black || v > white;
+}
+
+/*
+ * Block averages follow from the DC coefficients alone: a quantized DC of
+ * d over table entry q is a mean of d * q / 8 around 128.
+ */
+static double dc_mean(JBLOCKROW row, size_t x, JQUANT_TBL *qtbl)
+{
+	return row[x][0] * qtbl->quantval[0] / 8.0 + 128;
+}
+
+/* share of the block averages of R, G and B outside black..white */
+static double clip_share(struct jpeg_decompress_struct *dinfo,
+		jvirt_barray_ptr *coefs, int black, int white)
+{
+	jpeg_component_info *comp = dinfo->comp_info;
+	JBLOCKARRAY y, cb = NULL, cr = NULL;
+	JDIMENSION by, bx, cx;
+	double l, u, v, n = 0, total = 0;
+
+	for (by = 0; by < comp[0].height_in_blocks; by++) {
+		y = (*dinfo->mem->access_virt_barray)((j_common_ptr) dinfo,
+				coefs[0], by, 1, FALSE);
+
+		/* the chroma blocks a luma block lies in */
+		if (dinfo->num_components == 3) {
+			cb = (*dinfo->mem->access_virt_barray)(
+					(j_common_ptr) dinfo, coefs[1],
+					by * comp[1].v_samp_factor /
+					comp[0].v_samp_factor, 1, FALSE);
+			cr = (*dinfo->mem->access_virt_barray)(
+					(j_common_ptr) dinfo, coefs[2],
+					by * comp[2].v_samp_factor /
+					comp[0].v_samp_factor, 1, FALSE);
+		}
+
+		for (bx = 0; bx < comp[0].width_in_blocks; bx++) {
+			l = dc_mean(y[0], bx, comp[0].quant_table);
+
+			if (dinfo->num_components != 3) {
+				n += clipped(l, black, white);
+				total++;
+				continue;
+			}
+
+			cx = bx * comp[1].h_samp_factor / comp[0].h_samp_factor;
+			u = dc_mean(cb[0], cx, comp[1].quant_table) - 128;
+			cx = bx * comp[2].h_samp_factor / comp[0].h_samp_factor;
+			v = dc_mean(cr[0], cx, comp[2].quant_table) - 128;
+
+			n += clipped(l + 1.402 * v, black, white);
+			n += clipped(l - 0.344136 * u - 0.714136 * v, black,
+					white);
+			n += clipped(l + 1.772 * u, black, white);
+			total += 3;
+		}
+	}
+
+	return total > 0 ? n / total : 0;
+}
+
+static JCOEF clamp_coef(double c, double lo, double hi)
+{
+	c = c < 0 ? ceil(c - 0.5) : floor(c + 0.5);
+
+	if (c < lo) {
+		return (JCOEF) lo;
+	} else if (c > hi) {
+		return (JCOEF) hi;
+	} else {
+		return (JCOEF) c;
+	}
+}
+
+/*
+ * Maps every sample to gain * sample + offset: as the colour conversion is
+ * affine, luma takes the same map while chroma only scales about 128, and
+ * within a block only DC carries the offset.
+ */
+static void stretch_coefs(struct jpeg_decompress_struct *dinfo,
+		jvirt_barray_ptr *coefs, double gain, double offset)
+{
+	jpeg_component_info *comp;
+	JBLOCKARRAY row;
+	JDIMENSION by, bx;
+	JCOEFPTR block;
+	JCOEF ac[2 * AC_MAX + 1];
+	double q, shift;
+	int c, k;
+
+	/* every AC coefficient of every component scales alike */
+	for (k = -AC_MAX; k <= AC_MAX; k++) {
+		ac[k + AC_MAX] = clamp_coef(gain * k, -AC_MAX, AC_MAX);
+	}
+
+	for (c = 0; c < dinfo->num_components; c++) {
+		comp = dinfo->comp_info + c;
+		q = comp->quant_table->quantval[0];
+		shift = c == 0 ? 8 * (128 * gain + offset - 128) / q : 0;
+
+		for (by = 0; by < comp->height_in_blocks; by++) {
+			row = (*dinfo->mem->access_virt_barray)(
+					(j_common_ptr) dinfo, coefs[c], by, 1,
+					TRUE);
+
+			for (bx = 0; bx < comp->width_in_blocks; bx++) {
+				block = row[0][bx];
+
+				/* keeps block averages within 0..255 */
+				block[0] = clamp_coef(gain * block[0] + shift,
+						-1024 / q, 1016 / q);
+
+				for (k = 1; k < DCTSIZE2; k++) {
+					if (block[k] >= -AC_MAX &&
+							block[k] <= AC_MAX) {
+						block[k] = ac[block[k] + AC_MAX];
+					}
+				}
+			}
+		}
+	}
+}
+
+int jpg2jpg(const char *in, const char *out, int black, int white,
+		double clip)
+{
+	int rc;
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_compress_struct cinfo;
+	struct jpg_error err;
+	jvirt_barray_ptr *coefs;
+	FILE * volatile infile = NULL;
+	FILE * volatile outfile = NULL;
+	volatile int decompress = 0, compress = 0;
+	double share;
+
+	if (!(infile = fopen(in, "rb"))) {
+		rc = errno ? errno : -1;
+		error("fopen: %s (%s)", strerror(rc), in);
+		goto finally;
+	}
+
+	dinfo.err = cinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = jpg_error_exit;
+
+	if (setjmp(err.jmp)) {
+		rc = EINVAL;
+		error("failed to transcode '%s'", in);
+		goto finally;
+	}
+
+	jpeg_create_decompress(&dinfo);
+	decompress = 1;
+	jpeg_stdio_src(&dinfo, infile);
+	jpeg_read_header(&dinfo, TRUE);
+
+	if (dinfo.data_precision != 8 ||
+			!((dinfo.jpeg_color_space == JCS_YCbCr &&
+			dinfo.num_components == 3) ||
+			(dinfo.jpeg_color_space == JCS_GRAYSCALE &&
+			dinfo.num_components == 1))) {
+		debug("not YCbCr nor greyscale: %s", in);
+		rc = EAGAIN;
+		goto finally;
+	}
+
+	coefs = jpeg_read_coefficients(&dinfo);
+
+	/* rgb2jpg() leaves pictures alone unless both points move */
+	if (black > 0 && white < 255) {
+		if ((share = clip_share(&dinfo, coefs, black, white)) > clip) {
+			debug("%.2f%% of '%s' clipped", share * 100, in);
+			rc = EAGAIN;
+			goto finally;
+		}
+
+		stretch_coefs(&dinfo, coefs, 255.0 / (white - black),
+				-black * 255.0 / (white - black));
+	}
+
+	/* everything is in memory now, so out may be in */
+	fclose(infile);
+	infile = NULL;
+
+	if (!(outfile = fopen(out, "wb"))) {
+		rc = errno ? errno : -1;
+		error("fopen: %s (%s)", strerror(rc), out);
+		goto finally;
+	}
+
+	jpeg_create_compress(&cinfo);
+	compress = 1;
+	jpeg_stdio_dest(&cinfo, outfile);
+	jpeg_copy_critical_parameters(&dinfo, &cinfo);
+	jpeg_write_coefficients(&cinfo, coefs);
+	jpeg_finish_compress(&cinfo);
+	rc = 0;
+
+finally:
+	if (compress) {
+		jpeg_destroy_compress(&cinfo);
+	}
+	if (decompress) {
+		jpeg_destroy_decompress(&dinfo);
+	}
+	if (outfile) {
+		fclose(outfile);
+	}
+	if (infile) {
+		fclose(infile);
+	}
+	return rc;
+}
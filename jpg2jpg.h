@@ -0,0 +1,30 @@
+// $Id$
+/*
+ * Copyright 2013 Cedric Shih (cedric dot shih at gmail dot com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef JPG2JPG_H_
+#define JPG2JPG_H_
+
+/*
+ * Stretches black..white to 0..255 as rgb2jpg() would, but on the DCT
+ * coefficients, keeping the quantization of in.  Returns EAGAIN, writing
+ * nothing, when more than clip of the block averages would be clipped or
+ * the picture is not YCbCr or greyscale, so that pixels have to be used.
+ */
+int jpg2jpg(const char *in, const char *out, int black, int white,
+		double clip);
+
+#endif /* JPG2JPG_H_ */
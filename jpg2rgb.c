@@ -15,29 +15,40 @@
  * limitations under the License.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <setjmp.h>
 
 #include <jpeglib.h>
 #include <jerror.h>
 
 #include "log.h"
+#include "tone.h"
 
 #include "jpg2rgb.h"
 
-static int jpgerr = 0;
+struct jpg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jmp;
+};
 
 static void jpg_error_exit(j_common_ptr cinfo)
 {
-	jpgerr = errno ? errno : -1;
+	struct jpg_error *err = (struct jpg_error *) cinfo->err;
+	char msg[JMSG_LENGTH_MAX];
+
+	(*cinfo->err->format_message)(cinfo, msg);
+	error("libjpeg: %s", msg);
+	longjmp(err->jmp, 1);
 }
 
 int jpg_read_header(const char *path, size_t *w, size_t *h)
 {
 	int rc;
 	struct jpeg_decompress_struct dinfo;
-	struct jpeg_error_mgr derr;
+	struct jpg_error derr;
 	FILE *file = NULL;
 
 	if (!(file = fopen(path, "rb"))) {
@@ -46,20 +57,21 @@ int jpg_read_header(const char *path, size_t *w, size_t *h)
 		goto finally;
 	}
 
-	dinfo.err = jpeg_std_error(&derr);
-	derr.error_exit = jpg_error_exit;
+	dinfo.err = jpeg_std_error(&derr.mgr);
+	derr.mgr.error_exit = jpg_error_exit;
 
 	jpeg_create_decompress(&dinfo);
-	jpeg_stdio_src(&dinfo, file);
-
-	jpgerr = 0;
-	jpeg_read_header(&dinfo, TRUE);
 
-	if (jpgerr != 0) {
-		rc = jpgerr;
+	if (setjmp(derr.jmp)) {
+		rc = EINVAL;
+		error("failed to read header of '%s'", path);
+		jpeg_destroy_decompress(&dinfo);
 		goto finally;
 	}
 
+	jpeg_stdio_src(&dinfo, file);
+	jpeg_read_header(&dinfo, TRUE);
+
 	*w = dinfo.image_width;
 	*h = dinfo.image_height;
 
@@ -73,32 +85,17 @@ finally:
 	return rc;
 }
 
-static unsigned char clamp(int c)
-{
-	if (c < 0) {
-		return 0;
-	} else if (c > 255) {
-		return 255;
-	} else {
-		return (unsigned char) c;
-	}
-}
-
-static unsigned char stretch(int c, int min, int max)
-{
-	return clamp((c - min) * 255 / (max - min));
-}
-
 int jpg2rgb(const char *in, const char *out, int black, int white, double a,
 		int b, size_t *w, size_t *h)
 {
-	int rc, i;
+	int rc;
 	struct jpeg_decompress_struct dinfo;
 	struct jpeg_error_mgr derr;
 	FILE *infile = NULL, *outfile = NULL;
 	JSAMPARRAY dbuffer;
-	int dstride;
+	int dstride, identity;
 	size_t n;
+	unsigned char lut[TONE_SIZE];
 
 	if (!(infile = fopen(in, "rb"))) {
 		rc = errno ? errno : -1;
@@ -112,6 +109,9 @@ int jpg2rgb(const char *in, const char *out, int black, int white, double a,
 		goto finally;
 	}
 
+	tone_build(lut, black, white, a, b);
+	identity = tone_identity(lut);
+
 	dinfo.err = jpeg_std_error(&derr);
 	jpeg_create_decompress(&dinfo);
 	jpeg_stdio_src(&dinfo, infile);
@@ -132,24 +132,8 @@ int jpg2rgb(const char *in, const char *out, int black, int white, double a,
 	while (dinfo.output_scanline < dinfo.output_height) {
 		jpeg_read_scanlines(&dinfo, dbuffer, 1);
 
-		if (black > 0 && white < 255) {
-			for (i = 0; i < dstride; i++) {
-				dbuffer[0][i] = stretch(dbuffer[0][i], black, white);
-			}
-		}
-
-		if (a != 1.0 || b != 0) {
-			for (i = 0; i < dstride; i++) {
-				if (a != 1.0) {
-					dbuffer[0][i] = clamp(a *
-							dbuffer[0][i]);
-				}
-
-				if (b != 0) {
-					dbuffer[0][i] = clamp(b +
-							dbuffer[0][i]);
-				}
-			}
+		if (!identity) {
+			tone_apply(lut, dbuffer[0], dstride);
 		}
 
 		if ((n = fwrite(dbuffer[0], dinfo.output_components,
@@ -182,3 +166,179 @@ finally:
 	}
 	return rc;
 }
+
+struct jpg_reader {
+	FILE *file;
+	struct jpeg_decompress_struct dinfo;
+	struct jpg_error derr;
+	int stride;
+	unsigned char tone[TONE_SIZE];
+	int identity;
+	struct {
+		struct pit_prof *prof;
+		int decode;
+		int adjust;
+	} prof;
+};
+
+/*
+ * Let the IDCT do the coarse part of a downscale: pick the smallest of
+ * 1/8, 1/4 and 1/2 that still yields at least width x height pixels.
+ */
+static void jpg_reader_scale(struct jpeg_decompress_struct *dinfo,
+		size_t width, size_t height)
+{
+	unsigned int denom;
+
+	dinfo->scale_num = 1;
+
+	for (denom = 8; denom > 1; denom >>= 1) {
+		dinfo->scale_denom = denom;
+		jpeg_calc_output_dimensions(dinfo);
+
+		if (dinfo->output_width >= width &&
+				dinfo->output_height >= height) {
+			debug("scaling by 1/%d: %dx%d => %dx%d", denom,
+					dinfo->image_width, dinfo->image_height,
+					dinfo->output_width, dinfo->output_height);
+			return;
+		}
+	}
+
+	dinfo->scale_denom = 1;
+}
+
+struct jpg_reader *jpg_reader_open(const char *path, size_t width,
+		size_t height, int black, int white, double a, int b)
+{
+	int rc;
+	struct jpg_reader *reader;
+
+	if (!(reader = calloc(1, sizeof(*reader)))) {
+		rc = errno ? errno : -1;
+		error("calloc: %s", strerror(rc));
+		goto finally;
+	}
+
+	if (!(reader->file = fopen(path, "rb"))) {
+		rc = errno ? errno : -1;
+		error("fopen: %s (%s)", strerror(rc), path);
+		goto finally;
+	}
+
+	/* a corrupt picture fails this frame rather than exiting */
+	reader->dinfo.err = jpeg_std_error(&reader->derr.mgr);
+	reader->derr.mgr.error_exit = jpg_error_exit;
+
+	if (setjmp(reader->derr.jmp)) {
+		rc = EINVAL;
+		error("failed to open '%s'", path);
+		goto finally;
+	}
+
+	jpeg_create_decompress(&reader->dinfo);
+	jpeg_stdio_src(&reader->dinfo, reader->file);
+	jpeg_read_header(&reader->dinfo, TRUE);
+
+	if (width > 0 && height > 0) {
+		jpg_reader_scale(&reader->dinfo, width, height);
+	}
+
+	jpeg_start_decompress(&reader->dinfo);
+
+	reader->stride = reader->dinfo.output_width *
+			reader->dinfo.output_components;
+	tone_build(reader->tone, black, white, a, b);
+	reader->identity = tone_identity(reader->tone);
+	rc = 0;
+
+finally:
+	if (rc != 0) {
+		if (reader) {
+			/* a no-op unless jpeg_create_decompress() got done */
+			jpeg_destroy_decompress(&reader->dinfo);
+
+			if (reader->file) {
+				fclose(reader->file);
+			}
+			free(reader);
+		}
+		reader = NULL;
+		errno = rc;
+	}
+	return reader;
+}
+
+void jpg_reader_close(struct jpg_reader *reader)
+{
+	if (!reader) {
+		return;
+	}
+
+	if (setjmp(reader->derr.jmp)) {
+		warn("failed to finish decompression");
+	} else if (reader->dinfo.output_scanline ==
+			reader->dinfo.output_height) {
+		jpeg_finish_decompress(&reader->dinfo);
+	}
+
+	jpeg_destroy_decompress(&reader->dinfo);
+	fclose(reader->file);
+	free(reader);
+}
+
+size_t jpg_reader_width(struct jpg_reader *reader)
+{
+	return reader->dinfo.output_width;
+}
+
+size_t jpg_reader_height(struct jpg_reader *reader)
+{
+	return reader->dinfo.output_height;
+}
+
+int jpg_reader_read(struct jpg_reader *reader, unsigned char *row,
+		size_t len)
+{
+	JSAMPROW rows[1];
+
+	if (len < reader->stride) {
+		error("scanline too small: %zu < %d", len, reader->stride);
+		return EINVAL;
+	}
+
+	if (reader->dinfo.output_scanline >= reader->dinfo.output_height) {
+		error("all scanlines read");
+		return -1;
+	}
+
+	if (setjmp(reader->derr.jmp)) {
+		error("failed to read scanline %u",
+				reader->dinfo.output_scanline);
+		return EINVAL;
+	}
+
+	rows[0] = row;
+	jpeg_read_scanlines(&reader->dinfo, rows, 1);
+
+	if (reader->prof.prof) {
+		pit_prof_lap(reader->prof.prof, reader->prof.decode);
+	}
+
+	if (!reader->identity) {
+		tone_apply(reader->tone, rows[0], reader->stride);
+	}
+
+	if (reader->prof.prof) {
+		pit_prof_lap(reader->prof.prof, reader->prof.adjust);
+	}
+	return 0;
+}
+
+void jpg_reader_prof(struct jpg_reader *reader, struct pit_prof *prof,
+		int decode, int adjust)
+{
+	reader->prof.prof = prof;
+	reader->prof.decode = decode;
+	reader->prof.adjust = adjust;
+}
@@ -19,9 +19,29 @@
 #ifndef JPG2RAW_H_
 #define JPG2RAW_H_
 
+#include "common.h"
+
 int jpg_read_header(const char *file, size_t *w, size_t *h);
 
 int jpg2rgb(const char *in, const char *out, int black, int white, double a,
 		int b, size_t *w, size_t *h);
 
+struct jpg_reader;
+
+struct jpg_reader *jpg_reader_open(const char *path, size_t width,
+		size_t height, int black, int white, double a, int b);
+
+void jpg_reader_close(struct jpg_reader *reader);
+
+size_t jpg_reader_width(struct jpg_reader *reader);
+
+size_t jpg_reader_height(struct jpg_reader *reader);
+
+int jpg_reader_read(struct jpg_reader *reader, unsigned char *row,
+		size_t len);
+
+/* charges scanline decoding and adjustment to two stages of prof */
+void jpg_reader_prof(struct jpg_reader *reader, struct pit_prof *prof,
+		int decode, int adjust);
+
 #endif /* JPG2RAW_H_ */
@@ -27,6 +27,11 @@ void pit_set_log_level(enum pit_log_level level)
 	log_level = level;
 }
 
+enum pit_log_level pit_get_log_level(void)
+{
+	return log_level;
+}
+
 static pit_log_cb log_cb = NULL;
 static void *log_cbarg = NULL;
 
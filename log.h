@@ -32,6 +32,8 @@ enum pit_log_level {
 
 void pit_set_log_level(enum pit_log_level level);
 
+enum pit_log_level pit_get_log_level(void);
+
 typedef void (*pit_log_cb)(enum pit_log_level level,
 		const char *func, int line,
 		const char *fmt, va_list ap, void *cbarg);
@@ -24,6 +24,7 @@
 #include "startrail.h"
 #include "stretch.h"
 #include "stack.h"
+#include "bench.h"
 
 typedef int (*pit_handler)(char *basename, int argc, char **argv);
 typedef void (*pit_helper)(FILE *file, char *basename, char *cmd);
@@ -42,6 +43,7 @@ static struct {
 		{ "time", "create timelapse video", timelapse, timelapse_help },
 		{ "star", "create star trail photograph", startrail, startrail_help },
 		{ "stack", "create HDR image", stack, stack_help },
+		{ "bench", "measure throughput of each stage", bench, bench_help },
 };
 static int num_handlers = sizeof(handlers) / sizeof(handlers[0]);
 
@@ -0,0 +1,817 @@
+// $Id$
+/*
+ * Copyright 2013 Cedric Shih (cedric dot shih at gmail dot com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "log.h"
+
+#include "mp4.h"
+
+#define MP4_TRACK_ID 1
+#define MP4_MOVIE_TIMESCALE 1000
+
+enum {
+	NAL_SPS = 7,
+	NAL_PPS = 8,
+	NAL_AUD = 9,
+};
+
+enum {
+	TRUN_DATA_OFFSET = 0x000001,
+	TRUN_SAMPLE_DURATION = 0x000100,
+	TRUN_SAMPLE_SIZE = 0x000200,
+	TRUN_SAMPLE_FLAGS = 0x000400,
+	TRUN_SAMPLE_CTS = 0x000800,
+};
+
+#define TFHD_DEFAULT_BASE_IS_MOOF 0x020000
+
+#define SAMPLE_SYNC 0x02000000
+#define SAMPLE_NON_SYNC 0x01010000
+
+struct mp4_buf {
+	unsigned char *data;
+	size_t len;
+	size_t cap;
+	int rc;
+};
+
+struct mp4_sample {
+	u_int32_t size;
+	u_int32_t flags;
+	u_int32_t cts;
+};
+
+struct mp4_writer {
+	char *filename;
+	int fd;
+	struct pit_dim size;
+	struct pit_frac fps;
+	size_t fragment;
+	u_int32_t sequence;
+	u_int64_t decode_time;
+	struct mp4_buf header;
+	struct mp4_buf mdat;
+	struct {
+		struct mp4_sample *samples;
+		size_t num;
+	} frag;
+	struct {
+		size_t frames;
+	} stat;
+};
+
+static int mp4_writer_init(struct mp4_writer *writer,
+		unsigned char *data, size_t len, int64_t dts);
+static int mp4_writer_fragment(struct mp4_writer *writer);
+static int mp4_writer_output(struct mp4_writer *writer,
+		const unsigned char *data, size_t len);
+
+static const unsigned char *nal_next(const unsigned char *p,
+		const unsigned char *end, size_t *len);
+
+static void buf_reserve(struct mp4_buf *buf, size_t len);
+static void buf_put(struct mp4_buf *buf, const void *data, size_t len);
+static void buf_put8(struct mp4_buf *buf, u_int8_t v);
+static void buf_put16(struct mp4_buf *buf, u_int16_t v);
+static void buf_put32(struct mp4_buf *buf, u_int32_t v);
+static void buf_put64(struct mp4_buf *buf, u_int64_t v);
+static void buf_zero(struct mp4_buf *buf, size_t len);
+static void buf_set32(struct mp4_buf *buf, size_t offset, u_int32_t v);
+static size_t box_begin(struct mp4_buf *buf, const char *type);
+static size_t full_box_begin(struct mp4_buf *buf, const char *type,
+		u_int8_t version, u_int32_t flags);
+static void box_end(struct mp4_buf *buf, size_t offset);
+
+static const u_int32_t unity_matrix[9] = {
+		0x00010000, 0, 0,
+		0, 0x00010000, 0,
+		0, 0, 0x40000000,
+};
+
+struct mp4_writer *mp4_writer_new(struct pit_dim *size, struct pit_frac *fps,
+		size_t fragment)
+{
+	struct mp4_writer *writer;
+
+	if (!(writer = calloc(1, sizeof(*writer)))) {
+		error("failed to allocate for mp4_writer");
+		goto error;
+	}
+
+	memcpy(&writer->size, size, sizeof(writer->size));
+	memcpy(&writer->fps, fps, sizeof(writer->fps));
+	writer->fd = -1;
+
+	if (!(writer->fragment = fragment)) {
+		writer->fragment = fps->den ? (fps->num + fps->den / 2)
+				/ fps->den : 1;
+	}
+
+	if (writer->fragment < 1) {
+		writer->fragment = 1;
+	}
+
+	if (!(writer->frag.samples = calloc(writer->fragment,
+			sizeof(*writer->frag.samples)))) {
+		error("failed to allocate for %zu samples", writer->fragment);
+		goto error;
+	}
+
+	return writer;
+error:
+	mp4_writer_free(writer);
+	return NULL;
+}
+
+void mp4_writer_free(struct mp4_writer *writer)
+{
+	if (!writer) {
+		return;
+	}
+
+	if (writer->fd >= 0) {
+		mp4_writer_close(writer);
+	}
+
+	if (writer->filename) {
+		free(writer->filename);
+	}
+
+	if (writer->header.data) {
+		free(writer->header.data);
+	}
+
+	if (writer->mdat.data) {
+		free(writer->mdat.data);
+	}
+
+	if (writer->frag.samples) {
+		free(writer->frag.samples);
+	}
+
+	free(writer);
+}
+
+int mp4_writer_open(struct mp4_writer *writer, const char *filename)
+{
+	int rc;
+
+	if (!writer || !filename) {
+		rc = EINVAL;
+		error("null argument(s)");
+		goto finally;
+	}
+
+	if (writer->fd >= 0) {
+		rc = EINPROGRESS;
+		error("already open");
+		goto finally;
+	}
+
+	writer->stat.frames = 0;
+	writer->sequence = 0;
+	writer->decode_time = 0;
+	writer->frag.num = 0;
+	writer->mdat.len = 0;
+
+	if (writer->filename) {
+		free(writer->filename);
+		writer->filename = NULL;
+	}
+
+	if (!(writer->filename = strdup(filename))) {
+		rc = ENOMEM;
+		error("failed to strdup: %s", filename);
+		goto finally;
+	}
+
+	if ((writer->fd = open(writer->filename,
+			O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		rc = errno ? errno : -1;
+		error("failed to open file '%s': %s",
+				writer->filename, strerror(rc));
+		goto finally;
+	}
+
+	rc = 0;
+
+finally:
+	if (rc != 0) {
+		if (writer->filename) {
+			free(writer->filename);
+			writer->filename = NULL;
+		}
+	}
+	return rc;
+}
+
+int mp4_writer_close(struct mp4_writer *writer)
+{
+	int rc;
+
+	if (!writer) {
+		rc = EINVAL;
+		error("null argument(s)");
+		goto finally;
+	}
+
+	if (writer->fd < 0) {
+		rc = -1;
+		error("not open");
+		goto finally;
+	}
+
+	/* the descriptor is closed even if the last fragment is lost */
+	if ((rc = writer->frag.num > 0 ? mp4_writer_fragment(writer) : 0)) {
+		error("failed to write last fragment: %s", strerror(rc));
+	}
+
+	debug("closing file: %s", writer->filename);
+
+	if (close(writer->fd) && rc == 0) {
+		rc = errno ? errno : -1;
+		error("failed to close file '%s': %s",
+				writer->filename, strerror(rc));
+	}
+
+	writer->fd = -1;
+
+finally:
+	return rc;
+}
+
+int mp4_writer_write(struct mp4_writer *writer, void *data, size_t len,
+		int keyframe, int64_t pts, int64_t dts)
+{
+	int rc;
+	const unsigned char *p, *end, *nal;
+	size_t offset, n;
+	struct mp4_sample *sample;
+
+	if (!writer || !data) {
+		rc = EINVAL;
+		error("null argument(s)");
+		goto finally;
+	}
+
+	if (writer->fd < 0) {
+		rc = -1;
+		error("not open");
+		goto finally;
+	}
+
+	if (writer->stat.frames == 0) {
+		if ((rc = mp4_writer_init(writer, data, len, dts))) {
+			error("failed to init: %s", strerror(rc));
+			goto finally;
+		}
+	}
+
+	/* Annex B to length prefixed NALs; parameter sets live in avcC */
+	offset = writer->mdat.len;
+	p = data;
+	end = p + len;
+
+	while ((nal = nal_next(p, end, &n))) {
+		p = nal + n;
+
+		switch (nal[0] & 0x1f) {
+		case NAL_SPS:
+		case NAL_PPS:
+		case NAL_AUD:
+			continue;
+		default:
+			break;
+		}
+
+		buf_put32(&writer->mdat, n);
+		buf_put(&writer->mdat, nal, n);
+	}
+
+	if ((rc = writer->mdat.rc)) {
+		error("failed to buffer sample: %s", strerror(rc));
+		goto finally;
+	}
+
+	sample = writer->frag.samples + writer->frag.num++;
+	sample->size = writer->mdat.len - offset;
+	sample->flags = keyframe ? SAMPLE_SYNC : SAMPLE_NON_SYNC;
+	sample->cts = (pts - dts) * writer->fps.den;
+
+	writer->stat.frames++;
+
+	if (writer->frag.num == writer->fragment) {
+		if ((rc = mp4_writer_fragment(writer))) {
+			error("failed to write fragment: %s", strerror(rc));
+			goto finally;
+		}
+	}
+
+	rc = 0;
+
+finally:
+	return rc;
+}
+
+size_t mp4_writer_num_frames(struct mp4_writer *writer)
+{
+	return writer->stat.frames;
+}
+
+int mp4_filename(const char *filename)
+{
+	const char *ext;
+
+	if (!(ext = strrchr(filename, '.'))) {
+		return 0;
+	}
+
+	return !strcasecmp(ext, ".mp4") || !strcasecmp(ext, ".m4v");
+}
+
+static int mp4_writer_init(struct mp4_writer *writer,
+		unsigned char *data, size_t len, int64_t dts)
+{
+	int rc;
+	const unsigned char *p, *end, *nal, *sps, *pps;
+	size_t n, sps_len, pps_len;
+	size_t moov, trak, edts, mdia, minf, dinf, stbl, stsd, avc1, avcC;
+	size_t mvex;
+	struct mp4_buf *buf = &writer->header;
+	unsigned int i;
+
+	sps = pps = NULL;
+	sps_len = pps_len = 0;
+	p = data;
+	end = p + len;
+
+	while ((nal = nal_next(p, end, &n))) {
+		p = nal + n;
+
+		if ((nal[0] & 0x1f) == NAL_SPS && !sps) {
+			sps = nal;
+			sps_len = n;
+		} else if ((nal[0] & 0x1f) == NAL_PPS && !pps) {
+			pps = nal;
+			pps_len = n;
+		}
+	}
+
+	if (!sps || !pps || sps_len < 4) {
+		rc = EINVAL;
+		error("first frame carries no SPS/PPS");
+		goto finally;
+	}
+
+	buf->len = 0;
+	buf->rc = 0;
+
+	box_begin(buf, "ftyp");
+	buf_put(buf, "isom", 4);
+	buf_put32(buf, 0x200);
+	buf_put(buf, "isomiso5iso6avc1mp41", 20);
+	box_end(buf, 0);
+
+	moov = box_begin(buf, "moov");
+
+	n = full_box_begin(buf, "mvhd", 0, 0);
+	buf_put32(buf, 0); /* creation time */
+	buf_put32(buf, 0); /* modification time */
+	buf_put32(buf, MP4_MOVIE_TIMESCALE);
+	buf_put32(buf, 0); /* duration is in the fragments */
+	buf_put32(buf, 0x00010000); /* rate */
+	buf_put16(buf, 0x0100); /* volume */
+	buf_zero(buf, 10);
+	for (i = 0; i < 9; i++) {
+		buf_put32(buf, unity_matrix[i]);
+	}
+	buf_zero(buf, 24);
+	buf_put32(buf, MP4_TRACK_ID + 1);
+	box_end(buf, n);
+
+	trak = box_begin(buf, "trak");
+
+	/* enabled | in movie */
+	n = full_box_begin(buf, "tkhd", 0, 0x000003);
+	buf_put32(buf, 0);
+	buf_put32(buf, 0);
+	buf_put32(buf, MP4_TRACK_ID);
+	buf_put32(buf, 0);
+	buf_put32(buf, 0); /* duration */
+	buf_zero(buf, 8);
+	buf_put16(buf, 0); /* layer */
+	buf_put16(buf, 0); /* alternate group */
+	buf_put16(buf, 0); /* volume */
+	buf_put16(buf, 0);
+	for (i = 0; i < 9; i++) {
+		buf_put32(buf, unity_matrix[i]);
+	}
+	buf_put32(buf, writer->size.width << 16);
+	buf_put32(buf, writer->size.height << 16);
+	box_end(buf, n);
+
+	/* B-frames start decoding before zero; present from the first pts */
+	if (dts < 0) {
+		edts = box_begin(buf, "edts");
+		n = full_box_begin(buf, "elst", 0, 0);
+		buf_put32(buf, 1);
+		buf_put32(buf, 0); /* segment duration, i.e. all of it */
+		buf_put32(buf, -dts * writer->fps.den);
+		buf_put32(buf, 0x00010000);
+		box_end(buf, n);
+		box_end(buf, edts);
+	}
+
+	mdia = box_begin(buf, "mdia");
+
+	n = full_box_begin(buf, "mdhd", 0, 0);
+	buf_put32(buf, 0);
+	buf_put32(buf, 0);
+	buf_put32(buf, writer->fps.num);
+	buf_put32(buf, 0);
+	buf_put16(buf, 0x55c4); /* 'und' */
+	buf_put16(buf, 0);
+	box_end(buf, n);
+
+	n = full_box_begin(buf, "hdlr", 0, 0);
+	buf_put32(buf, 0);
+	buf_put(buf, "vide", 4);
+	buf_zero(buf, 12);
+	buf_put(buf, "VideoHandler", 13);
+	box_end(buf, n);
+
+	minf = box_begin(buf, "minf");
+
+	n = full_box_begin(buf, "vmhd", 0, 0x000001);
+	buf_zero(buf, 8);
+	box_end(buf, n);
+
+	dinf = box_begin(buf, "dinf");
+	n = full_box_begin(buf, "dref", 0, 0);
+	buf_put32(buf, 1);
+	box_end(buf, full_box_begin(buf, "url ", 0, 0x000001));
+	box_end(buf, n);
+	box_end(buf, dinf);
+
+	stbl = box_begin(buf, "stbl");
+
+	stsd = full_box_begin(buf, "stsd", 0, 0);
+	buf_put32(buf, 1);
+
+	avc1 = box_begin(buf, "avc1");
+	buf_zero(buf, 6);
+	buf_put16(buf, 1); /* data reference index */
+	buf_zero(buf, 16);
+	buf_put16(buf, writer->size.width);
+	buf_put16(buf, writer->size.height);
+	buf_put32(buf, 0x00480000); /* 72 dpi */
+	buf_put32(buf, 0x00480000);
+	buf_put32(buf, 0);
+	buf_put16(buf, 1); /* frame count */
+	buf_zero(buf, 32); /* compressor name */
+	buf_put16(buf, 0x0018);
+	buf_put16(buf, 0xffff);
+
+	avcC = box_begin(buf, "avcC");
+	buf_put8(buf, 1);
+	buf_put8(buf, sps[1]); /* profile */
+	buf_put8(buf, sps[2]); /* compatibility */
+	buf_put8(buf, sps[3]); /* level */
+	buf_put8(buf, 0xff); /* 4 byte NAL lengths */
+	buf_put8(buf, 0xe1);
+	buf_put16(buf, sps_len);
+	buf_put(buf, sps, sps_len);
+	buf_put8(buf, 1);
+	buf_put16(buf, pps_len);
+	buf_put(buf, pps, pps_len);
+
+	/* high profiles; pit only feeds 8 bit 4:2:0 */
+	if (sps[1] >= 100) {
+		buf_put8(buf, 0xfc | 1);
+		buf_put8(buf, 0xf8);
+		buf_put8(buf, 0xf8);
+		buf_put8(buf, 0);
+	}
+
+	box_end(buf, avcC);
+	box_end(buf, avc1);
+	box_end(buf, stsd);
+
+	/* samples are all in the fragments */
+	n = full_box_begin(buf, "stts", 0, 0);
+	buf_put32(buf, 0);
+	box_end(buf, n);
+
+	n = full_box_begin(buf, "stsc", 0, 0);
+	buf_put32(buf, 0);
+	box_end(buf, n);
+
+	n = full_box_begin(buf, "stsz", 0, 0);
+	buf_put32(buf, 0);
+	buf_put32(buf, 0);
+	box_end(buf, n);
+
+	n = full_box_begin(buf, "stco", 0, 0);
+	buf_put32(buf, 0);
+	box_end(buf, n);
+
+	box_end(buf, stbl);
+	box_end(buf, minf);
+	box_end(buf, mdia);
+	box_end(buf, trak);
+
+	mvex = box_begin(buf, "mvex");
+	n = full_box_begin(buf, "trex", 0, 0);
+	buf_put32(buf, MP4_TRACK_ID);
+	buf_put32(buf, 1); /* sample description index */
+	buf_put32(buf, writer->fps.den); /* duration */
+	buf_put32(buf, 0); /* size */
+	buf_put32(buf, SAMPLE_NON_SYNC);
+	box_end(buf, n);
+	box_end(buf, mvex);
+
+	box_end(buf, moov);
+
+	if ((rc = buf->rc)) {
+		error("failed to build moov: %s", strerror(rc));
+		goto finally;
+	}
+
+	if ((rc = mp4_writer_output(writer, buf->data, buf->len))) {
+		error("failed to write moov: %s", strerror(rc));
+		goto finally;
+	}
+
+	rc = 0;
+
+finally:
+	return rc;
+}
+
+static int mp4_writer_fragment(struct mp4_writer *writer)
+{
+	int rc;
+	size_t moof, traf, trun, data_offset, i;
+	struct mp4_buf *buf = &writer->header;
+	struct mp4_sample *sample;
+
+	buf->len = 0;
+	buf->rc = 0;
+
+	moof = box_begin(buf, "moof");
+
+	i = full_box_begin(buf, "mfhd", 0, 0);
+	buf_put32(buf, ++writer->sequence);
+	box_end(buf, i);
+
+	traf = box_begin(buf, "traf");
+
+	i = full_box_begin(buf, "tfhd", 0, TFHD_DEFAULT_BASE_IS_MOOF);
+	buf_put32(buf, MP4_TRACK_ID);
+	box_end(buf, i);
+
+	i = full_box_begin(buf, "tfdt", 1, 0);
+	buf_put64(buf, writer->decode_time);
+	box_end(buf, i);
+
+	trun = full_box_begin(buf, "trun", 0, TRUN_DATA_OFFSET
+			| TRUN_SAMPLE_DURATION | TRUN_SAMPLE_SIZE
+			| TRUN_SAMPLE_FLAGS | TRUN_SAMPLE_CTS);
+	buf_put32(buf, writer->frag.num);
+	data_offset = buf->len;
+	buf_put32(buf, 0);
+
+	for (i = 0; i < writer->frag.num; i++) {
+		sample = writer->frag.samples + i;
+		buf_put32(buf, writer->fps.den);
+		buf_put32(buf, sample->size);
+		buf_put32(buf, sample->flags);
+		buf_put32(buf, sample->cts);
+	}
+
+	box_end(buf, trun);
+	box_end(buf, traf);
+	box_end(buf, moof);
+
+	/* samples start right after the mdat header */
+	buf_set32(buf, data_offset, buf->len - moof + 8);
+	buf_put32(buf, writer->mdat.len + 8);
+	buf_put(buf, "mdat", 4);
+
+	if ((rc = buf->rc)) {
+		error("failed to build moof: %s", strerror(rc));
+		goto finally;
+	}
+
+	if ((rc = mp4_writer_output(writer, buf->data, buf->len))) {
+		error("failed to write moof: %s", strerror(rc));
+		goto finally;
+	}
+
+	if ((rc = mp4_writer_output(writer, writer->mdat.data,
+			writer->mdat.len))) {
+		error("failed to write mdat: %s", strerror(rc));
+		goto finally;
+	}
+
+	writer->decode_time += (u_int64_t) writer->frag.num * writer->fps.den;
+	writer->frag.num = 0;
+	writer->mdat.len = 0;
+	rc = 0;
+
+finally:
+	return rc;
+}
+
+static int mp4_writer_output(struct mp4_writer *writer,
+		const unsigned char *data, size_t len)
+{
+	int rc;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(writer->fd, data, len)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			rc = errno ? errno : -1;
+			error("failed to write(): %s", strerror(rc));
+			goto finally;
+		}
+
+		data += n;
+		len -= n;
+	}
+
+	rc = 0;
+
+finally:
+	return rc;
+}
+
+/* returns the NAL after the next start code and its length, or NULL */
+static const unsigned char *nal_next(const unsigned char *p,
+		const unsigned char *end, size_t *len)
+{
+	const unsigned char *nal, *q;
+
+	for (; p + 3 <= end; p++) {
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+			break;
+		}
+	}
+
+	if (p + 3 > end) {
+		return NULL;
+	}
+
+	nal = p + 3;
+
+	for (q = nal; q + 3 <= end; q++) {
+		if (q[0] == 0 && q[1] == 0 && q[2] <= 1) {
+			break;
+		}
+	}
+
+	if (q + 3 > end) {
+		q = end;
+	}
+
+	/* a 4 byte start code leaves its leading zero behind */
+	while (q > nal && q[-1] == 0) {
+		q--;
+	}
+
+	if (q == nal) {
+		return nal_next(nal, end, len);
+	}
+
+	*len = q - nal;
+	return nal;
+}
+
+static void buf_reserve(struct mp4_buf *buf, size_t len)
+{
+	size_t cap;
+	unsigned char *data;
+
+	if (buf->rc || buf->len + len <= buf->cap) {
+		return;
+	}
+
+	for (cap = buf->cap ? buf->cap : 4096; cap < buf->len + len; cap *= 2);
+
+	if (!(data = realloc(buf->data, cap))) {
+		buf->rc = errno ? errno : ENOMEM;
+		return;
+	}
+
+	buf->data = data;
+	buf->cap = cap;
+}
+
+static void buf_put(struct mp4_buf *buf, const void *data, size_t len)
+{
+	buf_reserve(buf, len);
+
+	if (buf->rc) {
+		return;
+	}
+
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void buf_put8(struct mp4_buf *buf, u_int8_t v)
+{
+	buf_put(buf, &v, 1);
+}
+
+static void buf_put16(struct mp4_buf *buf, u_int16_t v)
+{
+	unsigned char b[2] = { v >> 8, v };
+
+	buf_put(buf, b, sizeof(b));
+}
+
+static void buf_put32(struct mp4_buf *buf, u_int32_t v)
+{
+	unsigned char b[4] = { v >> 24, v >> 16, v >> 8, v };
+
+	buf_put(buf, b, sizeof(b));
+}
+
+static void buf_put64(struct mp4_buf *buf, u_int64_t v)
+{
+	buf_put32(buf, v >> 32);
+	buf_put32(buf, v);
+}
+
+static void buf_zero(struct mp4_buf *buf, size_t len)
+{
+	buf_reserve(buf, len);
+
+	if (buf->rc) {
+		return;
+	}
+
+	memset(buf->data + buf->len, '\0', len);
+	buf->len += len;
+}
+
+static void buf_set32(struct mp4_buf *buf, size_t offset, u_int32_t v)
+{
+	if (buf->rc) {
+		return;
+	}
+
+	buf->data[offset] = v >> 24;
+	buf->data[offset + 1] = v >> 16;
+	buf->data[offset + 2] = v >> 8;
+	buf->data[offset + 3] = v;
+}
+
+static size_t box_begin(struct mp4_buf *buf, const char *type)
+{
+	size_t offset = buf->len;
+
+	buf_put32(buf, 0);
+	buf_put(buf, type, 4);
+	return offset;
+}
+
+static size_t full_box_begin(struct mp4_buf *buf, const char *type,
+		u_int8_t version, u_int32_t flags)
+{
+	size_t offset = box_begin(buf, type);
+
+	buf_put32(buf, (version << 24) | (flags & 0xffffff));
+	return offset;
+}
+
+static void box_end(struct mp4_buf *buf, size_t offset)
+{
+	buf_set32(buf, offset, buf->len - offset);
+}
@@ -0,0 +1,52 @@
+// $Id$
+/*
+ * Copyright 2013 Cedric Shih (cedric dot shih at gmail dot com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MP4_H_
+#define MP4_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/*
+ * Fragmented MP4 (ISO-BMFF) writer for a single H.264 track: moov goes out
+ * with the first frame, then every fragment is appended as moof + mdat, so
+ * the file can be played while it grows.
+ */
+struct mp4_writer;
+
+/* fragment is the number of frames per moof; 0 for about one second */
+struct mp4_writer *mp4_writer_new(struct pit_dim *size, struct pit_frac *fps,
+		size_t fragment);
+
+void mp4_writer_free(struct mp4_writer *writer);
+
+int mp4_writer_open(struct mp4_writer *writer, const char *filename);
+
+int mp4_writer_close(struct mp4_writer *writer);
+
+/* data is one Annex B access unit; pts and dts count frames */
+int mp4_writer_write(struct mp4_writer *writer, void *data, size_t len,
+		int keyframe, int64_t pts, int64_t dts);
+
+size_t mp4_writer_num_frames(struct mp4_writer *writer);
+
+/* true if the file name asks for MP4 rather than AVI */
+int mp4_filename(const char *filename);
+
+#endif /* MP4_H_ */
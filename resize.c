@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "log.h"
 
@@ -153,15 +154,16 @@ void memdst_free(struct imgdst *img)
 	free(img);
 }
 
-struct fiosrc {
-	FILE *file;
+struct cbsrc {
+	imgsrc_read_cb cb;
+	void *cbarg;
 	unsigned char *row_cache;
 	unsigned char **row_caches;
 	int num_caches;
 	int first_row;
 };
 
-static void fiosrc_map_cache(struct fiosrc *src, int rowsize)
+static void cbsrc_map_cache(struct cbsrc *src, int rowsize)
 {
 	int i, j;
 	unsigned char *row = src->row_cache;
@@ -179,7 +181,7 @@ static void fiosrc_map_cache(struct fiosrc *src, int rowsize)
 	}
 }
 
-static int fiosrc_read_row(struct fiosrc *src, int rowsize)
+static int cbsrc_read_row(struct cbsrc *src, int rowsize)
 {
 	int rc;
 	int next_row = src->first_row + src->num_caches;
@@ -187,25 +189,24 @@ static int fiosrc_read_row(struct fiosrc *src, int rowsize)
 
 //	debug("reading next row: %d => %d", next_row, i);
 
-	if (fread(src->row_cache + (i * rowsize), 1, rowsize, src->file) !=
-			rowsize) {
-		rc = errno ? errno : -1;
-		error("fread: %s", strerror(rc));
+	if ((rc = (*src->cb)(src->row_cache + (i * rowsize), rowsize,
+			src->cbarg))) {
+		error("failed to read row %d: %s", next_row, strerror(rc));
 		goto finally;
 	}
 
 	src->first_row++;
-	fiosrc_map_cache(src, rowsize);
+	cbsrc_map_cache(src, rowsize);
 	rc = 0;
 
 finally:
 	return rc;
 }
 
-static unsigned char *fiosrc_read_scanline(struct imgsrc *img, int row)
+static unsigned char *cbsrc_read_scanline(struct imgsrc *img, int row)
 {
-	int rc;
-	struct fiosrc *src = img->arg;
+	int rc, i;
+	struct cbsrc *src = img->arg;
 	int next_row = src->first_row + src->num_caches;
 
 //	debug("reading row: %d", row);
@@ -213,18 +214,21 @@ static unsigned char *fiosrc_read_scanline(struct imgsrc *img, int row)
 	if (src->first_row < 0) {
 //		debug("caching first %d rows", src->num_caches);
 
-		if (fread(src->row_cache, img->rowsize, src->num_caches, src->file) !=
-				src->num_caches) {
-			rc = errno ? errno : -1;
-			error("fread: %s", strerror(rc));
-			return NULL;
+		for (i = 0; i < src->num_caches; i++) {
+			if ((rc = (*src->cb)(src->row_cache + (i * img->rowsize),
+					img->rowsize, src->cbarg))) {
+				error("failed to read row %d: %s", i,
+						strerror(rc));
+				return NULL;
+			}
 		}
 
 		src->first_row = 0;
-		fiosrc_map_cache(src, img->rowsize);
+		cbsrc_map_cache(src, img->rowsize);
 	} else if (row == next_row) {
-		fiosrc_read_row(src, img->rowsize);
-		fiosrc_map_cache(src, img->rowsize);
+		if (cbsrc_read_row(src, img->rowsize)) {
+			return NULL;
+		}
 	} else if (row > next_row) {
 		error("not incremental read");
 		return NULL;
@@ -233,12 +237,12 @@ static unsigned char *fiosrc_read_scanline(struct imgsrc *img, int row)
 	return src->row_caches[row - src->first_row];
 }
 
-struct imgsrc *fiosrc_new(FILE *file, int width, int height, int bpp,
-		int row_caches)
+struct imgsrc *cbsrc_new(int width, int height, int bpp, int row_caches,
+		imgsrc_read_cb cb, void *cbarg)
 {
 	int rc;
 	struct imgsrc *img = NULL;
-	struct fiosrc *src = NULL;
+	struct cbsrc *src = NULL;
 
 	CALLOC(img, *img, 1);
 
@@ -246,10 +250,15 @@ struct imgsrc *fiosrc_new(FILE *file, int width, int height, int bpp,
 	img->height = height;
 	img->bpp = bpp;
 	img->rowsize = rowstride(bpp, width);
-	img->read_scanline = fiosrc_read_scanline;
+	img->read_scanline = cbsrc_read_scanline;
+
+	if (row_caches > height) {
+		row_caches = height;
+	}
 
 	CALLOC(src, *src, 1);
-	src->file = file;
+	src->cb = cb;
+	src->cbarg = cbarg;
 	src->first_row = -1;
 	src->num_caches = row_caches;
 	CALLOC(src->row_caches, unsigned char *, row_caches);
@@ -274,14 +283,15 @@ finally:
 			free(img);
 		}
 
+		img = NULL;
 		errno = rc;
 	}
 	return img;
 }
 
-void fiosrc_free(struct imgsrc *img)
+void cbsrc_free(struct imgsrc *img)
 {
-	struct fiosrc *src;
+	struct cbsrc *src;
 
 	if (!img) {
 		return;
@@ -298,6 +308,92 @@ void fiosrc_free(struct imgsrc *img)
 	free(img);
 }
 
+static int fiosrc_read(unsigned char *row, size_t len, void *cbarg)
+{
+	if (fread(row, 1, len, cbarg) != len) {
+		return errno ? errno : -1;
+	}
+
+	return 0;
+}
+
+struct imgsrc *fiosrc_new(FILE *file, int width, int height, int bpp,
+		int row_caches)
+{
+	return cbsrc_new(width, height, bpp, row_caches, fiosrc_read, file);
+}
+
+void fiosrc_free(struct imgsrc *img)
+{
+	cbsrc_free(img);
+}
+
+struct cbdst {
+	imgdst_write_cb cb;
+	void *cbarg;
+};
+
+static int cbdst_write_scanline(struct imgdst *img, unsigned char *scanline)
+{
+	int rc;
+	struct cbdst *dst = img->arg;
+
+	if (img->row >= img->height) {
+		error("all scanlines written");
+		return -1;
+	}
+
+	if ((rc = (*dst->cb)(scanline, img->row, dst->cbarg))) {
+		return rc;
+	}
+
+	img->row++;
+	return 0;
+}
+
+struct imgdst *cbdst_new(int width, int height, int bpp,
+		imgdst_write_cb cb, void *cbarg)
+{
+	int rc;
+	struct imgdst *img = NULL;
+	struct cbdst *dst = NULL;
+
+	CALLOC(img, *img, 1);
+
+	img->width = width;
+	img->height = height;
+	img->bpp = bpp;
+	img->rowsize = rowstride(bpp, width);
+	img->write_scanline = cbdst_write_scanline;
+
+	CALLOC(dst, *dst, 1);
+	dst->cb = cb;
+	dst->cbarg = cbarg;
+
+	img->arg = dst;
+	rc = 0;
+
+finally:
+	if (rc != 0) {
+		if (img) {
+			free(img);
+		}
+		img = NULL;
+		errno = rc;
+	}
+	return img;
+}
+
+void cbdst_free(struct imgdst *img)
+{
+	if (!img) {
+		return;
+	}
+
+	FREE(img->arg);
+	free(img);
+}
+
 static int fiodst_write_scanline(struct imgdst *img, unsigned char *scanline)
 {
 	if (img->row >= img->height) {
@@ -369,14 +465,12 @@ void fiodst_free(struct imgdst *img)
 
 static float *togamma = NULL;
 static unsigned char *fromgamma = NULL;
+static pthread_once_t gamma_once = PTHREAD_ONCE_INIT;
 
-static void init_gamma(void)
+static void build_gamma(void)
 {
 	int i1, i2, i3;
 
-	if (togamma != NULL && fromgamma != NULL)
-		return;
-
 	togamma = malloc(sizeof(float) * 256);
 
 	for (i1 = 0; i1 < 256; i1++)
@@ -392,6 +486,11 @@ static void init_gamma(void)
 		fromgamma[i3] = 255;
 }
 
+static void init_gamma(void)
+{
+	pthread_once(&gamma_once, build_gamma);
+}
+
 static float lanczos(float x)
 {
 	if (x == 0.0f)
@@ -627,7 +726,11 @@ int scale_down(struct imgsrc *src, struct imgdst *dst)
 
 		for (t2 = 0; t2 < nrrows + t3; t2++)
 		{
-			rows[t2] = src->read_scanline(src, pos + t2);
+			if (!(rows[t2] = src->read_scanline(src, pos + t2))) {
+				rc = -1;
+				error("failed to read scanline: %d", pos + t2);
+				goto finally;
+			}
 		}
 
 //		warn("%s(%d)", __func__, __LINE__);
@@ -711,6 +814,49 @@ finally:
 	return rc;
 }
 
+int scale_down_rows(int src_height, int dst_height)
+{
+	float fy = (float) src_height / dst_height;
+	int nrrows = (int)ceil(fy + 1.0f);
+	int pos = dst_height / 2 * fy;
+	int t3 = pos + nrrows < src_height + 1 ? 0 : pos - src_height + 1;
+
+	return nrrows + t3;
+}
+
+int scale_copy(struct imgsrc *src, struct imgdst *dst)
+{
+	int rc, y;
+	unsigned char *row;
+
+	if (src->width != dst->width || src->height != dst->height ||
+			src->bpp != dst->bpp) {
+		rc = EINVAL;
+		error("geometry mismatched: %dx%dx%d => %dx%dx%d",
+				src->width, src->height, src->bpp,
+				dst->width, dst->height, dst->bpp);
+		goto finally;
+	}
+
+	for (y = 0; y < src->height; y++) {
+		if (!(row = src->read_scanline(src, y))) {
+			rc = -1;
+			error("failed to read scanline: %d", y);
+			goto finally;
+		}
+
+		if ((rc = dst->write_scanline(dst, row))) {
+			error("write_scanline: %s", strerror(rc));
+			goto finally;
+		}
+	}
+
+	rc = 0;
+
+finally:
+	return rc;
+}
+
 #if 0
 int resize(FILE *f1, int w1, int h1, int bpp1,
 		FILE *f2, int w2, int h2, int bpp2)
@@ -15,6 +15,20 @@ struct imgdst *memdst_new(unsigned char *data, int width, int height, int bpp);
 
 void memdst_free(struct imgdst *img);
 
+typedef int (*imgsrc_read_cb)(unsigned char *row, size_t len, void *cbarg);
+
+struct imgsrc *cbsrc_new(int width, int height, int bpp, int row_caches,
+		imgsrc_read_cb cb, void *cbarg);
+
+void cbsrc_free(struct imgsrc *img);
+
+typedef int (*imgdst_write_cb)(unsigned char *row, int y, void *cbarg);
+
+struct imgdst *cbdst_new(int width, int height, int bpp,
+		imgdst_write_cb cb, void *cbarg);
+
+void cbdst_free(struct imgdst *img);
+
 struct imgsrc *fiosrc_new(FILE *file, int width, int height, int bpp,
 		int row_caches);
 
@@ -29,4 +43,8 @@ int scale_up(unsigned char *buffer, int width, int height, int bpp, int rowsize,
 
 int scale_down(struct imgsrc *src, struct imgdst *dst);
 
+int scale_down_rows(int src_height, int dst_height);
+
+int scale_copy(struct imgsrc *src, struct imgdst *dst);
+
 #endif /* RESIZE_H_ */
@@ -12,47 +12,18 @@
 #include <jpeglib.h>
 #include <jerror.h>
 
-static unsigned char clamp(int c)
-{
-	if (c < 0) {
-		return 0;
-	} else if (c > 255) {
-		return 255;
-	} else {
-		return (unsigned char) c;
-	}
-}
-
-static unsigned char stretch(int c, int min, int max)
-{
-	return clamp((c - min) * 255 / (max - min));
-}
-
-static void reverse(unsigned char *stride, size_t w)
-{
-	size_t i;
-	unsigned char r, g, b;
-
-	for (i = 0; i < w; i++) {
-		r = stride[0];
-		g = stride[1];
-		b = stride[2];
-
-		*stride++ = b;
-		*stride++ = g;
-		*stride++ = r;
-	}
-}
+#include "tone.h"
 
 int rgb2jpg(const char *dst, int quality, int black, int white, double a,
 		int b, unsigned char *src, int w, int h)
 {
-	int rc, y, i;
+	int rc, y, identity;
 	FILE *outfile = NULL;
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr cerr;
 	JSAMPROW cbuffer[1];
 	int cstride;
+	unsigned char lut[TONE_SIZE];
 
 	if (!(outfile = fopen(dst, "wb+"))) {
 		rc = errno ? errno : -1;
@@ -76,31 +47,16 @@ int rgb2jpg(const char *dst, int quality, int black, int white, double a,
 
 	cstride = cinfo.image_width * cinfo.input_components;
 
+	tone_build(lut, black, white, a, b);
+	identity = tone_identity(lut);
+
 	for (y = 0; y < h; y++) {
 		cbuffer[0] = src;
 
-		if (black > 0 && white < 255) {
-			for (i = 0; i < cstride; i++) {
-				cbuffer[0][i] = stretch(cbuffer[0][i], black, white);
-			}
-		}
-
-		if (a != 1.0 || b != 0) {
-			for (i = 0; i < cstride; i++) {
-				if (a != 1.0) {
-					cbuffer[0][i] = clamp(a *
-							cbuffer[0][i]);
-				}
-
-				if (b != 0) {
-					cbuffer[0][i] = clamp(b +
-							cbuffer[0][i]);
-				}
-			}
+		if (!identity) {
+			tone_apply(lut, cbuffer[0], cstride);
 		}
 
-		reverse(cbuffer[0], w);
-
 		jpeg_write_scanlines(&cinfo, cbuffer, 1);
 		src += cstride;
 	}
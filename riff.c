@@ -15,17 +15,27 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "log.h"
 
 #include "riff.h"
 
-struct riff_tree *riff_tree_new(FILE *file)
+static int riff_tree_append(struct riff_tree *tree, const void *data,
+		size_t len);
+static int riff_tree_pwrite(struct riff_tree *tree, const void *data,
+		size_t len, off_t offset);
+
+struct riff_tree *riff_tree_new(int fd)
 {
 	struct riff_tree *tree;
+	off_t offset;
 
 	if (!(tree = calloc(1, sizeof(*tree)))) {
 		error("failed to calloc riff_tree");
@@ -33,7 +43,20 @@ struct riff_tree *riff_tree_new(FILE *file)
 	}
 
 	TAILQ_INIT(&tree->list);
-	tree->file = file;
+	tree->fd = fd;
+
+	if (posix_memalign((void **) &tree->buf, 4096, RIFF_BUFFER_SIZE)) {
+		tree->buf = NULL;
+		error("failed to allocate write buffer");
+		goto error;
+	}
+
+	if ((offset = lseek(fd, 0, SEEK_CUR)) == -1) {
+		error("failed to lseek(): %s", strerror(errno));
+		goto error;
+	}
+
+	tree->flushed = tree->reserved = offset;
 
 	return tree;
 
@@ -50,6 +73,10 @@ void riff_tree_free(struct riff_tree *tree)
 
 	riff_list_clear(&tree->list);
 
+	if (tree->buf) {
+		free(tree->buf);
+	}
+
 	free(tree);
 }
 
@@ -58,7 +85,7 @@ int riff_tree_add_list(struct riff_tree *tree,
 {
 	int rc;
 
-	if ((rc = riff_list_add_list(&tree->list, NULL, tree->file,
+	if ((rc = riff_list_add_list(&tree->list, NULL, tree,
 			type, subtype, child))) {
 		goto finally;
 	}
@@ -74,7 +101,7 @@ int riff_tree_add_leaf(struct riff_tree *tree,
 {
 	int rc;
 
-	if ((rc = riff_list_add_leaf(&tree->list, NULL, tree->file,
+	if ((rc = riff_list_add_leaf(&tree->list, NULL, tree,
 			type, size, child))) {
 		goto finally;
 	}
@@ -99,8 +126,133 @@ finally:
 	return rc;
 }
 
+/* writes out the full buffer, reserving disk space an extent ahead */
+static int riff_tree_drain(struct riff_tree *tree)
+{
+	int rc;
+	size_t done;
+	ssize_t n;
+
+#ifdef FALLOC_FL_KEEP_SIZE
+	if (tree->reserved >= 0 && tree->flushed + tree->len > tree->reserved) {
+		if (fallocate(tree->fd, FALLOC_FL_KEEP_SIZE, tree->reserved,
+				RIFF_EXTENT_SIZE)) {
+			debug("preallocation unavailable: %s", strerror(errno));
+			tree->reserved = -1;
+		} else {
+			tree->reserved += RIFF_EXTENT_SIZE;
+		}
+	}
+#endif
+
+	for (done = 0; done < tree->len; done += n) {
+		if ((n = pwrite(tree->fd, tree->buf + done, tree->len - done,
+				tree->flushed + done)) < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+
+			rc = errno ? errno : -1;
+			error("failed to pwrite(): %s", strerror(rc));
+			goto finally;
+		}
+	}
+
+	tree->flushed += tree->len;
+	tree->len = 0;
+	rc = 0;
+
+finally:
+	return rc;
+}
+
+int riff_tree_append(struct riff_tree *tree, const void *data, size_t len)
+{
+	int rc;
+	size_t n;
+
+	while (len > 0) {
+		n = RIFF_BUFFER_SIZE - tree->len;
+		n = n < len ? n : len;
+
+		memcpy(tree->buf + tree->len, data, n);
+		tree->len += n;
+		data = (const unsigned char *) data + n;
+		len -= n;
+
+		if (tree->len == RIFF_BUFFER_SIZE &&
+				(rc = riff_tree_drain(tree))) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+/* patches bytes already written, in the buffer where they still are */
+int riff_tree_pwrite(struct riff_tree *tree, const void *data, size_t len,
+		off_t offset)
+{
+	int rc;
+	size_t n;
+	ssize_t written;
+
+	if (offset + len > tree->flushed + tree->len) {
+		error("writing beyond end: %ld+%zu", offset, len);
+		return EINVAL;
+	}
+
+	while (offset < tree->flushed && len > 0) {
+		n = tree->flushed - offset;
+		n = n < len ? n : len;
+
+		if ((written = pwrite(tree->fd, data, n, offset)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			rc = errno ? errno : -1;
+			error("failed to pwrite(): %s", strerror(rc));
+			return rc;
+		}
+
+		data = (const unsigned char *) data + written;
+		offset += written;
+		len -= written;
+	}
+
+	if (len > 0) {
+		memcpy(tree->buf + (offset - tree->flushed), data, len);
+	}
+
+	return 0;
+}
+
+int riff_tree_flush(struct riff_tree *tree)
+{
+	int rc;
+
+	if ((rc = riff_tree_drain(tree))) {
+		goto finally;
+	}
+
+	/* hand back whatever was preallocated past the end */
+	if (tree->reserved > tree->flushed &&
+			ftruncate(tree->fd, tree->flushed)) {
+		rc = errno ? errno : -1;
+		error("failed to ftruncate(): %s", strerror(rc));
+		goto finally;
+	}
+
+	rc = 0;
+
+finally:
+	return rc;
+}
+
 int riff_list_add_list(struct riff_list *list,
-		struct riff *parent, FILE *file,
+		struct riff *parent, struct riff_tree *tree,
 		u_int32_t type, u_int32_t subtype, struct riff **out)
 {
 	int rc;
@@ -124,7 +276,7 @@ int riff_list_add_list(struct riff_list *list,
 	TAILQ_INIT(&riff->list);
 
 	riff->parent = parent;
-	riff->file = file;
+	riff->tree = tree;
 	riff->type = FALCO_RIFF_LIST;
 	riff->offset = -1;
 	riff->header.list.type = type;
@@ -165,7 +317,7 @@ finally:
 }
 
 int riff_list_add_leaf(struct riff_list *list,
-		struct riff *parent, FILE *file,
+		struct riff *parent, struct riff_tree *tree,
 		u_int32_t type, u_int32_t size, struct riff **out)
 {
 	int rc;
@@ -189,7 +341,7 @@ int riff_list_add_leaf(struct riff_list *list,
 	TAILQ_INIT(&riff->list);
 
 	riff->parent = parent;
-	riff->file = file;
+	riff->tree = tree;
 	riff->type = FALCO_RIFF_LEAF;
 	riff->offset = -1;
 	riff->header.leaf.type = type;
@@ -279,7 +431,7 @@ int riff_add_list(struct riff *riff,
 		goto finally;
 	}
 
-	if ((rc = riff_list_add_list(&riff->list, riff, riff->file,
+	if ((rc = riff_list_add_list(&riff->list, riff, riff->tree,
 			type, subtype, child))) {
 		error("failed to add child list chunk: %s", strerror(rc));
 		goto finally;
@@ -300,7 +452,7 @@ int riff_add_leaf(struct riff *riff,
 		goto finally;
 	}
 
-	if ((rc = riff_list_add_leaf(&riff->list, riff, riff->file,
+	if ((rc = riff_list_add_leaf(&riff->list, riff, riff->tree,
 			type, size, child))) {
 		error("failed to add child leaf chunk: %s", strerror(rc));
 		goto finally;
@@ -316,8 +468,7 @@ int riff_write(struct riff *riff, void *data, size_t len)
 
 	debug("writing data of %s: %d bytes", riff->name, len);
 
-	if (!fwrite(data, len, 1, riff->file)) {
-		rc = errno ? errno : -1;
+	if ((rc = riff_tree_append(riff->tree, data, len))) {
 		error("failed to write data: %s", strerror(rc));
 		goto finally;
 	}
@@ -337,7 +488,7 @@ finally:
 int riff_update(struct riff *riff, void *data, size_t len)
 {
 	int rc;
-	off_t temp, offset;
+	off_t offset;
 
 	if (len > riff->size) {
 		rc = EOVERFLOW;
@@ -358,35 +509,14 @@ int riff_update(struct riff *riff, void *data, size_t len)
 		goto finally;
 	}
 
-	if ((temp = ftell(riff->file)) == -1) {
-		rc = errno ? errno : -1;
-		error("failed to ftell(): %s", strerror(rc));
-		goto finally;
-	}
-
-	if (fseek(riff->file, offset, 0) < 0) {
-		rc = errno ? errno : -1;
-		error("failed to seek to %ld: %s", offset,
-				strerror(rc));
-		goto finally;
-	}
-
 	debug("writing data of %s at %ld: %d bytes", riff->name,
 			offset, len);
 
-	if (!fwrite(data, len, 1, riff->file)) {
-		rc = errno ? errno : -1;
+	if ((rc = riff_tree_pwrite(riff->tree, data, len, offset))) {
 		error("failed to write data: %s", strerror(rc));
 		goto finally;
 	}
 
-	if (fseek(riff->file, temp, 0) < 0) {
-		rc = errno ? errno : -1;
-		error("failed to seek back to %ld: %s", temp,
-				strerror(rc));
-		goto finally;
-	}
-
 	rc = 0;
 
 finally:
@@ -422,7 +552,6 @@ int riff_write_header(struct riff *riff)
 	void *data;
 	size_t len;
 	u_int32_t *size;
-	long temp;
 
 	switch (riff->type) {
 	case FALCO_RIFF_LIST:
@@ -442,17 +571,12 @@ int riff_write_header(struct riff *riff)
 	}
 
 	if (riff->offset < 0) {
-		if ((riff->offset = ftell(riff->file)) == -1) {
-			rc = errno ? errno : -1;
-			error("failed to ftell(): %s", strerror(rc));
-			goto finally;
-		}
+		riff->offset = riff->tree->flushed + riff->tree->len;
 
 		debug("writing %s header for first time at: %ld",
 				riff->name, riff->offset);
 
-		if (!fwrite(data, sizeof(u_int8_t), len, riff->file)) {
-			rc = errno ? errno : -1;
+		if ((rc = riff_tree_append(riff->tree, data, len))) {
 			error("failed to write header: %s", strerror(rc));
 			goto finally;
 		}
@@ -469,34 +593,14 @@ int riff_write_header(struct riff *riff)
 
 		*size = riff->size;
 
-		if ((temp = ftell(riff->file)) == -1) {
-			rc = errno ? errno : -1;
-			error("failed to ftell(): %s", strerror(rc));
-			goto finally;
-		}
-
-		if (fseek(riff->file, riff->offset, 0) < 0) {
-			rc = errno ? errno : -1;
-			error("failed to seek to %ld: %s", riff->offset,
-					strerror(rc));
-			goto finally;
-		}
-
 		debug("refreshing %s header at: %ld",
 				riff->name, riff->offset);
 
-		if (!fwrite(data, sizeof(u_int8_t), len, riff->file)) {
-			rc = errno ? errno : -1;
+		if ((rc = riff_tree_pwrite(riff->tree, data, len,
+				riff->offset))) {
 			error("failed to write header: %s", strerror(rc));
 			goto finally;
 		}
-
-		if (fseek(riff->file, temp, 0) < 0) {
-			rc = errno ? errno : -1;
-			error("failed to seek back to %ld: %s", temp,
-					strerror(rc));
-			goto finally;
-		}
 	}
 
 	if (riff->type == FALCO_RIFF_LIST) {
@@ -37,7 +37,8 @@ size_t riff_list_header_size(void);
 
 struct riff_tree;
 
-struct riff_tree *riff_tree_new(FILE *file);
+/* takes an open descriptor; the tree buffers writes but never closes it */
+struct riff_tree *riff_tree_new(int fd);
 
 void riff_tree_free(struct riff_tree *tree);
 
@@ -49,6 +50,8 @@ int riff_tree_add_leaf(struct riff_tree *tree,
 
 int riff_tree_refresh(struct riff_tree *tree);
 
+int riff_tree_flush(struct riff_tree *tree);
+
 int riff_add_list(struct riff *riff,
 		u_int32_t type, u_int32_t subtype, struct riff **child);
 
@@ -80,7 +83,7 @@ enum riff_type {
 
 struct riff {
 	char name[11];
-	FILE *file;
+	struct riff_tree *tree;
 	enum riff_type type;
 	off_t offset;
 	size_t size;
@@ -99,17 +102,24 @@ struct riff {
 	struct riff_list list;
 };
 
+#define RIFF_BUFFER_SIZE (4 << 20)
+#define RIFF_EXTENT_SIZE (64 << 20)
+
 struct riff_tree {
-	FILE *file;
+	int fd;
+	unsigned char *buf; /* RIFF_BUFFER_SIZE bytes at file offset flushed */
+	size_t len;
+	off_t flushed;
+	off_t reserved; /* preallocated up to; negative if unsupported */
 	struct riff_list list;
 };
 
 int riff_list_add_list(struct riff_list *list,
-		struct riff *parent, FILE *file,
+		struct riff *parent, struct riff_tree *tree,
 		u_int32_t type, u_int32_t subtype, struct riff **riff);
 
 int riff_list_add_leaf(struct riff_list *list,
-		struct riff *parent, FILE *file,
+		struct riff *parent, struct riff_tree *tree,
 		u_int32_t type, u_int32_t size, struct riff **out);
 
 int riff_list_write_header(struct riff_list *list);
@@ -26,6 +26,9 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "log.h"
 #include "common.h"
@@ -35,8 +38,7 @@
 #include "rgbe.h"
 
 #define DEFAULT_OUTPUT "stack_%05d.hdr"
-#define TEMPFILE_RGB "tempfile.rgb"
-#define TEMPFILE_RGBF "tempfile.xyz"
+#define TEMPFILE_RGBF "tempfile.XXXXXX"
 
 #define murmur(fmt...) fprintf(stderr, fmt)
 
@@ -58,9 +60,35 @@ static int layer_cmp(struct layer *a, struct layer *b);
 RB_HEAD(stack, layer);
 RB_PROTOTYPE(stack, layer, entry, layer_cmp);
 
+struct accum {
+	float *data;
+	size_t len;
+	int fd;
+	unsigned int share;
+};
+
+struct stack_group {
+	struct stack stack;
+	char output[PATH_MAX];
+	int rc;
+	int done;
+};
+
+struct stack_pool {
+	struct stack_group *groups;
+	size_t num_groups;
+	size_t next;
+	unsigned int threads;
+	float evcenter;
+	float evmin;
+	int quit;
+	pthread_mutex_t mutex;
+	pthread_cond_t done;
+};
+
 static void stack_clear(struct stack *stack);
-static int stack_flush(struct stack *stack, float evcenter, float evmin,
-		const char *output);
+static int stack_flush(struct stack *stack, struct accum *acc,
+		float evcenter, float evmin, const char *output);
 
 void stack_help(FILE *file, char *basename, char *cmd)
 {
@@ -69,6 +97,7 @@ void stack_help(FILE *file, char *basename, char *cmd)
 			"    -o <output>         Output filename template (default: %s)\n"
 			"    -e <stop>           Bracket EV (specify for multiple times)\n"
 			"    -t <begin>:<end>    Treat file name as template, e.g. '%%08d.JPG'\n"
+			"    -j <threads>        Number of brackets stacked at once; 0 for number of CPUs. (default: 0)\n"
 			"\n", basename, cmd, DEFAULT_OUTPUT);
 }
 
@@ -180,202 +209,141 @@ static inline void nnadd(float *dst, float *x, float *y, size_t len)
 	}
 }
 
-static inline int freadn(void *dst, FILE *src, size_t len)
+static void accum_release(struct accum *acc)
 {
-	int rc;
-	size_t n, rem = len;
-	unsigned char *ptr = dst;
-
-	clearerr(src);
-
-	while (rem > 0) {
-		if ((n = fread(ptr, 1, rem, src)) != rem) {
-			if ((rc = ferror(src))) {
-				goto finally;
-			}
-
-			if (!n) {
-				rc = errno ? errno : -1;
-				goto finally;
-			}
+	if (acc->fd >= 0) {
+		if (acc->data) {
+			munmap(acc->data, acc->len);
 		}
-
-		rem -= n;
-		ptr += n;
+		close(acc->fd);
+	} else if (acc->data) {
+		free(acc->data);
 	}
 
-	rc = 0;
-
-finally:
-	return rc;
+	acc->data = NULL;
+	acc->len = 0;
+	acc->fd = -1;
 }
 
-static int load_file(const char *dst, const char *src, size_t w, size_t h)
+/*
+ * Keep the accumulator in RAM when it takes no more than its share of half
+ * of physical memory; otherwise back it with a file the kernel can page
+ * sequentially.
+ */
+static int accum_reserve(struct accum *acc, size_t len)
 {
 	int rc;
-	FILE *fdst = NULL, *fsrc = NULL;
-	size_t i, y, stride, len;
-	float *bdst = NULL;
-	unsigned char *bsrc = NULL;
+	long pages, pagesize;
+	void *data;
+	char path[] = TEMPFILE_RGBF;
 
-	stride = w * 3;
+	if (acc->data && acc->len >= len) {
+		return 0;
+	}
 
-	if (!(bdst = malloc(stride * sizeof(*bdst)))) {
-		rc = errno ? errno : -1;
-		error("malloc: %s", strerror(rc));
+	accum_release(acc);
+
+	pages = sysconf(_SC_PHYS_PAGES);
+	pagesize = sysconf(_SC_PAGESIZE);
+
+	if (pages > 0 && pagesize > 0 && len / pagesize <= pages / 2 / acc->share &&
+			(acc->data = malloc(len))) {
+		acc->len = len;
+		rc = 0;
 		goto finally;
 	}
 
-	if (!(bsrc = malloc(stride))) {
+	/* a file of its own, gone as soon as it is closed */
+	if ((acc->fd = mkstemp(path)) < 0) {
 		rc = errno ? errno : -1;
-		error("malloc: %s", strerror(rc));
+		error("mkstemp: %s", strerror(rc));
 		goto finally;
 	}
 
-	if (!(fsrc = fopen(src, "rb"))) {
+	debug("mapping %zu bytes of accumulator to %s", len, path);
+	unlink(path);
+
+	if (ftruncate(acc->fd, len)) {
 		rc = errno ? errno : -1;
-		error("fopen: %s", strerror(rc));
+		error("ftruncate: %s", strerror(rc));
 		goto finally;
 	}
 
-	if (!(fdst = fopen(dst, "wb+"))) {
+	if ((data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			acc->fd, 0)) == MAP_FAILED) {
 		rc = errno ? errno : -1;
-		error("fopen: %s", strerror(rc));
+		error("mmap: %s", strerror(rc));
 		goto finally;
 	}
 
-	for (y = 0; y < h; y++) {
-		if ((rc = freadn(bsrc, fsrc, stride))) {
-			error("fread: %s", strerror(rc));
-			goto finally;
-		}
-
-		for (i = 0; i < stride; i++) {
-			bdst[i] = bsrc[i] / 255.0;
-		}
+	acc->data = data;
+	acc->len = len;
 
-		if ((len = fwrite(bdst, sizeof(*bdst), stride, fdst)) != stride) {
-			rc = errno ? errno : -1;
-			error("fread: %s", strerror(rc));
-			goto finally;
-		}
+	if (madvise(acc->data, acc->len, MADV_SEQUENTIAL)) {
+		warn("madvise: %s", strerror(errno));
 	}
 
 	rc = 0;
 
 finally:
-	if (bsrc) {
-		free(bsrc);
-	}
-	if (bdst) {
-		free(bdst);
-	}
-	if (fsrc) {
-		fclose(fsrc);
-	}
-	if (fdst) {
-		fclose(fdst);
+	if (rc != 0) {
+		accum_release(acc);
 	}
 	return rc;
 }
 
-static void stack_line(float *bg, float *fg, float *mat, size_t len,
-		float factor, float lo, float hi)
-{
-	nclip(mat, fg, len, lo, hi);
-	nmultiply(fg, fg, len, factor);
-	nnmultiply(fg, fg, mat, len);
-	nsubtract(mat, mat, len, 1.0);
-	nnmultiply(bg, bg, mat, len);
-	nnadd(bg, bg, fg, len);
-}
-
-#if 0
-static int read_line(float *dst, const char *src, size_t y, size_t stride)
+static int load_file(float *dst, struct jpg_reader *src, size_t w, size_t h)
 {
 	int rc;
-	FILE *fsrc = NULL;
-	size_t len;
+	size_t i, y, stride;
+	unsigned char *bsrc = NULL;
 
-	if (!(fsrc = fopen(src, "rb"))) {
+	stride = w * 3;
+
+	if (!(bsrc = malloc(stride))) {
 		rc = errno ? errno : -1;
-		error("fopen: %s", strerror(rc));
+		error("malloc: %s", strerror(rc));
 		goto finally;
 	}
 
-	if (y != 0) {
-		len = y * stride * sizeof(*dst);
-
-		fprintf(stdout, "reading line: %d @ %d\n", y, len);
-
-		if (fseek(fsrc, len, SEEK_SET) < 0) {
-			rc = errno ? errno : -1;
-			error("fseek: %s (%s)", strerror(rc), src);
+	for (y = 0; y < h; y++) {
+		if ((rc = jpg_reader_read(src, bsrc, stride))) {
+			error("jpg_reader_read: %s", strerror(rc));
 			goto finally;
 		}
-	}
 
-	if ((rc = freadn(dst, fsrc, stride * sizeof(*dst)))) {
-		error("fread: %s", strerror(rc));
-		goto finally;
+		for (i = 0; i < stride; i++) {
+			*dst++ = bsrc[i] / 255.0;
+		}
 	}
 
 	rc = 0;
 
 finally:
-	if (fsrc) {
-		fclose(fsrc);
+	if (bsrc) {
+		free(bsrc);
 	}
 	return rc;
 }
 
-static int write_line(const char *dst, float *src, size_t y, size_t stride)
+void stack_line(float *bg, float *fg, float *mat, size_t len,
+		float factor, float lo, float hi)
 {
-	int rc;
-	FILE *fdst = NULL;
-	size_t len;
-
-	if (!(fdst = fopen(dst, "wb"))) {
-		rc = errno ? errno : -1;
-		error("fopen: %s", strerror(rc));
-		goto finally;
-	}
-
-//	fprintf(stdout, "writing line: %d\n", y);
-
-	if (y != 0) {
-		if (fseek(fdst, y * stride * sizeof(*dst), SEEK_SET) < 0) {
-			rc = errno ? errno : -1;
-			error("fseek: %s", strerror(rc));
-			goto finally;
-		}
-	}
-
-	if ((len = fwrite(src, sizeof(*src), stride, fdst)) != stride) {
-		rc = errno ? errno : -1;
-		error("fwrite: %s", strerror(rc));
-		goto finally;
-	}
-
-	rc = 0;
-
-finally:
-	if (fdst) {
-		fflush(fdst);
-		fclose(fdst);
-	}
-	return rc;
+	nclip(mat, fg, len, lo, hi);
+	nmultiply(fg, fg, len, factor);
+	nnmultiply(fg, fg, mat, len);
+	nsubtract(mat, mat, len, 1.0);
+	nnmultiply(bg, bg, mat, len);
+	nnadd(bg, bg, fg, len);
 }
-#endif
 
-static int stack_file(const char *dst, const char *src, size_t w, size_t h,
+static int stack_file(float *dst, struct jpg_reader *src, size_t w, size_t h,
 		float ev, float lo, float hi)
 {
 	int rc;
-	FILE *fdst = NULL, *fsrc = NULL;
-	size_t i, y, stride, len, off;
+	size_t i, y, stride, len;
 	unsigned char *bytes = NULL;
-	float factor, *bg = NULL, *fg = NULL, *mat = NULL;
+	float factor, *fg = NULL, *mat = NULL;
 
 	stride = w * 3;
 
@@ -385,13 +353,7 @@ static int stack_file(const char *dst, const char *src, size_t w, size_t h,
 		goto finally;
 	}
 
-	len = stride * sizeof(*bg);
-
-	if (!(bg = malloc(len))) {
-		rc = errno ? errno : -1;
-		error("malloc: %s", strerror(rc));
-		goto finally;
-	}
+	len = stride * sizeof(*fg);
 
 	if (!(fg = malloc(len))) {
 		rc = errno ? errno : -1;
@@ -405,23 +367,11 @@ static int stack_file(const char *dst, const char *src, size_t w, size_t h,
 		goto finally;
 	}
 
-	if (!(fsrc = fopen(src, "rb"))) {
-		rc = errno ? errno : -1;
-		error("fopen: %s", strerror(rc));
-		goto finally;
-	}
-
-	if (!(fdst = fopen(dst, "r+"))) {
-		rc = errno ? errno : -1;
-		error("fopen: %s", strerror(rc));
-		goto finally;
-	}
-
 	factor = ev_factor(ev);
 
 	for (y = 0; y < h; y++) {
-		if ((rc = freadn(bytes, fsrc, stride))) {
-			error("fread: %s", strerror(rc));
+		if ((rc = jpg_reader_read(src, bytes, stride))) {
+			error("jpg_reader_read: %s", strerror(rc));
 			goto finally;
 		}
 
@@ -429,35 +379,8 @@ static int stack_file(const char *dst, const char *src, size_t w, size_t h,
 			fg[i] = bytes[i] / 255.0;
 		}
 
-		off = y * stride * sizeof(*bg);
-		fseek(fdst, off, 0);
-
-		if ((rc = freadn(bg, fdst, stride * sizeof(*bg)))) {
-			error("fread: %s", strerror(rc));
-			goto finally;
-		}
-
-//		if ((rc = read_line(bg, dst, y, stride))) {
-//			error("read_line: %s", strerror(rc));
-//			goto finally;
-//		}
-
-		stack_line(bg, fg, mat, stride, factor, lo, hi);
-
-		fseek(fdst, off, 0);
-
-		if ((len = fwrite(bg, sizeof(*bg), stride, fdst)) != stride) {
-			rc = errno ? errno : -1;
-			error("fwrite: %s", strerror(rc));
-			goto finally;
-		}
-
-		fflush(fdst);
-
-//		if ((rc = write_line(dst, bg, y, stride))) {
-//			error("write_line: %s", strerror(rc));
-//			goto finally;
-//		}
+		stack_line(dst, fg, mat, stride, factor, lo, hi);
+		dst += stride;
 	}
 
 	rc = 0;
@@ -466,29 +389,20 @@ finally:
 	if (mat) {
 		free(mat);
 	}
-	if (bg) {
-		free(bg);
-	}
 	if (fg) {
 		free(fg);
 	}
 	if (bytes) {
 		free(bytes);
 	}
-	if (fdst) {
-		fclose(fdst);
-	}
-	if (fsrc) {
-		fclose(fsrc);
-	}
 	return rc;
 }
 
-static int write_file(const char *dst, const char *src, size_t w, size_t h, float factor)
+static int write_file(const char *dst, float *src, size_t w, size_t h,
+		float factor)
 {
 	int rc, y;
-	FILE *fdst = NULL, *fsrc = NULL;
-	float *buffer = NULL;
+	FILE *fdst = NULL;
 	size_t stride = w * 3;
 
 	if (!(fdst = fopen(dst, "wb+"))) {
@@ -497,37 +411,23 @@ static int write_file(const char *dst, const char *src, size_t w, size_t h, floa
 		goto finally;
 	}
 
-	if (!(fsrc = fopen(src, "rb"))) {
-		rc = errno ? errno : -1;
-		error("fopen: %s", strerror(rc));
-		goto finally;
-	}
-
-	if (!(buffer = malloc(stride * sizeof(*buffer)))) {
-		rc = errno ? errno : -1;
-		error("malloc: %s", strerror(rc));
-		goto finally;
-	}
-
 	if (RGBE_WriteHeader(fdst, w, h, NULL)) {
 		rc = errno ? errno : -1;
 		error("RGBE_WriteHeader: %s", strerror(rc));
 		goto finally;
 	}
 
+	/* the accumulator is done with, so scale it in place */
 	for (y = 0; y < h; y++) {
-		if ((rc = freadn(buffer, fsrc, stride * sizeof(*buffer)))) {
-			error("fread: %s (y=%d)", strerror(rc), y);
-			goto finally;
-		}
+		nmultiply(src, src, stride, factor);
 
-		nmultiply(buffer, buffer, stride, factor);
-
-		if (RGBE_WritePixels(fdst, buffer, w)) {
+		if (RGBE_WritePixels(fdst, src, w)) {
 			rc = errno ? errno : -1;
 			error("RGBE_WritePixels: %s", strerror(rc));
 			goto finally;
 		}
+
+		src += stride;
 	}
 
 	rc = 0;
@@ -536,22 +436,55 @@ finally:
 	if (fdst) {
 		fclose(fdst);
 	}
-	if (fsrc) {
-		fclose(fsrc);
-	}
 	return rc;
 }
 
+static void *stack_worker(void *arg)
+{
+	struct stack_pool *pool = arg;
+	struct stack_group *group;
+	struct accum acc;
+	int rc;
+
+	memset(&acc, '\0', sizeof(acc));
+	acc.fd = -1;
+
+	acc.share = pool->threads;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	while (!pool->quit && pool->next < pool->num_groups) {
+		group = pool->groups + pool->next++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		rc = stack_flush(&group->stack, &acc, pool->evcenter,
+				pool->evmin, group->output);
+
+		pthread_mutex_lock(&pool->mutex);
+		group->rc = rc;
+		group->done = 1;
+		pthread_cond_broadcast(&pool->done);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	accum_release(&acc);
+	return NULL;
+}
+
 int stack(char *basename, int argc, char **argv)
 {
 	int rc, c, i, j;
 	enum pit_log_level log_level = PIT_WARN;
 	struct pit_range range;
+	struct stack_pool pool;
+	struct stack_group *group;
+	pthread_t *tids = NULL;
+	unsigned int threads, started = 0;
 	struct fileque list;
 	struct file *item;
 	struct evlist evlist;
 	struct ev *ev;
-	struct stack stack;
 	struct layer *layer;
 	size_t total, count, evnum;
 	char *ptr, *output = DEFAULT_OUTPUT;
@@ -561,14 +494,18 @@ int stack(char *basename, int argc, char **argv)
 	buffer = NULL;
 	TAILQ_INIT(&list);
 	TAILQ_INIT(&evlist);
-	RB_INIT(&stack);
 	evnum = 0;
+	threads = 0;
+
+	memset(&pool, '\0', sizeof(pool));
+	pthread_mutex_init(&pool.mutex, NULL);
+	pthread_cond_init(&pool.done, NULL);
 
 	memset(&range, '\0', sizeof(range));
 	range.lo.value = -1;
 	range.hi.value = -1;
 
-	while ((c = getopt(argc, argv, "vo:e:t:")) != -1) {
+	while ((c = getopt(argc, argv, "vo:e:t:j:")) != -1) {
 		switch (c) {
 		case 'v':
 			log_level--;
@@ -606,6 +543,15 @@ int stack(char *basename, int argc, char **argv)
 				goto finally;
 			}
 			break;
+		case 'j':
+			threads = (unsigned int) strtoul(optarg, &ptr, 10);
+
+			if (*ptr != '\0') {
+				rc = EINVAL;
+				murmur("Invalid number of threads: %s\n", optarg);
+				goto finally;
+			}
+			break;
 		default:
 			/* unrecognised option ... add your error condition */
 			break;
@@ -700,7 +646,25 @@ int stack(char *basename, int argc, char **argv)
 
 	fprintf(stdout, "Center EV: %f\n", evstop);
 
-	count = 0;
+	if (!(pool.groups = calloc(total / evnum, sizeof(*pool.groups)))) {
+		rc = errno ? errno : -1;
+		error("calloc: %s", strerror(rc));
+		goto finally;
+	}
+
+	pool.num_groups = total / evnum;
+	pool.evcenter = evstop;
+	pool.evmin = evmin;
+
+	/* brackets are named by their place in the list, not by completion */
+	for (count = 0; count < pool.num_groups; count++) {
+		group = pool.groups + count;
+		RB_INIT(&group->stack);
+		snprintf(group->output, sizeof(group->output), output,
+				count + 1);
+	}
+
+	group = pool.groups;
 	ev = TAILQ_FIRST(&evlist);
 
 	TAILQ_FOREACH(item, &list, next) {
@@ -712,31 +676,95 @@ int stack(char *basename, int argc, char **argv)
 
 		layer->stop = ev->stop;
 		layer->path = item->path;
-		RB_INSERT(stack, &stack, layer);
+		RB_INSERT(stack, &group->stack, layer);
 
 		if (!(ev = TAILQ_NEXT(ev, next))) {
-			snprintf(fmt, sizeof(fmt), "%d", total / evnum);
-			snprintf(fmt, sizeof(fmt), "%%0%dd", strlen(fmt));
+			group++;
+			ev = TAILQ_FIRST(&evlist);
+		}
+	}
 
-			fprintf(stdout, fmt, count + 1);
-			fprintf(stdout, "/%d: ", total / evnum);
+	if (threads == 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ?
+				sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	}
 
-			count++;
-			snprintf(fmt, sizeof(fmt), output, count);
+	if (threads > pool.num_groups) {
+		threads = pool.num_groups;
+	}
 
-			stack_flush(&stack, evstop, evmin, fmt);
+	pool.threads = threads;
 
-			fprintf(stdout, "OK\n");
+	if (!(tids = calloc(threads, sizeof(*tids)))) {
+		rc = errno ? errno : -1;
+		error("calloc: %s", strerror(rc));
+		goto finally;
+	}
 
-			ev = TAILQ_FIRST(&evlist);
+	for (started = 0; started < threads; started++) {
+		if ((rc = pthread_create(&tids[started], NULL, stack_worker,
+				&pool))) {
+			error("pthread_create: %s", strerror(rc));
+			goto finally;
 		}
 	}
 
+	snprintf(fmt, sizeof(fmt), "%zu", pool.num_groups);
+	snprintf(fmt, sizeof(fmt), "%%0%zuzu", strlen(fmt));
+
+	/* report in list order whichever worker finishes first */
+	for (count = 0; count < pool.num_groups; count++) {
+		group = pool.groups + count;
+
+		pthread_mutex_lock(&pool.mutex);
+
+		while (!group->done) {
+			pthread_cond_wait(&pool.done, &pool.mutex);
+		}
+
+		pthread_mutex_unlock(&pool.mutex);
+
+		fprintf(stdout, fmt, count + 1);
+		fprintf(stdout, "/%zu: ", pool.num_groups);
+
+		RB_FOREACH(layer, stack, &group->stack) {
+			fprintf(stdout, "%s => ", layer->path);
+		}
+
+		fprintf(stdout, "%s => ", group->output);
+
+		if ((rc = group->rc)) {
+			fprintf(stdout, "Failed\n");
+			error("stack_flush: %s", strerror(rc));
+			goto finally;
+		}
+
+		fprintf(stdout, "OK\n");
+	}
+
 	rc = 0;
 
 finally:
-	unlink(TEMPFILE_RGB);
-	unlink(TEMPFILE_RGBF);
+	pthread_mutex_lock(&pool.mutex);
+	pool.quit = 1;
+	pthread_mutex_unlock(&pool.mutex);
+
+	while (started > 0) {
+		pthread_join(tids[--started], NULL);
+	}
+
+	if (tids) {
+		free(tids);
+	}
+	if (pool.groups) {
+		for (count = 0; count < pool.num_groups; count++) {
+			stack_clear(&pool.groups[count].stack);
+		}
+
+		free(pool.groups);
+	}
+	pthread_cond_destroy(&pool.done);
+	pthread_mutex_destroy(&pool.mutex);
 	while ((ev = TAILQ_FIRST(&evlist))) {
 		TAILQ_REMOVE(&evlist, ev, next);
 		free(ev);
@@ -748,47 +776,73 @@ finally:
 	return rc;
 }
 
-int stack_flush(struct stack *stack, float evcenter, float evmin,
-		const char *output)
+int stack_flush(struct stack *stack, struct accum *acc, float evcenter,
+		float evmin, const char *output)
 {
 	int rc;
 	struct layer *layer;
-	size_t w, h;
+	struct jpg_reader *reader = NULL;
+	size_t w = 0, h = 0;
 
-	RB_FOREACH(layer, stack, stack) {
-		fprintf(stdout, "%s => ", layer->path);
+	if (RB_EMPTY(stack)) {
+		rc = EINVAL;
+		error("empty stack");
+		goto finally;
+	}
 
-		if ((rc = jpg2rgb(layer->path, TEMPFILE_RGB, 0, 255, 1, 0, &w, &h))) {
-			error("jpg2rgb: %s", strerror(rc));
+	RB_FOREACH(layer, stack, stack) {
+		if (!(reader = jpg_reader_open(layer->path, 0, 0, 0, 255, 1, 0))) {
+			rc = errno ? errno : -1;
+			error("jpg_reader_open: %s", strerror(rc));
 			goto finally;
 		}
 
 		if (layer == RB_MIN(stack, stack)) {
-			if ((rc = load_file(TEMPFILE_RGBF, TEMPFILE_RGB, w, h))) {
+			w = jpg_reader_width(reader);
+			h = jpg_reader_height(reader);
+
+			if ((rc = accum_reserve(acc, w * h * 3 *
+					sizeof(*acc->data)))) {
+				error("accum_reserve: %s", strerror(rc));
+				goto finally;
+			}
+
+			if ((rc = load_file(acc->data, reader, w, h))) {
 				error("load_file: %s", strerror(rc));
 				goto finally;
 			}
 		} else {
-			if ((rc = stack_file(TEMPFILE_RGBF, TEMPFILE_RGB, w, h,
+			if (jpg_reader_width(reader) != w ||
+					jpg_reader_height(reader) != h) {
+				rc = EINVAL;
+				error("size mismatch: %zux%zu", jpg_reader_width(
+						reader), jpg_reader_height(reader));
+				goto finally;
+			}
+
+			if ((rc = stack_file(acc->data, reader, w, h,
 					layer->stop - evmin, 0.7, 0.8))) {
 				error("stack_file: %s", strerror(rc));
 				goto finally;
 			}
 		}
-	}
 
-	fprintf(stdout, "%s => ", output);
+		jpg_reader_close(reader);
+		reader = NULL;
+	}
 
-	if ((rc = write_file(output, TEMPFILE_RGBF, w, h,
+	if ((rc = write_file(output, acc->data, w, h,
 			pow(2.0, evcenter - evmin)))) {
 		error("write_file: %s", strerror(rc));
 		goto finally;
 	}
 
-	stack_clear(stack);
 	rc = 0;
 
 finally:
+	if (reader) {
+		jpg_reader_close(reader);
+	}
 	return rc;
 }
 
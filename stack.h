@@ -22,4 +22,7 @@ int stack(char *basename, int argc, char **argv);
 
 void stack_help(FILE *file, char *basename, char *cmd);
 
+void stack_line(float *bg, float *fg, float *mat, size_t len,
+		float factor, float lo, float hi);
+
 #endif /* STACK_H_ */
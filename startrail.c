@@ -26,6 +26,7 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include "log.h"
 #include "common.h"
@@ -33,6 +34,7 @@
 #include "jpg2rgb.h"
 #include "rgb2jpg.h"
 #include "histogram.h"
+#include "blend.h"
 
 #define murmur(fmt...) fprintf(stderr, fmt)
 
@@ -50,6 +52,8 @@ void startrail_help(FILE *file, char *basename, char *cmd)
 			"    -q <quality>        Output JPEG quality from 0 to 100 (default: %d)\n"
 			"    -s <black>[:white]  Stretch contrast; black and white points could be pixel value or percentage calculated from first frame.\n"
 			"    -t <begin>:<end>    Treat file name as template, e.g. '%%08d.JPG'.\n"
+			"    -j <threads>        Number of decoder threads; 0 for number of CPUs. (default: 0)\n"
+			"    -S <state>          Keep the trails and merged frames in state, so that later runs only merge new frames.\n"
 			"\n", basename, cmd, DEFAULT_OUTOUT, DEFAULT_QUALITY);
 }
 
@@ -66,50 +70,454 @@ static int jpeg_filter(const char *filename, const char *extname, void *cbarg)
 	}
 }
 
-#define MAX(a,b) a > b ? a : b
+struct startrail_job {
+	const char *path;
+	struct pit_dim size;
+	int skip;
+	int merged;
+	int done;
+	int rc;
+};
+
+struct startrail_pool {
+	struct pit_dim size;
+	struct startrail_job *jobs;
+	size_t num_jobs;
+	size_t next;
+	int quit;
+	int rc;
+	pthread_mutex_t mutex;
+	pthread_cond_t done;
+};
+
+struct startrail_worker {
+	struct startrail_pool *pool;
+	pthread_t thread;
+	int running;
+	unsigned char *acc;
+	unsigned char *row;
+};
+
+static int blend_file(unsigned char *acc, unsigned char *row,
+		const char *path, size_t w, size_t h)
+{
+	int rc;
+	struct jpg_reader *reader = NULL;
+	size_t y, stride;
+
+	if (!(reader = jpg_reader_open(path, 0, 0, PIXEL_MIN, PIXEL_MAX,
+			1.0, 0))) {
+		rc = errno ? errno : -1;
+		error("jpg_reader_open: %s", strerror(rc));
+		goto finally;
+	}
+
+	if (jpg_reader_width(reader) != w || jpg_reader_height(reader) != h) {
+		rc = EINVAL;
+		error("size mismatch: %zux%zu", jpg_reader_width(reader),
+				jpg_reader_height(reader));
+		goto finally;
+	}
+
+	stride = w * 3;
+
+	for (y = 0; y < h; y++) {
+		if ((rc = jpg_reader_read(reader, row, stride))) {
+			error("jpg_reader_read: %s", strerror(rc));
+			goto finally;
+		}
+
+		blend_max(acc, row, stride);
+		acc += stride;
+	}
+
+	rc = 0;
 
-static int load_file(unsigned char *dst, const char *filename, size_t w, size_t h)
+finally:
+	if (reader) {
+		jpg_reader_close(reader);
+	}
+	return rc;
+}
+
+static void *blend_worker(void *arg)
+{
+	int rc;
+	struct startrail_worker *worker = arg;
+	struct startrail_pool *pool = worker->pool;
+	struct startrail_job *job;
+	size_t w = pool->size.width, h = pool->size.height;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	while (!pool->quit && pool->next < pool->num_jobs) {
+		job = pool->jobs + pool->next++;
+
+		if (job->skip || job->merged) {
+			continue;
+		}
+
+		pthread_mutex_unlock(&pool->mutex);
+
+		/* accumulators start black, as the single-threaded one did */
+		if (!worker->acc && !(worker->acc = calloc(w * h, 3))) {
+			rc = errno ? errno : -1;
+			error("calloc: %s", strerror(rc));
+		} else if (!worker->row && !(worker->row = malloc(w * 3))) {
+			rc = errno ? errno : -1;
+			error("malloc: %s", strerror(rc));
+		} else {
+			rc = blend_file(worker->acc, worker->row, job->path,
+					w, h);
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+
+		job->rc = rc;
+		job->done = 1;
+
+		if (rc != 0 && !pool->quit) {
+			pool->rc = rc;
+			pool->quit = 1;
+		}
+
+		pthread_cond_broadcast(&pool->done);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+struct startrail_merge {
+	pthread_t thread;
+	int running;
+	unsigned char *dst;
+	unsigned char *src;
+	size_t len;
+};
+
+static void *merge_worker(void *arg)
+{
+	struct startrail_merge *merge = arg;
+
+	blend_max(merge->dst, merge->src, merge->len);
+	return NULL;
+}
+
+/*
+ * Pairwise max of the accumulators, one thread per pair at every level,
+ * leaving the result in workers[0].acc.
+ */
+static int startrail_reduce(struct startrail_worker *workers, size_t n,
+		size_t len)
+{
+	int rc;
+	size_t i, j, k, step;
+	struct startrail_merge *merges = NULL;
+
+	if (!(merges = calloc(n, sizeof(*merges)))) {
+		rc = errno ? errno : -1;
+		error("calloc: %s", strerror(rc));
+		goto finally;
+	}
+
+	for (i = 0, j = 0; i < n; i++) {
+		if (workers[i].acc) {
+			workers[j++].acc = workers[i].acc;
+		}
+	}
+
+	for (i = j; i < n; i++) {
+		workers[i].acc = NULL;
+	}
+
+	n = j;
+
+	for (step = 1; step < n; step <<= 1) {
+		for (i = 0, k = 0; i + step < n; i += step << 1, k++) {
+			merges[k].dst = workers[i].acc;
+			merges[k].src = workers[i + step].acc;
+			merges[k].len = len;
+			merges[k].running = k > 0 && !pthread_create(
+					&merges[k].thread, NULL, merge_worker,
+					merges + k);
+
+			if (k > 0 && !merges[k].running) {
+				merge_worker(merges + k);
+			}
+		}
+
+		merge_worker(merges);
+
+		for (j = 1; j < k; j++) {
+			if (merges[j].running) {
+				pthread_join(merges[j].thread, NULL);
+			}
+		}
+	}
+
+	rc = 0;
+
+finally:
+	if (merges) {
+		free(merges);
+	}
+	return rc;
+}
+
+#define STATE_MAGIC "PITSTAR1"
+
+struct startrail_state_header {
+	char magic[8];
+	u_int32_t width;
+	u_int32_t height;
+	u_int32_t count;
+};
+
+/*
+ * What earlier runs left behind: the max of every frame they merged and
+ * the paths of those frames, so that only new ones have to be decoded.
+ */
+struct startrail_state {
+	struct pit_dim size;
+	unsigned char *acc;
+	char **paths;
+	size_t count;
+};
+
+static int state_compare(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static void state_clear(struct startrail_state *state)
+{
+	size_t i;
+
+	for (i = 0; i < state->count; i++) {
+		free(state->paths[i]);
+	}
+
+	if (state->paths) {
+		free(state->paths);
+	}
+
+	if (state->acc) {
+		free(state->acc);
+	}
+
+	memset(state, '\0', sizeof(*state));
+}
+
+static int state_merged(struct startrail_state *state, const char *path)
+{
+	return state->count > 0 && bsearch(&path, state->paths, state->count,
+			sizeof(*state->paths), state_compare) != NULL;
+}
+
+static int state_load(struct startrail_state *state, const char *path)
 {
 	int rc;
 	FILE *file = NULL;
-	size_t i, y, stride, len;
-	unsigned char *buffer = NULL;
+	struct startrail_state_header hdr;
+	struct stat st;
+	u_int32_t len;
+	size_t num, left;
 
-	stride = w * 3;
+	if (!(file = fopen(path, "rb"))) {
+		rc = errno ? errno : -1;
 
-	if (!(buffer = malloc(stride))) {
+		if (rc != ENOENT) {
+			error("fopen: %s (%s)", strerror(rc), path);
+		}
+		goto finally;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1 ||
+			memcmp(hdr.magic, STATE_MAGIC, sizeof(hdr.magic)) ||
+			hdr.width == 0 || hdr.height == 0) {
+		rc = EINVAL;
+		error("not a star trail state: %s", path);
+		goto finally;
+	}
+
+	if (fstat(fileno(file), &st)) {
 		rc = errno ? errno : -1;
-		error("malloc: %s", strerror(rc));
+		error("fstat: %s (%s)", strerror(rc), path);
 		goto finally;
 	}
 
-	if (!(file = fopen(filename, "rb"))) {
+	left = (size_t) st.st_size > sizeof(hdr) ?
+			(size_t) st.st_size - sizeof(hdr) : 0;
+
+	/* the accumulator and a length per path have to be in the file */
+	if (hdr.width > left / hdr.height / 3 ||
+			hdr.count > (left - (size_t) hdr.width * hdr.height * 3) /
+			sizeof(len)) {
+		rc = EINVAL;
+		error("corrupted state: %s", path);
+		goto finally;
+	}
+
+	state->size.width = hdr.width;
+	state->size.height = hdr.height;
+	num = state->size.width * state->size.height * 3;
+
+	if (!(state->paths = calloc((size_t) hdr.count + 1,
+			sizeof(*state->paths))) ||
+			!(state->acc = malloc(num))) {
 		rc = errno ? errno : -1;
-		error("fopen: %s", strerror(rc));
+		error("malloc: %s", strerror(rc));
 		goto finally;
 	}
 
-	for (y = 0; y < h; y++) {
-		if ((len = fread(buffer, 1, stride, file)) != stride) {
+	for (; state->count < hdr.count; state->count++) {
+		if (fread(&len, sizeof(len), 1, file) != 1 ||
+				len >= PATH_MAX) {
+			rc = EINVAL;
+			error("corrupted state: %s", path);
+			goto finally;
+		}
+
+		if (!(state->paths[state->count] = malloc(len + 1))) {
 			rc = errno ? errno : -1;
-			error("fread: %s", strerror(rc));
+			error("malloc: %s", strerror(rc));
 			goto finally;
 		}
 
-		for (i = 0; i < stride; i++) {
-			*dst++ = MAX(buffer[i], *dst);
+		state->paths[state->count][len] = '\0';
+
+		if (len > 0 && fread(state->paths[state->count], len, 1,
+				file) != 1) {
+			free(state->paths[state->count]);
+			rc = EINVAL;
+			error("corrupted state: %s", path);
+			goto finally;
 		}
 	}
 
+	if (fread(state->acc, num, 1, file) != 1) {
+		rc = EINVAL;
+		error("corrupted state: %s", path);
+		goto finally;
+	}
+
+	qsort(state->paths, state->count, sizeof(*state->paths),
+			state_compare);
 	rc = 0;
 
 finally:
-	if (buffer) {
-		free(buffer);
+	if (file) {
+		fclose(file);
+	}
+	if (rc != 0) {
+		state_clear(state);
+	}
+	return rc;
+}
+
+static int state_write(FILE *file, const void *data, size_t len)
+{
+	if (len > 0 && fwrite(data, len, 1, file) != 1) {
+		return errno ? errno : -1;
+	}
+
+	return 0;
+}
+
+static int state_write_path(FILE *file, const char *path)
+{
+	int rc;
+	u_int32_t len = strlen(path);
+
+	if ((rc = state_write(file, &len, sizeof(len)))) {
+		return rc;
+	}
+
+	return state_write(file, path, len);
+}
+
+/*
+ * The paths loaded into state followed by those of the jobs done now; it is
+ * written aside and renamed, so an interrupted run leaves the old state.
+ */
+static int state_save(const char *path, struct startrail_state *state,
+		struct pit_dim *size, const unsigned char *acc,
+		struct startrail_job *jobs, size_t num_jobs)
+{
+	int rc;
+	FILE *file = NULL;
+	struct startrail_state_header hdr;
+	char tmp[PATH_MAX];
+	size_t i;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	memset(&hdr, '\0', sizeof(hdr));
+	memcpy(hdr.magic, STATE_MAGIC, sizeof(hdr.magic));
+	hdr.width = size->width;
+	hdr.height = size->height;
+	hdr.count = state->count;
+
+	for (i = 0; i < num_jobs; i++) {
+		hdr.count += jobs[i].done;
+	}
+
+	if (!(file = fopen(tmp, "wb"))) {
+		rc = errno ? errno : -1;
+		error("fopen: %s (%s)", strerror(rc), tmp);
+		goto finally;
+	}
+
+	if ((rc = state_write(file, &hdr, sizeof(hdr)))) {
+		error("failed to write '%s': %s", tmp, strerror(rc));
+		goto finally;
+	}
+
+	for (i = 0; i < state->count; i++) {
+		if ((rc = state_write_path(file, state->paths[i]))) {
+			error("failed to write '%s': %s", tmp, strerror(rc));
+			goto finally;
+		}
+	}
+
+	for (i = 0; i < num_jobs; i++) {
+		if (jobs[i].done && (rc = state_write_path(file,
+				jobs[i].path))) {
+			error("failed to write '%s': %s", tmp, strerror(rc));
+			goto finally;
+		}
 	}
+
+	if ((rc = state_write(file, acc, size->width * size->height * 3))) {
+		error("failed to write '%s': %s", tmp, strerror(rc));
+		goto finally;
+	}
+
+	if (fclose(file)) {
+		file = NULL;
+		rc = errno ? errno : -1;
+		error("failed to close '%s': %s", tmp, strerror(rc));
+		goto finally;
+	}
+
+	file = NULL;
+
+	if (rename(tmp, path)) {
+		rc = errno ? errno : -1;
+		error("failed to rename '%s': %s", tmp, strerror(rc));
+		goto finally;
+	}
+
+	rc = 0;
+
+finally:
 	if (file) {
 		fclose(file);
 	}
+	if (rc != 0) {
+		unlink(tmp);
+	}
 	return rc;
 }
 
@@ -119,24 +527,36 @@ int startrail(char *basename, int argc, char **argv)
 	enum pit_log_level log_level = PIT_WARN;
 	int quality;
 	struct pit_range stretch, range;
-	struct pit_dim size, sz;
+	struct pit_dim size;
 	size_t num;
 	unsigned char *out;
 	struct filelist list;
 	struct file *item;
 	size_t total, count;
-	char *tmp, *output = DEFAULT_OUTOUT;
+	char *tmp, *output = DEFAULT_OUTOUT, *state_path = NULL;
 	char fmt[256];
 	char rgb[PATH_MAX];
 	struct stat st;
 	off_t fsize;
 	FILE *file;
 	struct histogram *histogram = NULL;
+	unsigned int threads;
+	size_t n, pending, resumed;
+	struct startrail_state state;
+	struct startrail_pool pool;
+	struct startrail_job *job;
+	struct startrail_worker *workers = NULL;
 
 	RB_INIT(&list);
 	quality = DEFAULT_QUALITY;
+	threads = 0;
 	rgb[0] = '\0';
 
+	memset(&state, '\0', sizeof(state));
+	memset(&pool, '\0', sizeof(pool));
+	pthread_mutex_init(&pool.mutex, NULL);
+	pthread_cond_init(&pool.done, NULL);
+
 	memset(&stretch, '\0', sizeof(stretch));
 	stretch.lo.value = PIXEL_MIN;
 	stretch.hi.value = PIXEL_MAX;
@@ -146,12 +566,11 @@ int startrail(char *basename, int argc, char **argv)
 	range.hi.value = -1;
 
 	memset(&size, '\0', sizeof(size));
-	memset(&sz, '\0', sizeof(sz));
 
 	out = NULL;
 	file = NULL;
 
-	while ((c = getopt(argc, argv, "vq:o:s:t:")) != -1) {
+	while ((c = getopt(argc, argv, "vq:o:s:t:j:S:")) != -1) {
 		switch (c) {
 		case 'v':
 			log_level--;
@@ -195,6 +614,18 @@ int startrail(char *basename, int argc, char **argv)
 				goto finally;
 			}
 			break;
+		case 'j':
+			threads = (unsigned int) strtoul(optarg, &tmp, 10);
+
+			if (*tmp != '\0') {
+				rc = EINVAL;
+				murmur("Invalid number of threads: %s\n", optarg);
+				goto finally;
+			}
+			break;
+		case 'S':
+			state_path = optarg;
+			break;
 		default:
 			/* unrecognised option ... add your error condition */
 			break;
@@ -256,61 +687,148 @@ int startrail(char *basename, int argc, char **argv)
 		goto finally;
 	}
 
-	snprintf(rgb, sizeof(rgb), "decompressed.rgb");
+	if (state_path && (rc = state_load(&state, state_path)) &&
+			rc != ENOENT) {
+		error("state_load: %s", strerror(rc));
+		goto finally;
+	}
 
-	count = 0;
+	if (state.acc) {
+		fprintf(stdout, "Resuming %zu frames of %zux%zu from %s\n\n",
+				state.count, state.size.width,
+				state.size.height, state_path);
+		memcpy(&size, &state.size, sizeof(size));
+	}
 
-	RB_FOREACH(item, filelist, &list) {
-		snprintf(fmt, sizeof(fmt), "%d", total);
-		snprintf(fmt, sizeof(fmt), "%%0%dd", strlen(fmt));
+	if (!(pool.jobs = calloc(total, sizeof(*pool.jobs)))) {
+		rc = errno ? errno : -1;
+		error("calloc: %s", strerror(rc));
+		goto finally;
+	}
 
-		fprintf(stdout, fmt, count + 1);
-		fprintf(stdout, "/%d: %s => ", total, item->path);
+	resumed = 0;
 
-		if ((rc = jpg_read_header(item->path,
-				&sz.width, &sz.height))) {
+	/* sizes are known up front, so workers only get frames that fit */
+	RB_FOREACH(item, filelist, &list) {
+		job = pool.jobs + pool.num_jobs++;
+		job->path = item->path;
+
+		/* frames merged before do not even have their headers read */
+		if (state_merged(&state, item->path)) {
+			job->merged = 1;
+			resumed++;
+		} else if ((rc = jpg_read_header(item->path,
+				&job->size.width, &job->size.height))) {
 			error("jpg_read_header: %s", strerror(rc));
 			goto finally;
+		} else if (size.width == 0) {
+			memcpy(&size, &job->size, sizeof(size));
+		} else if (job->size.width != size.width ||
+				job->size.height != size.height) {
+			job->skip = 1;
 		}
 
-		if (!out) {
-			num = sz.width * sz.height * 3;
+		if (pool.num_jobs >= total) {
+			break;
+		}
+	}
 
-			if (!(out = calloc(sizeof(*out), num))) {
-				error("malloc: %s", strerror(rc));
-				goto finally;
-			}
+	pending = pool.num_jobs - resumed;
+	memcpy(&pool.size, &size, sizeof(pool.size));
+	num = size.width * size.height * 3;
 
-			memcpy(&size, &sz, sizeof(size));
-		} else {
-			if (sz.width != size.width ||
-					sz.height != size.height) {
-				fprintf(stdout, "Size mismatch: %dx%d\n",
-						sz.width, sz.height);
-				continue;
-			}
-		}
+	if (threads == 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ?
+				sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	}
+
+	if (threads > pending) {
+		threads = pending > 0 ? pending : 1;
+	}
+
+	if (!(workers = calloc(threads, sizeof(*workers)))) {
+		rc = errno ? errno : -1;
+		error("calloc: %s", strerror(rc));
+		goto finally;
+	}
+
+	for (n = 0; n < threads; n++) {
+		workers[n].pool = &pool;
 
-		if ((rc = jpg2rgb(item->path, rgb, 0, 255, 1, 0, NULL, NULL))) {
-			error("jpg2rgb: %s", strerror(rc));
+		if ((rc = pthread_create(&workers[n].thread, NULL,
+				blend_worker, workers + n))) {
+			error("pthread_create: %s", strerror(rc));
 			goto finally;
 		}
 
-		if ((rc = load_file(out, rgb, size.width, size.height))) {
-			error("load_file: %s", strerror(rc));
-			unlink(rgb);
-			goto finally;
+		workers[n].running = 1;
+	}
+
+	count = 0;
+
+	for (n = 0; n < pool.num_jobs; n++) {
+		job = pool.jobs + n;
+
+		if (job->merged) {
+			continue;
 		}
 
-		unlink(rgb);
+		snprintf(fmt, sizeof(fmt), "%zu", pending);
+		snprintf(fmt, sizeof(fmt), "%%0%zuzu", strlen(fmt));
+
+		fprintf(stdout, fmt, count + 1);
+		fprintf(stdout, "/%zu: %s => ", pending, job->path);
+
+		if (job->skip) {
+			fprintf(stdout, "Size mismatch: %zux%zu\n",
+					job->size.width, job->size.height);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool.mutex);
+
+		while (!job->done && !pool.quit) {
+			pthread_cond_wait(&pool.done, &pool.mutex);
+		}
+
+		rc = job->done ? job->rc : pool.rc;
+		pthread_mutex_unlock(&pool.mutex);
+
+		if (rc != 0) {
+			error("blend_file: %s", strerror(rc));
+			goto finally;
+		}
 
 		fprintf(stdout, "OK\n");
 
 		count++;
+	}
 
-		if (count >= total) {
-			break;
-		}
+	for (n = 0; n < threads; n++) {
+		pthread_join(workers[n].thread, NULL);
+		workers[n].running = 0;
+	}
+
+	if ((rc = startrail_reduce(workers, threads, num))) {
+		error("startrail_reduce: %s", strerror(rc));
+		goto finally;
+	}
+
+	out = workers[0].acc;
+	workers[0].acc = NULL;
+
+	/* the max is the same in whichever order frames come */
+	if (!out) {
+		out = state.acc;
+		state.acc = NULL;
+	} else if (state.acc) {
+		blend_max(out, state.acc, num);
+	}
+
+	if (state_path && (rc = state_save(state_path, &state, &size, out,
+			pool.jobs, pool.num_jobs))) {
+		error("state_save: %s", strerror(rc));
+		goto finally;
 	}
 
 	black = stretch.lo.value;
@@ -324,6 +842,9 @@ int startrail(char *basename, int argc, char **argv)
 			goto finally;
 		}
 
+		histogram_sample(histogram, histogram_sample_step(size.width,
+				size.height, HISTOGRAM_SAMPLE_ERROR));
+
 		if ((rc = histogram_load(histogram, out, size.width,
 				size.height))) {
 			error("histogram_load: %s", strerror(rc));
@@ -365,6 +886,33 @@ int startrail(char *basename, int argc, char **argv)
 	rc = 0;
 
 finally:
+	if (workers) {
+		pthread_mutex_lock(&pool.mutex);
+		pool.quit = 1;
+		pthread_mutex_unlock(&pool.mutex);
+
+		for (n = 0; n < threads; n++) {
+			if (workers[n].running) {
+				pthread_join(workers[n].thread, NULL);
+			}
+
+			if (workers[n].acc) {
+				free(workers[n].acc);
+			}
+
+			if (workers[n].row) {
+				free(workers[n].row);
+			}
+		}
+
+		free(workers);
+	}
+	if (pool.jobs) {
+		free(pool.jobs);
+	}
+	state_clear(&state);
+	pthread_cond_destroy(&pool.done);
+	pthread_mutex_destroy(&pool.mutex);
 	if (histogram) {
 		histogram_free(histogram);
 	}
@@ -25,6 +25,7 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include "log.h"
@@ -32,12 +33,16 @@
 #include "filelist.h"
 #include "jpg2rgb.h"
 #include "rgb2jpg.h"
+#include "jpg2jpg.h"
 #include "histogram.h"
 
 #define murmur(fmt...) fprintf(stderr, fmt)
 
 #define DEFAULT_QUALITY 98
 
+/* share of block averages that may clip before pixels are stretched */
+#define STRETCH_CLIP_SHARE 0.001
+
 #define PIXEL_MIN 0
 #define PIXEL_MAX 255
 
@@ -46,9 +51,11 @@ void stretch_help(FILE *file, char *basename, char *cmd)
 	fprintf(file, "Usage: %s %s [options] [file...]\n\n"
 			"Options:\n"
 			"    -o <output>         Output JPEG file\n"
-			"    -q <quality>        Output JPEG quality from 0 to 100 (default: %d)\n"
+			"    -q <quality>        Output JPEG quality from 0 to 100 when pixels are stretched (default: %d)\n"
 			"    -c <black>[:white]  Stretch contrast; black and white points could be pixel value or percentage calculated from first frame.\n"
 			"    -t <begin>:<end>    Treat file name as template, e.g. '%%08d.JPG'.\n"
+			"    -j <threads>        Number of files stretched at once; 0 for number of CPUs. (default: 0)\n"
+			"    -P                  Always stretch decoded pixels, even when DCT coefficients of the pictures could be stretched losslessly otherwise.\n"
 			"\n", basename, cmd, DEFAULT_QUALITY);
 }
 
@@ -56,7 +63,7 @@ static int jpeg_filter(const char *filename, const char *extname, void *cbarg)
 {
 	const char *output = cbarg;
 
-	if (strcmp(output, filename) && extname &&
+	if ((!output || strcmp(output, filename)) && extname &&
 			(!strcasecmp(extname, "jpg") ||
 			!strcasecmp(extname, "jpeg"))) {
 		return 1;
@@ -65,119 +72,137 @@ static int jpeg_filter(const char *filename, const char *extname, void *cbarg)
 	}
 }
 
-static int load_file(unsigned char *dst, const char *filename, size_t w, size_t h)
+struct stretch_scratch {
+	unsigned char *out;
+	size_t out_sz;
+	struct histogram *histogram;
+};
+
+struct stretch_job {
+	const char *path;
+	int black;
+	int white;
+	int rc;
+	int done;
+};
+
+struct stretch_pool {
+	struct stretch_job *jobs;
+	size_t num_jobs;
+	size_t next;
+	struct pit_range *contrast;
+	const char *output;
+	int quality;
+	int pixels;
+	int quit;
+	pthread_mutex_t mutex;
+	pthread_cond_t done;
+};
+
+static int decode_file(struct stretch_scratch *scratch, const char *filename,
+		struct pit_dim *size)
 {
 	int rc;
-	FILE *file = NULL;
-	size_t i, y, stride, len;
-	unsigned char *buffer = NULL;
-
-	stride = w * 3;
+	struct jpg_reader *reader = NULL;
+	unsigned char *out;
+	size_t y, stride, len;
 
-	if (!(buffer = malloc(stride))) {
+	if (!(reader = jpg_reader_open(filename, 0, 0, PIXEL_MIN, PIXEL_MAX,
+			1, 0))) {
 		rc = errno ? errno : -1;
-		error("malloc: %s", strerror(rc));
+		error("jpg_reader_open: %s", strerror(rc));
 		goto finally;
 	}
 
-	if (!(file = fopen(filename, "rb"))) {
-		rc = errno ? errno : -1;
-		error("fopen: %s", strerror(rc));
-		goto finally;
-	}
+	size->width = jpg_reader_width(reader);
+	size->height = jpg_reader_height(reader);
+	stride = size->width * 3;
+	len = stride * size->height;
 
-	for (y = 0; y < h; y++) {
-		if ((len = fread(buffer, 1, stride, file)) != stride) {
+	if (len > scratch->out_sz) {
+		if (!(out = realloc(scratch->out, len))) {
 			rc = errno ? errno : -1;
-			error("fread: %s", strerror(rc));
+			error("realloc: %s", strerror(rc));
 			goto finally;
 		}
 
-		for (i = 0; i < stride; i++) {
-			*dst++ = buffer[i];
+		scratch->out = out;
+		scratch->out_sz = len;
+	}
+
+	for (y = 0; y < size->height; y++) {
+		if ((rc = jpg_reader_read(reader, scratch->out + y * stride,
+				stride))) {
+			error("jpg_reader_read: %s", strerror(rc));
+			goto finally;
 		}
 	}
 
 	rc = 0;
 
 finally:
-	if (buffer) {
-		free(buffer);
-	}
-	if (file) {
-		fclose(file);
+	if (reader) {
+		jpg_reader_close(reader);
 	}
 	return rc;
 }
 
-static int stretch_file(const char *filename, struct pit_range *contrast,
-		const char *output, int quality)
+static int stretch_file(struct stretch_scratch *scratch, const char *filename,
+		struct pit_range *contrast, const char *output, int quality,
+		int pixels, int *black, int *white)
 {
-	int rc, black, white;
+	int rc;
 	struct pit_dim size;
-	size_t num;
-	unsigned char *out = NULL;
-	struct histogram *histogram = NULL;
-	FILE *file = NULL;
-	char rgb[PATH_MAX];
+	struct histogram *histogram = scratch->histogram;
 
-	snprintf(rgb, sizeof(rgb), "decompressed.rgb");
 	memset(&size, '\0', sizeof(size));
 	output = output ? output : filename;
 
-	if ((rc = jpg_read_header(filename, &size.width, &size.height))) {
-		error("jpg_read_header: %s", strerror(rc));
-		goto finally;
-	}
-
-	num = size.width * size.height * 3;
+	/* fixed points are stretched on coefficients unless much would clip */
+	if (!pixels && contrast->lo.unit != '%' && contrast->hi.unit != '%') {
+		*black = contrast->lo.value;
+		*white = contrast->hi.value;
 
-	if (!(out = calloc(sizeof(*out), num))) {
-		error("malloc: %s", strerror(rc));
-		goto finally;
-	}
-
-	if ((rc = jpg2rgb(filename, rgb, 0, 255, 1, 0, NULL, NULL))) {
-		error("jpg2rgb: %s", strerror(rc));
-		goto finally;
+		if ((rc = jpg2jpg(filename, output, *black, *white,
+				STRETCH_CLIP_SHARE)) != EAGAIN) {
+			if (rc) {
+				error("jpg2jpg: %s", strerror(rc));
+			}
+			goto finally;
+		}
 	}
 
-	if ((rc = load_file(out, rgb, size.width, size.height))) {
-		error("load_file: %s", strerror(rc));
-		unlink(rgb);
+	if ((rc = decode_file(scratch, filename, &size))) {
+		error("decode_file: %s", strerror(rc));
 		goto finally;
 	}
 
-	black = contrast->lo.value;
-	white = contrast->hi.value;
+	*black = contrast->lo.value;
+	*white = contrast->hi.value;
 
 	if (contrast->lo.unit == '%' || contrast->hi.unit == '%') {
-		if (!(histogram = histogram_new(256))) {
-			rc = errno ? errno : -1;
-			error("histogram_new: %s", strerror(rc));
-			goto finally;
-		}
+		histogram_reset(histogram);
+		histogram_sample(histogram, histogram_sample_step(size.width,
+				size.height, HISTOGRAM_SAMPLE_ERROR));
 
-		if ((rc = histogram_load(histogram, out, size.width,
+		if ((rc = histogram_load(histogram, scratch->out, size.width,
 				size.height))) {
 			error("histogram_load: %s", strerror(rc));
 			goto finally;
 		}
 
 		if (contrast->lo.unit == '%') {
-			black = histogram_ratio_value(histogram,
+			*black = histogram_ratio_value(histogram,
 					contrast->lo.value / 100);
 		}
 
 		if (contrast->hi.unit == '%') {
-			white = histogram_ratio_value(histogram,
+			*white = histogram_ratio_value(histogram,
 					contrast->hi.value / 100);
 		}
 	}
 
-	fprintf(stdout, "%d:%d => ", black, white);
-
-	if ((rc = rgb2jpg(output, quality, black, white, 1, 0, out,
+	if ((rc = rgb2jpg(output, quality, *black, *white, 1, 0, scratch->out,
 			size.width, size.height))) {
 		error("rgb2jpg: %s", strerror(rc));
 		goto finally;
@@ -186,17 +211,60 @@ static int stretch_file(const char *filename, struct pit_range *contrast,
 	rc = 0;
 
 finally:
-	unlink(rgb);
-	if (file) {
-		fclose(file);
+	return rc;
+}
+
+static void *stretch_worker(void *arg)
+{
+	struct stretch_pool *pool = arg;
+	struct stretch_scratch scratch;
+	struct stretch_job *job;
+	int rc, black, white;
+
+	memset(&scratch, '\0', sizeof(scratch));
+
+	if (!(scratch.histogram = histogram_new(256))) {
+		rc = errno ? errno : -1;
+		error("histogram_new: %s", strerror(rc));
+	} else {
+		/* the pool already keeps every CPU busy */
+		histogram_threads(scratch.histogram, 1);
+		rc = 0;
 	}
-	if (histogram) {
-		histogram_free(histogram);
+
+	pthread_mutex_lock(&pool->mutex);
+
+	while (!pool->quit && pool->next < pool->num_jobs) {
+		job = pool->jobs + pool->next++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		black = white = 0;
+
+		if (rc == 0) {
+			job->rc = stretch_file(&scratch, job->path,
+					pool->contrast, pool->output,
+					pool->quality, pool->pixels, &black,
+					&white);
+		} else {
+			job->rc = rc;
+		}
+
+		pthread_mutex_lock(&pool->mutex);
+		job->black = black;
+		job->white = white;
+		job->done = 1;
+		pthread_cond_broadcast(&pool->done);
 	}
-	if (out) {
-		free(out);
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (scratch.histogram) {
+		histogram_free(scratch.histogram);
 	}
-	return rc;
+	if (scratch.out) {
+		free(scratch.out);
+	}
+	return NULL;
 }
 
 int stretch(char *basename, int argc, char **argv)
@@ -208,11 +276,21 @@ int stretch(char *basename, int argc, char **argv)
 	struct filelist list;
 	struct file *item;
 	size_t total, count;
+	unsigned int threads, started;
+	pthread_t *tids = NULL;
+	struct stretch_pool pool;
+	struct stretch_job *job;
 	char *tmp, *output = NULL;
 	char fmt[PATH_MAX];
 
 	RB_INIT(&list);
 	quality = DEFAULT_QUALITY;
+	threads = 0;
+	started = 0;
+
+	memset(&pool, '\0', sizeof(pool));
+	pthread_mutex_init(&pool.mutex, NULL);
+	pthread_cond_init(&pool.done, NULL);
 
 	memset(&stretch, '\0', sizeof(stretch));
 	stretch.lo.value = PIXEL_MIN;
@@ -222,7 +300,7 @@ int stretch(char *basename, int argc, char **argv)
 	range.lo.value = -1;
 	range.hi.value = -1;
 
-	while ((c = getopt(argc, argv, "vq:o:c:t:")) != -1) {
+	while ((c = getopt(argc, argv, "vq:o:c:t:j:P")) != -1) {
 		switch (c) {
 		case 'v':
 			log_level--;
@@ -266,6 +344,18 @@ int stretch(char *basename, int argc, char **argv)
 				goto finally;
 			}
 			break;
+		case 'P':
+			pool.pixels = 1;
+			break;
+		case 'j':
+			threads = (unsigned int) strtoul(optarg, &tmp, 10);
+
+			if (*tmp != '\0') {
+				rc = EINVAL;
+				murmur("Invalid number of threads: %s\n", optarg);
+				goto finally;
+			}
+			break;
 		default:
 			/* unrecognised option ... add your error condition */
 			break;
@@ -333,33 +423,93 @@ int stretch(char *basename, int argc, char **argv)
 		goto finally;
 	}
 
-	count = 0;
+	if (!(pool.jobs = calloc(total, sizeof(*pool.jobs)))) {
+		rc = errno ? errno : -1;
+		error("calloc: %s", strerror(rc));
+		goto finally;
+	}
 
 	RB_FOREACH(item, filelist, &list) {
-		snprintf(fmt, sizeof(fmt), "%d", total);
-		snprintf(fmt, sizeof(fmt), "%%0%dd", strlen(fmt));
+		if (pool.num_jobs >= total) {
+			break;
+		}
 
-		fprintf(stdout, fmt, count + 1);
-		fprintf(stdout, "/%d: %s => ", total, item->path);
+		pool.jobs[pool.num_jobs++].path = item->path;
+	}
 
-		if ((rc = stretch_file(item->path, &stretch, output,
-				quality))) {
-			error("stretch_file: %s", strerror(rc));
+	pool.contrast = &stretch;
+	pool.output = output;
+	pool.quality = quality;
+
+	if (threads == 0) {
+		threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ?
+				sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	}
+
+	if (threads > pool.num_jobs) {
+		threads = pool.num_jobs;
+	}
+
+	if (!(tids = calloc(threads, sizeof(*tids)))) {
+		rc = errno ? errno : -1;
+		error("calloc: %s", strerror(rc));
+		goto finally;
+	}
+
+	for (started = 0; started < threads; started++) {
+		if ((rc = pthread_create(&tids[started], NULL, stretch_worker,
+				&pool))) {
+			error("pthread_create: %s", strerror(rc));
 			goto finally;
 		}
+	}
 
-		fprintf(stdout, "OK\n");
+	snprintf(fmt, sizeof(fmt), "%zu", pool.num_jobs);
+	snprintf(fmt, sizeof(fmt), "%%0%zuzu", strlen(fmt));
 
-		count++;
+	/* report in list order whichever worker finishes first */
+	for (count = 0; count < pool.num_jobs; count++) {
+		job = pool.jobs + count;
 
-		if (count >= total) {
-			break;
+		pthread_mutex_lock(&pool.mutex);
+
+		while (!job->done) {
+			pthread_cond_wait(&pool.done, &pool.mutex);
 		}
+
+		pthread_mutex_unlock(&pool.mutex);
+
+		fprintf(stdout, fmt, count + 1);
+		fprintf(stdout, "/%zu: %s => ", pool.num_jobs, job->path);
+
+		if ((rc = job->rc)) {
+			fprintf(stdout, "Failed\n");
+			error("stretch_file: %s", strerror(rc));
+			goto finally;
+		}
+
+		fprintf(stdout, "%d:%d => OK\n", job->black, job->white);
 	}
 
 	rc = 0;
 
 finally:
+	pthread_mutex_lock(&pool.mutex);
+	pool.quit = 1;
+	pthread_mutex_unlock(&pool.mutex);
+
+	while (started > 0) {
+		pthread_join(tids[--started], NULL);
+	}
+
+	if (tids) {
+		free(tids);
+	}
+	if (pool.jobs) {
+		free(pool.jobs);
+	}
+	pthread_cond_destroy(&pool.done);
+	pthread_mutex_destroy(&pool.mutex);
 	filelist_clear(&list);
 	return rc;
 }
@@ -25,6 +25,7 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include "log.h"
@@ -39,6 +40,8 @@
 #define DEFAULT_FPS 24
 #define DEFAULT_PROFILE "high"
 
+#define DEFAULT_CACHE_SIZE 4096
+
 #define PIXEL_MIN 0
 #define PIXEL_MAX 255
 
@@ -46,14 +49,195 @@ void timelapse_help(FILE *file, char *basename, char *cmd)
 {
 	fprintf(file, "Usage: %s %s [options] <width>x<height> [file...]\n\n"
 			"Options:\n"
-			"    -o <output>         Output video file. (default: %s)\n"
+			"    -o <output>         Output video file; fragmented MP4 if named .mp4 or .m4v, AVI otherwise. (default: %s)\n"
 			"    -f <fps>            Video frame rate. (default: %d)\n"
 			"    -d <duration>       Maximum video duration. (unit: second)\n"
-			"    -r <picture>        Index of reference picture. (default: 0)\n"
+			"    -r <picture>[:num]  Index of reference picture, and number of pictures spread from there to the end to analyse. (default: 0:1)\n"
 			"    -s <black>[:white]  Stretch contrast; black and white points could be pixel value or percentage calculated from reference picture.\n"
 			"    -t <begin>:<end>    Treat file name as template, e.g. '%%08d.JPG'.\n"
 			"    -F <head>:<tail>    Fade in/out effect. (unit: second)\n"
-			"\n", basename, cmd, DEFAULT_OUTOUT, DEFAULT_FPS);
+			"    -j <threads>        Number of decoder threads; 0 for number of CPUs. (default: 0)\n"
+			"    -c <matrix>[:range] Color space, 'bt601' or 'bt709' with 'limited' or 'full' range. (default: bt601:limited)\n"
+			"    -p <preset>[:tune]  x264 preset and tune, e.g. 'veryfast:film'. (default: %s:%s)\n"
+			"    -q <crf>            Constant rate factor from 0 to 51. (default: preset)\n"
+			"    -Q <qp>             Constant quantizer from 0 to 51; overrides -q.\n"
+			"    -k <keyint>         Maximum GOP length in frames. (default: preset)\n"
+			"    -l <frames>         Rate control lookahead in frames. (default: preset)\n"
+			"    -T <threads>        Number of encoder threads; 0 for auto. (default: 0)\n"
+			"    -S                  Use sliced threads instead of frame threads.\n"
+			"    -C <dir>[:MB]       Cache decoded frames in dir for re-renders, evicting the least recently used beyond MB. (default size: %d)\n"
+			"    -e <sessions>[:len] Encode segments of len frames as closed GOPs on parallel x264 sessions. (default: 1:keyint)\n"
+			"    -D <frames>         Deflicker towards the mean brightness of up to frames before and after each frame, at most %d. (default: 0, off)\n"
+			"\n", basename, cmd, DEFAULT_OUTOUT, DEFAULT_FPS,
+			AVCENC_DEFAULT_PRESET, AVCENC_DEFAULT_TUNE,
+			DEFAULT_CACHE_SIZE, JPG2AVC_DEFLICKER_MAX);
+}
+
+static int transcode_next(struct jpg2avc *ctx, size_t *count, size_t total)
+{
+	int rc;
+	const char *jpg = NULL;
+	char fmt[256];
+
+	rc = jpg2avc_next(ctx, &jpg);
+
+	snprintf(fmt, sizeof(fmt), "%zu", total);
+	snprintf(fmt, sizeof(fmt), "%%0%zuzu", strlen(fmt));
+
+	fprintf(stdout, fmt, ++(*count));
+	fprintf(stdout, "/%zu: %s => ", total, jpg);
+
+	if (rc == EINVAL) {
+		fprintf(stdout, "Invalid JPEG or aspect ratio\n");
+		rc = 0;
+	} else if (rc != 0) {
+		fprintf(stdout, "Failed\n");
+		error("jpg2avc_next: %s", strerror(rc));
+	} else {
+		fprintf(stdout, "OK\n");
+	}
+
+	return rc;
+}
+
+struct reference {
+	const char **paths;
+	size_t num;
+	size_t next;
+	struct histogram *histogram;
+	pthread_mutex_t lock;
+	int rc;
+};
+
+static int reference_load(struct reference *ref, const char *path)
+{
+	int rc;
+	struct jpg_reader *reader;
+	unsigned char *pixels = NULL;
+	size_t w, h, y, stride;
+
+	/* any scale yields 1x1, so the reader settles for 1/8: DC only */
+	if (!(reader = jpg_reader_open(path, 1, 1, PIXEL_MIN, PIXEL_MAX,
+			1.0, 0))) {
+		rc = errno ? errno : -1;
+		error("jpg_reader_open: %s (%s)", strerror(rc), path);
+		goto finally;
+	}
+
+	w = jpg_reader_width(reader);
+	h = jpg_reader_height(reader);
+	stride = w * 3;
+
+	if (!(pixels = malloc(stride * h))) {
+		rc = errno ? errno : -1;
+		error("malloc: %s", strerror(rc));
+		goto finally;
+	}
+
+	for (y = 0; y < h; y++) {
+		if ((rc = jpg_reader_read(reader, pixels + y * stride,
+				stride))) {
+			error("jpg_reader_read: %s (%s)", strerror(rc), path);
+			goto finally;
+		}
+	}
+
+	pthread_mutex_lock(&ref->lock);
+	rc = histogram_load(ref->histogram, pixels, w, h);
+	pthread_mutex_unlock(&ref->lock);
+
+	if (rc) {
+		error("histogram_load: %s", strerror(rc));
+		goto finally;
+	}
+
+	rc = 0;
+
+finally:
+	if (pixels) {
+		free(pixels);
+	}
+	if (reader) {
+		jpg_reader_close(reader);
+	}
+	return rc;
+}
+
+static void *reference_worker(void *arg)
+{
+	int rc;
+	struct reference *ref = arg;
+	const char *path;
+
+	for (;;) {
+		pthread_mutex_lock(&ref->lock);
+		path = (!ref->rc && ref->next < ref->num) ?
+				ref->paths[ref->next++] : NULL;
+		pthread_mutex_unlock(&ref->lock);
+
+		if (!path) {
+			break;
+		}
+
+		if ((rc = reference_load(ref, path))) {
+			pthread_mutex_lock(&ref->lock);
+			ref->rc = ref->rc ? ref->rc : rc;
+			pthread_mutex_unlock(&ref->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/* loads reference pictures into histogram, threads of them at a time */
+static int reference_analyse(struct histogram *histogram,
+		const char **paths, size_t num, unsigned int threads)
+{
+	int rc;
+	struct reference ref;
+	pthread_t *tids = NULL;
+	size_t i, n = 0;
+
+	memset(&ref, '\0', sizeof(ref));
+	ref.paths = paths;
+	ref.num = num;
+	ref.histogram = histogram;
+	pthread_mutex_init(&ref.lock, NULL);
+
+	if (threads > num) {
+		threads = num;
+	}
+
+	if (threads > 1 && !(tids = calloc(threads - 1, sizeof(*tids)))) {
+		rc = errno ? errno : -1;
+		error("calloc: %s", strerror(rc));
+		goto finally;
+	}
+
+	for (i = 0; i + 1 < threads; i++) {
+		if ((rc = pthread_create(&tids[i], NULL, reference_worker,
+				&ref))) {
+			error("pthread_create: %s", strerror(rc));
+			break;
+		}
+
+		n++;
+	}
+
+	reference_worker(&ref);
+
+	for (i = 0; i < n; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	rc = ref.rc;
+
+finally:
+	if (tids) {
+		free(tids);
+	}
+	pthread_mutex_destroy(&ref.lock);
+	return rc;
 }
 
 static int jpeg_filter(const char *filename, const char *extname, void *cbarg)
@@ -77,18 +261,23 @@ int timelapse(char *basename, int argc, char **argv)
 	struct pit_frac frame_rate;
 	int duration;
 	int ref_pic_index = 0;
-	struct pit_dim sz;
-	const char *ref_pic = NULL;
+	size_t ref_pic_num = 1, ref_pic_step, ncpu;
+	const char **ref_pics = NULL;
 	const char *profile;
 	struct pit_range stretch, range, fade;
 	struct filelist list;
 	struct file *item;
-	size_t total, limit, current;
-	char *tmp, *cmd, *output = DEFAULT_OUTOUT;
+	size_t total, limit, current, count;
+	unsigned int threads, sessions, seglen, radius;
+	char cache[PATH_MAX];
+	unsigned long cache_size;
+	enum i420_matrix matrix;
+	enum i420_range color_range;
+	struct avcenc_params params;
+	float quality;
+	char *tmp, *end, *cmd, *output = DEFAULT_OUTOUT;
 	char fmt[256];
 	char rgb[PATH_MAX];
-	char resized[PATH_MAX];
-	char avc[PATH_MAX];
 	int *fades = NULL;
 	struct histogram *histogram = NULL;
 	struct jpg2avc *ctx = NULL;
@@ -100,15 +289,25 @@ int timelapse(char *basename, int argc, char **argv)
 	long hour;
 	struct stat st;
 	off_t fsize;
+	double begin, elapsed;
+	struct pit_timer timer;
+	int stage;
 
 	RB_INIT(&list);
 	frame_rate.num = DEFAULT_FPS;
 	frame_rate.den = 1;
 	duration = 0;
 	profile = DEFAULT_PROFILE;
+	threads = 0;
+	sessions = 1;
+	seglen = 0;
+	radius = 0;
+	cache[0] = '\0';
+	cache_size = DEFAULT_CACHE_SIZE;
+	matrix = I420_BT601;
+	color_range = I420_LIMITED;
+	avcenc_params_init(&params);
 	rgb[0] = '\0';
-	resized[0] = '\0';
-	avc[0] = '\0';
 
 	memset(&stretch, '\0', sizeof(stretch));
 	stretch.lo.value = PIXEL_MIN;
@@ -122,7 +321,7 @@ int timelapse(char *basename, int argc, char **argv)
 
 	cmd = argv[0];
 
-	while ((c = getopt(argc, argv, "vd:o:s:f:t:F:")) != -1) {
+	while ((c = getopt(argc, argv, "vd:o:r:s:f:t:F:j:c:p:q:Q:k:l:T:Se:C:D:")) != -1) {
 		switch (c) {
 		case 'v':
 			log_level--;
@@ -139,7 +338,12 @@ int timelapse(char *basename, int argc, char **argv)
 		case 'r':
 			ref_pic_index = (int) strtol(optarg, &tmp, 10);
 
-			if (*tmp != '\0') {
+			if (*tmp == ':') {
+				ref_pic_num = strtoul(tmp + 1, &tmp, 10);
+			}
+
+			if (*tmp != '\0' || ref_pic_index < 0 ||
+					ref_pic_num < 1) {
 				rc = EINVAL;
 				murmur("Invalid index of reference picture: %s\n", optarg);
 				goto finally;
@@ -191,12 +395,131 @@ int timelapse(char *basename, int argc, char **argv)
 				goto finally;
 			}
 			break;
+		case 'j':
+			threads = (unsigned int) strtoul(optarg, &tmp, 10);
+
+			if (*tmp != '\0') {
+				rc = EINVAL;
+				murmur("Invalid number of threads: %s\n", optarg);
+				goto finally;
+			}
+			break;
+		case 'c':
+			if ((rc = i420_colorspace_parse(&matrix, &color_range,
+					optarg))) {
+				murmur("Invalid color space: %s\n", optarg);
+				goto finally;
+			}
+			break;
+		case 'p':
+			if ((rc = avcenc_params_preset(&params, optarg))) {
+				murmur("Invalid preset: %s\n", optarg);
+				goto finally;
+			}
+			break;
+		case 'q':
+		case 'Q':
+			quality = strtof(optarg, &tmp);
+
+			if (*tmp != '\0' || quality < 0 || quality > 51) {
+				rc = EINVAL;
+				murmur("Invalid %s: %s\n", c == 'q' ? "CRF" : "QP",
+						optarg);
+				goto finally;
+			}
+
+			if (c == 'Q' || params.rc != AVCENC_RC_QP) {
+				params.rc = c == 'Q' ? AVCENC_RC_QP : AVCENC_RC_CRF;
+				params.quality = quality;
+			}
+			break;
+		case 'k':
+			params.keyint = (unsigned int) strtoul(optarg, &tmp, 10);
+
+			if (*tmp != '\0') {
+				rc = EINVAL;
+				murmur("Invalid keyint: %s\n", optarg);
+				goto finally;
+			}
+			break;
+		case 'l':
+			params.lookahead = (int) strtol(optarg, &tmp, 10);
+
+			if (*tmp != '\0' || params.lookahead < 0) {
+				rc = EINVAL;
+				murmur("Invalid lookahead: %s\n", optarg);
+				goto finally;
+			}
+			break;
+		case 'T':
+			params.threads = (unsigned int) strtoul(optarg, &tmp, 10);
+
+			if (*tmp != '\0') {
+				rc = EINVAL;
+				murmur("Invalid number of threads: %s\n", optarg);
+				goto finally;
+			}
+			break;
+		case 'S':
+			params.sliced_threads = 1;
+			break;
+		case 'e':
+			sessions = (unsigned int) strtoul(optarg, &tmp, 10);
+
+			if (*tmp == ':') {
+				seglen = (unsigned int) strtoul(tmp + 1, &tmp, 10);
+			}
+
+			if (*tmp != '\0' || sessions < 1) {
+				rc = EINVAL;
+				murmur("Invalid encoder sessions: %s\n", optarg);
+				goto finally;
+			}
+			break;
+		case 'D':
+			radius = (unsigned int) strtoul(optarg, &tmp, 10);
+
+			if (*tmp != '\0' || radius > JPG2AVC_DEFLICKER_MAX) {
+				rc = EINVAL;
+				murmur("Invalid deflicker frames: %s\n", optarg);
+				goto finally;
+			}
+			break;
+		case 'C':
+			snprintf(cache, sizeof(cache), "%s", optarg);
+
+			/* a trailing ":<MB>" is the size, the rest the path */
+			if ((tmp = strrchr(cache, ':')) && tmp[1] != '\0') {
+				cache_size = strtoul(tmp + 1, &end, 10);
+
+				if (*end != '\0') {
+					rc = EINVAL;
+					murmur("Invalid cache size: %s\n", optarg);
+					goto finally;
+				}
+
+				*tmp = '\0';
+			}
+
+			if (cache[0] == '\0') {
+				rc = EINVAL;
+				murmur("Invalid cache: %s\n", optarg);
+				goto finally;
+			}
+			break;
 		default:
 			/* unrecognised option ... add your error condition */
 			break;
 		}
 	}
 
+	/* deflicker looks ahead into the one session's decoder ring */
+	if (radius > 0 && sessions > 1) {
+		rc = EINVAL;
+		murmur("Deflicker needs a single encoder session.\n");
+		goto finally;
+	}
+
 	argc -= optind;
 	argv += optind;
 
@@ -263,67 +586,79 @@ int timelapse(char *basename, int argc, char **argv)
 		goto finally;
 	}
 
-	snprintf(rgb, sizeof(rgb), "decompressed.rgb");
-	snprintf(resized, sizeof(resized), "resized.rgb");
-	snprintf(avc, sizeof(avc), "encoded.264");
-
-	if (!(ctx = jpg2avc_new(&size, &frame_rate, profile))) {
+	if (!(ctx = jpg2avc_new(&size, &frame_rate, profile, &params))) {
 		rc = errno ? errno : -1;
 		error("jpg2avc_new: %s", strerror(rc));
 		goto finally;
 	}
 
-	if (stretch.lo.unit == '%' || stretch.hi.unit == '%') {
+	if ((stretch.lo.unit == '%' || stretch.hi.unit == '%') &&
+			(size_t) ref_pic_index < total) {
+		if (!(ref_pics = calloc(ref_pic_num, sizeof(*ref_pics)))) {
+			rc = errno ? errno : -1;
+			error("calloc: %s", strerror(rc));
+			goto finally;
+		}
+
+		/* spread the reference pictures from the index to the end */
+		ref_pic_step = (total - ref_pic_index) / ref_pic_num;
+		ref_pic_step = ref_pic_step > 0 ? ref_pic_step : 1;
 		current = 0;
+		count = 0;
 
 		RB_FOREACH(item, filelist, &list) {
-			if (current == ref_pic_index) {
-				ref_pic = item->path;
+			if (count >= ref_pic_num) {
 				break;
 			}
 
+			if (current >= (size_t) ref_pic_index &&
+					(current - ref_pic_index) % ref_pic_step == 0) {
+				ref_pics[count++] = item->path;
+			}
+
 			current++;
 		}
 
-		if (ref_pic) {
-			fprintf(stdout, "Stretching by '%s' =>", ref_pic);
-
-			if (!(histogram = histogram_new(256))) {
-				rc = errno ? errno : -1;
-				error("histogram_new: %s", strerror(rc));
-				goto finally;
-			}
+		if (count > 1) {
+			fprintf(stdout, "Stretching by %d pictures from '%s' =>",
+					(int) count, ref_pics[0]);
+		} else {
+			fprintf(stdout, "Stretching by '%s' =>", ref_pics[0]);
+		}
 
-			if ((rc = jpg2rgb(ref_pic, rgb, PIXEL_MIN, PIXEL_MAX,
-					1.0, 0, &sz.width, &sz.height))) {
-				error("failed to convert '%s': %s", ref_pic,
-						strerror(rc));
-				goto finally;
-			}
+		if (!(histogram = histogram_new(256))) {
+			rc = errno ? errno : -1;
+			error("histogram_new: %s", strerror(rc));
+			goto finally;
+		}
 
-			if ((rc = histogram_load_file(histogram, rgb,
-					sz.width, sz.height))) {
-				error("failed to load histogram '%s': %s", rgb,
-						strerror(rc));
-				goto finally;
-			}
+		if ((ncpu = threads) == 0) {
+			ncpu = sysconf(_SC_NPROCESSORS_ONLN) > 0 ?
+					sysconf(_SC_NPROCESSORS_ONLN) : 1;
+		}
 
-			if (stretch.lo.unit == '%') {
-				fprintf(stdout, " %.2f%%=", stretch.lo.value);
-				stretch.lo.value = histogram_ratio_value(histogram,
-						stretch.lo.value / 100);
-				fprintf(stdout, "%d", (int) stretch.lo.value);
-			}
+		if ((rc = reference_analyse(histogram, ref_pics, count,
+				ncpu))) {
+			error("failed to analyse '%s': %s", ref_pics[0],
+					strerror(rc));
+			goto finally;
+		}
 
-			if (stretch.hi.unit == '%') {
-				fprintf(stdout, " %.2f%%=", stretch.hi.value);
-				stretch.hi.value = histogram_ratio_value(histogram,
-						stretch.hi.value / 100);
-				fprintf(stdout, "%d", (int) stretch.hi.value);
-			}
+		if (stretch.lo.unit == '%') {
+			fprintf(stdout, " %.2f%%=", stretch.lo.value);
+			stretch.lo.value = histogram_ratio_value(histogram,
+					stretch.lo.value / 100);
+			fprintf(stdout, "%d", (int) stretch.lo.value);
+		}
 
-			fprintf(stdout, "\n");
+		if (stretch.hi.unit == '%') {
+			fprintf(stdout, " %.2f%%=", stretch.hi.value);
+			stretch.hi.value = histogram_ratio_value(histogram,
+					stretch.hi.value / 100);
+			fprintf(stdout, "%d", (int) stretch.hi.value);
 		}
+
+		fprintf(stdout, "\n");
 	}
 
 	if ((rc = jpg2avc_stretch_black(ctx, (int) stretch.lo.value))) {
@@ -336,6 +671,32 @@ int timelapse(char *basename, int argc, char **argv)
 		goto finally;
 	}
 
+	if ((rc = jpg2avc_threads(ctx, threads))) {
+		error("jpg2avc_threads: %s", strerror(rc));
+		goto finally;
+	}
+
+	if (cache[0] && (rc = jpg2avc_cache(ctx, cache,
+			(off_t) cache_size << 20))) {
+		error("jpg2avc_cache: %s", strerror(rc));
+		goto finally;
+	}
+
+	if ((rc = jpg2avc_segments(ctx, sessions, seglen))) {
+		error("jpg2avc_segments: %s", strerror(rc));
+		goto finally;
+	}
+
+	if ((rc = jpg2avc_deflicker(ctx, radius))) {
+		error("jpg2avc_deflicker: %s", strerror(rc));
+		goto finally;
+	}
+
+	if ((rc = jpg2avc_colorspace(ctx, matrix, color_range))) {
+		error("jpg2avc_colorspace: %s", strerror(rc));
+		goto finally;
+	}
+
 	if ((rc = jpg2avc_begin(ctx, output))) {
 		error("jpg2avc_begin: %s", strerror(rc));
 		goto finally;
@@ -384,33 +745,35 @@ int timelapse(char *basename, int argc, char **argv)
 
 	fprintf(stdout, "\nPASS 1: %d frames\n\n", total);
 
+	begin = pit_clock();
+
 	current = 0;
+	count = 0;
 
 	RB_FOREACH(item, filelist, &list) {
-		snprintf(fmt, sizeof(fmt), "%d", total);
-		snprintf(fmt, sizeof(fmt), "%%0%dd", strlen(fmt));
-
-		fprintf(stdout, fmt, current + 1);
-		fprintf(stdout, "/%d: %s => ", total, item->path);
-
-		if ((rc = jpg2avc_transcode(ctx, item->path, rgb, resized, avc,
-				1.0, fades[current++]))) {
-			if ((rc == EINVAL)) {
-				fprintf(stdout, "Invalid JPEG or aspect ratio\n");
-				continue;
-			} else {
-				error("jpg2avc_transcode: %s", strerror(rc));
+		while ((rc = jpg2avc_submit(ctx, item->path, 1.0,
+				fades[current])) == EBUSY) {
+			if ((rc = transcode_next(ctx, &count, total))) {
 				goto finally;
 			}
 		}
 
-		fprintf(stdout, "OK\n");
+		if (rc != 0) {
+			error("jpg2avc_submit: %s", strerror(rc));
+			goto finally;
+		}
 
-		if (current >= total) {
+		if (++current >= total) {
 			break;
 		}
 	}
 
+	while (jpg2avc_queued_frames(ctx) > 0) {
+		if ((rc = transcode_next(ctx, &count, total))) {
+			goto finally;
+		}
+	}
+
 	total = jpg2avc_pending_frames(ctx);
 	current = 0;
 
@@ -425,7 +788,7 @@ int timelapse(char *basename, int argc, char **argv)
 		fprintf(stdout, fmt, current + 1);
 		fprintf(stdout, "/%d: ", total);
 
-		if ((rc = jpg2avc_flush(ctx, avc))) {
+		if ((rc = jpg2avc_flush(ctx))) {
 			if (rc != EAGAIN) {
 				error("jpg2avc_flush: %s", strerror(rc));
 				goto finally;
@@ -445,6 +808,8 @@ int timelapse(char *basename, int argc, char **argv)
 		goto finally;
 	}
 
+	elapsed = pit_clock() - begin;
+
 	if ((rc = stat(output, &st))) {
 		rc = errno ? errno : -1;
 		error("stat: %s", strerror(rc));
@@ -475,12 +840,30 @@ int timelapse(char *basename, int argc, char **argv)
 	fprintf(stdout, "Average Bit Rate: %.2f Mbps\n",
 			(float) fsize * 8 / jpg2avc_count(ctx) /
 			frame_rate.den * frame_rate.num / 1000000);
+	fprintf(stdout, "Elapsed: %.2f seconds / %.2f frames per second\n",
+			elapsed, elapsed > 0 ? jpg2avc_count(ctx) / elapsed : 0);
+
+	fprintf(stdout, "\n%-10s %10s %10s\n", "Stage", "Wall (s)", "CPU (s)");
+
+	for (stage = 0; stage < JPG2AVC_STAGES; stage++) {
+		if (jpg2avc_stage_time(ctx, stage, &timer)) {
+			continue;
+		}
+
+		fprintf(stdout, "%-10s %10.3f %10.3f\n",
+				jpg2avc_stage_name(stage), timer.wall, timer.cpu);
+	}
+
+	fprintf(stdout, "(header to convert are summed over decoder threads)\n");
 	rc = 0;
 
 finally:
 	if (histogram) {
 		histogram_free(histogram);
 	}
+	if (ref_pics) {
+		free(ref_pics);
+	}
 	if (fades) {
 		free(fades);
 	}
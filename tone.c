@@ -0,0 +1,175 @@
+// $Id$
+/*
+ * Copyright 2013 Cedric Shih (cedric dot shih at gmail dot com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define TONE_AVX2
+#define TONE_VBMI
+#include <immintrin.h>
+#endif
+
+#include "tone.h"
+
+typedef void (*tone_fn)(const unsigned char *lut, unsigned char *buf,
+		size_t len);
+
+static unsigned char clamp(int c)
+{
+	if (c < 0) {
+		return 0;
+	} else if (c > 255) {
+		return 255;
+	} else {
+		return (unsigned char) c;
+	}
+}
+
+void tone_build(unsigned char *lut, int black, int white, double a, int b)
+{
+	int v, c;
+
+	for (v = 0; v < TONE_SIZE; v++) {
+		c = v;
+
+		if (black > 0 && white < 255) {
+			c = clamp((c - black) * 255 / (white - black));
+		}
+
+		if (a != 1.0) {
+			c = clamp(a * c);
+		}
+
+		if (b != 0) {
+			c = clamp(b + c);
+		}
+
+		lut[v] = c;
+	}
+}
+
+int tone_identity(const unsigned char *lut)
+{
+	int v;
+
+	for (v = 0; v < TONE_SIZE; v++) {
+		if (lut[v] != v) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void apply_c(const unsigned char *lut, unsigned char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = lut[buf[i]];
+	}
+}
+
+#ifdef TONE_AVX2
+/*
+ * Sixteen 16-entry shuffles, one per high nibble; subtracting 16 per step
+ * brings the matching bytes to 0..15 and the saturating add of 0x70 sets
+ * bit 7 of every other byte so that the shuffle zeroes it.
+ */
+__attribute__((target("avx2")))
+static void apply_avx2(const unsigned char *lut, unsigned char *buf,
+		size_t len)
+{
+	size_t i;
+	int j;
+	__m256i t[16], x, y, k;
+	const __m256i step = _mm256_set1_epi8(0x10);
+	const __m256i bias = _mm256_set1_epi8(0x70);
+
+	for (j = 0; j < 16; j++) {
+		t[j] = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+				(const __m128i *) (lut + j * 16)));
+	}
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		x = _mm256_loadu_si256((const __m256i *) (buf + i));
+		y = _mm256_setzero_si256();
+
+		for (j = 0; j < 16; j++) {
+			k = _mm256_adds_epu8(x, bias);
+			y = _mm256_or_si256(y, _mm256_shuffle_epi8(t[j], k));
+			x = _mm256_sub_epi8(x, step);
+		}
+
+		_mm256_storeu_si256((__m256i *) (buf + i), y);
+	}
+
+	apply_c(lut, buf + i, len - i);
+}
+#endif
+
+#ifdef TONE_VBMI
+/* two 128-entry byte permutes, picked between by bit 7 of each byte */
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+static void apply_vbmi(const unsigned char *lut, unsigned char *buf,
+		size_t len)
+{
+	size_t i;
+	__m512i t0, t1, t2, t3, x, lo, hi;
+	__mmask64 m;
+
+	t0 = _mm512_loadu_si512(lut);
+	t1 = _mm512_loadu_si512(lut + 64);
+	t2 = _mm512_loadu_si512(lut + 128);
+	t3 = _mm512_loadu_si512(lut + 192);
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		x = _mm512_loadu_si512(buf + i);
+		lo = _mm512_permutex2var_epi8(t0, x, t1);
+		hi = _mm512_permutex2var_epi8(t2, x, t3);
+		m = _mm512_movepi8_mask(x);
+		_mm512_storeu_si512(buf + i, _mm512_mask_blend_epi8(m, lo, hi));
+	}
+
+	apply_c(lut, buf + i, len - i);
+}
+#endif
+
+static tone_fn tone_apply_fn = apply_c;
+static pthread_once_t tone_once = PTHREAD_ONCE_INIT;
+
+static void tone_init(void)
+{
+#ifdef TONE_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+		tone_apply_fn = apply_avx2;
+	}
+#endif
+#ifdef TONE_VBMI
+	if (__builtin_cpu_supports("avx512vbmi") &&
+			__builtin_cpu_supports("avx512bw")) {
+		tone_apply_fn = apply_vbmi;
+	}
+#endif
+}
+
+void tone_apply(const unsigned char *lut, unsigned char *buf, size_t len)
+{
+	pthread_once(&tone_once, tone_init);
+	(*tone_apply_fn)(lut, buf, len);
+}
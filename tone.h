@@ -0,0 +1,37 @@
+// $Id$
+/*
+ * Copyright 2013 Cedric Shih (cedric dot shih at gmail dot com)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TONE_H_
+#define TONE_H_
+
+#include <sys/types.h>
+
+#define TONE_SIZE 256
+
+/*
+ * Composes, in this order, the stretch of black..white to 0..255 (only
+ * when both points move), the gain a and the bias b into one table.
+ */
+void tone_build(unsigned char *lut, int black, int white, double a, int b);
+
+/* whether lut maps every value to itself */
+int tone_identity(const unsigned char *lut);
+
+/* buf[i] = lut[buf[i]] for every byte */
+void tone_apply(const unsigned char *lut, unsigned char *buf, size_t len);
+
+#endif /* TONE_H_ */